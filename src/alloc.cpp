@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <mutex>
+
+#include "alloc.hpp"
+#include "bitmap.hpp"
+
+/*
+    Longest run of clear bits starting in [start, end), a run starting before end still
+    counts everything up to nbits. Stops looking once one reaches len
+*/
+static BlockRun longest_zero_run(const uint8_t *bitmap, uint32_t nbits, uint32_t start, uint32_t end, uint32_t len)
+{
+    BlockRun best = {0, 0};
+
+    while (start < end)
+    {
+        int64_t zero = find_first_zero(bitmap, end, start);
+        if (zero < 0)
+            break;
+
+        uint32_t one = find_first_one(bitmap, nbits, zero);
+        if (one - zero > best.len)
+        {
+            best.start = zero;
+            best.len = one - zero;
+            if (best.len >= len)
+                break;
+        }
+
+        start = one;
+    }
+
+    return best;
+}
+
+/*
+    Best run within one group's bitmap: the first full length run from goal_bit on (which
+    is the one starting at goal_bit itself if that's free), else the first before it, else
+    the longest there is
+*/
+static BlockRun search_group(const uint8_t *bitmap, uint32_t nbits, uint32_t goal_bit, uint32_t len)
+{
+    BlockRun after = longest_zero_run(bitmap, nbits, goal_bit, nbits, len);
+    if (after.len >= len || goal_bit == 0)
+        return after;
+
+    // a run straddling goal_bit is measured whole, not cut off where the search started
+    BlockRun before = longest_zero_run(bitmap, nbits, 0, goal_bit, len);
+    return before.len > after.len ? before : after;
+}
+
+tl::expected<BlockRun, std::string> alloc_blocks(Filesystem &fs, uint64_t goal, uint32_t len)
+{
+    if (len == 0)
+        return tl::make_unexpected("Can't allocate an empty run of blocks");
+
+    uint32_t groups = fs.num_groups();
+
+    uint32_t goal_group = 0;
+    uint32_t goal_bit = 0;
+    if (goal >= fs.sb.blocks_reserved && goal < fs.sb.num_blocks)
+    {
+        goal_group = fs.block_group(goal);
+        goal_bit = goal - fs.group_start(goal_group);
+    }
+
+    std::lock_guard<std::mutex> lock(fs.meta_mtx);
+
+    BlockRun best = {0, 0};
+    uint32_t best_group = 0;
+
+    // goal's group, then its neighbours on either side working outwards
+    for (uint32_t distance = 0; distance < groups && best.len < len; distance++)
+    {
+        for (int side = 0; side < 2 && best.len < len; side++)
+        {
+            if (side == 1 && distance == 0)
+                break;
+
+            int64_t group = side == 0 ? (int64_t)goal_group + distance : (int64_t)goal_group - distance;
+            if (group < 0 || group >= groups)
+                continue;
+
+            // a group with no more free blocks than we already have can't do better
+            BlockGroupDescriptor &bgd = fs.descriptors[group];
+            if (bgd.free_blocks <= best.len)
+                continue;
+
+            auto bitmap = fs.cache->get(bgd.block_bitmap_addr);
+            if (!bitmap)
+                return tl::make_unexpected(bitmap.error());
+
+            BlockRun run = search_group((const uint8_t *)bitmap->data(), fs.blocks_in_group(group),
+                                        group == goal_group ? goal_bit : 0, len);
+            if (run.len > best.len)
+            {
+                best = run;
+                best_group = group;
+            }
+        }
+    }
+
+    if (best.len == 0)
+        return tl::make_unexpected("No free blocks left");
+
+    best.len = std::min(best.len, len);
+
+    BlockGroupDescriptor &bgd = fs.descriptors[best_group];
+
+    auto bitmap = fs.cache->get(bgd.block_bitmap_addr);
+    if (!bitmap)
+        return tl::make_unexpected(bitmap.error());
+
+    {
+        auto guard = bitmap->lock();
+        set_bits((uint8_t *)bitmap->data(), best.start, best.len);
+        bitmap->mark_dirty();
+    }
+
+    bgd.free_blocks -= best.len;
+    fs.sb.num_free_blocks -= best.len;
+
+    best.start += fs.group_start(best_group);
+    return best;
+}
+
+tl::expected<uint32_t, std::string> alloc_block(Filesystem &fs, uint64_t goal)
+{
+    return alloc_blocks(fs, goal, 1).map([](const BlockRun &run)
+                                         { return (uint32_t)run.start; });
+}
+
+tl::expected<monostate, std::string> free_blocks(Filesystem &fs, uint64_t start, uint32_t count)
+{
+    if (start < fs.sb.blocks_reserved || start + count > fs.sb.num_blocks)
+        return tl::make_unexpected("Freeing blocks outside the data area");
+
+    std::lock_guard<std::mutex> lock(fs.meta_mtx);
+
+    while (count > 0)
+    {
+        uint32_t group = fs.block_group(start);
+        uint32_t bit = start - fs.group_start(group);
+        uint32_t run = std::min(count, fs.blocks_in_group(group) - bit);
+
+        BlockGroupDescriptor &bgd = fs.descriptors[group];
+
+        auto bitmap = fs.cache->get(bgd.block_bitmap_addr);
+        if (!bitmap)
+            return tl::make_unexpected(bitmap.error());
+
+        uint8_t *bits = (uint8_t *)bitmap->data();
+        if (find_first_zero(bits, bit + run, bit) >= 0)
+            return tl::make_unexpected("Freeing a block that is already free");
+
+        {
+            auto guard = bitmap->lock();
+            clear_bits(bits, bit, run);
+            bitmap->mark_dirty();
+        }
+
+        bgd.free_blocks += run;
+        fs.sb.num_free_blocks += run;
+
+        // a stale copy written back (or replayed from the journal) after the block is handed out
+        // again would clobber its new contents
+        for (uint64_t b = start; b < start + run; b++)
+        {
+            if (fs.journal)
+                fs.journal->revoke(b);
+            fs.cache->forget(b);
+        }
+
+        start += run;
+        count -= run;
+    }
+
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> BlockReleaser::add(uint64_t start, uint32_t count)
+{
+    if (pending.len > 0 && pending.start + pending.len == start && pending.len + (uint64_t)count <= UINT32_MAX)
+    {
+        pending.len += count;
+        return monostate{};
+    }
+
+    auto freed = flush();
+    pending = BlockRun{start, count};
+    return freed;
+}
+
+tl::expected<monostate, std::string> BlockReleaser::flush()
+{
+    if (pending.len == 0)
+        return monostate{};
+
+    BlockRun run = pending;
+    pending = BlockRun{0, 0};
+    return free_blocks(fs, run.start, run.len);
+}
+
+tl::expected<uint32_t, std::string> alloc_inode(Filesystem &fs, uint32_t goal_group, FileType type)
+{
+    uint32_t groups = fs.num_groups();
+    uint32_t ipg = fs.sb.inodes_per_group;
+
+    std::lock_guard<std::mutex> lock(fs.meta_mtx);
+
+    if (goal_group >= groups)
+        goal_group = 0;
+
+    if (type == FileType::Directory)
+    {
+        // spread directories out so their files have room to grow next to them
+        for (uint32_t group = 0; group < groups; group++)
+        {
+            if (fs.descriptors[group].free_inodes > fs.descriptors[goal_group].free_inodes)
+                goal_group = group;
+        }
+    }
+
+    for (uint32_t i = 0; i < groups; i++)
+    {
+        uint32_t group = (goal_group + i) % groups;
+        BlockGroupDescriptor &bgd = fs.descriptors[group];
+        if (bgd.free_inodes == 0)
+            continue;
+
+        auto bitmap = fs.cache->get(bgd.inode_bitmap_addr);
+        if (!bitmap)
+            return tl::make_unexpected(bitmap.error());
+
+        uint8_t *bits = (uint8_t *)bitmap->data();
+        int64_t index = find_first_zero(bits, ipg, 0);
+        if (index < 0)
+            continue;
+
+        // any of the inode table that gets zeroed happens behind the cache's back
+        if (bgd.flags & BG_INODE_UNINIT)
+        {
+            uint32_t per_block = fs.block_size() / sizeof(Inode);
+            for (uint32_t b = (ipg - bgd.itable_unused) / per_block; b <= index / per_block; b++)
+                fs.cache->forget(bgd.inode_table + b);
+        }
+
+        auto reserved = reserve_inode(fs.dev, fs.sb, bgd, index);
+        if (!reserved)
+            return tl::make_unexpected(reserved.error());
+
+        {
+            auto guard = bitmap->lock();
+            set_bits(bits, index, 1);
+            bitmap->mark_dirty();
+        }
+
+        bgd.free_inodes--;
+        fs.sb.num_free_inodes--;
+        if (type == FileType::Directory)
+            bgd.num_dirs++;
+
+        return group * ipg + index + 1;
+    }
+
+    return tl::make_unexpected("No free inodes left");
+}
+
+tl::expected<monostate, std::string> free_inode(Filesystem &fs, uint32_t ino, FileType type)
+{
+    if (ino == 0 || ino > fs.sb.num_inodes)
+        return tl::make_unexpected("Freeing an inode that doesn't exist");
+
+    uint32_t group = (ino - 1) / fs.sb.inodes_per_group;
+    uint32_t index = (ino - 1) % fs.sb.inodes_per_group;
+
+    std::lock_guard<std::mutex> lock(fs.meta_mtx);
+
+    BlockGroupDescriptor &bgd = fs.descriptors[group];
+
+    auto bitmap = fs.cache->get(bgd.inode_bitmap_addr);
+    if (!bitmap)
+        return tl::make_unexpected(bitmap.error());
+
+    uint8_t *bits = (uint8_t *)bitmap->data();
+    if (!test_bit(bits, index))
+        return tl::make_unexpected("Freeing an inode that is already free");
+
+    {
+        auto guard = bitmap->lock();
+        clear_bits(bits, index, 1);
+        bitmap->mark_dirty();
+    }
+
+    bgd.free_inodes++;
+    fs.sb.num_free_inodes++;
+    if (type == FileType::Directory)
+        bgd.num_dirs--;
+
+    return monostate{};
+}
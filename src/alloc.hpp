@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "expected.hpp"
+#include "filesystem.hpp"
+#include "fs.hpp"
+#include "monostate.hpp"
+
+/*
+    Block and inode allocation out of the per-group bitmaps
+
+    Bitmaps are read and updated through the block cache, free counts in the
+    descriptors and superblock are kept in step in memory and reach the image
+    on the next Filesystem::sync
+*/
+
+// A run of contiguous blocks
+struct BlockRun
+{
+    uint64_t start;
+    uint32_t len;
+};
+
+/*
+    Allocates up to len contiguous blocks as close to goal as it can. Prefers a run
+    starting right at goal (so a file being appended to stays in one piece), then the
+    first run of the full length after goal in goal's group, then before it, then in
+    the groups either side of it working outwards. If no run is long enough anywhere the longest one found
+    is handed out instead, so the returned run can be shorter than len but is never empty.
+    Pass 0 as goal when there's no preference
+*/
+tl::expected<BlockRun, std::string> alloc_blocks(Filesystem &fs, uint64_t goal, uint32_t len);
+
+// Allocates a single block, see alloc_blocks
+tl::expected<uint32_t, std::string> alloc_block(Filesystem &fs, uint64_t goal);
+
+/*
+    Returns count blocks starting at start to the free pool, they may span groups.
+    Unpinned cached copies of them are dropped without being written back
+*/
+tl::expected<monostate, std::string> free_blocks(Filesystem &fs, uint64_t start, uint32_t count);
+
+/*
+    Gathers blocks being freed one or a few at a time, like when a file's mapping is
+    torn down, and frees them a contiguous run at a time. Whatever is still pending
+    when it's dropped is lost, call flush at the end. Blocks added mustn't be pinned
+    by then
+*/
+class BlockReleaser
+{
+public:
+    explicit BlockReleaser(Filesystem &fs) : fs(fs) {}
+
+    tl::expected<monostate, std::string> add(uint64_t start, uint32_t count);
+    tl::expected<monostate, std::string> flush();
+
+private:
+    Filesystem &fs;
+    BlockRun pending = {0, 0};
+};
+
+/*
+    Allocates an inode and returns its (1-based) number. Files go in goal_group if it
+    has room so they sit near their directory, directories are spread out into the
+    group with the most free inodes
+*/
+tl::expected<uint32_t, std::string> alloc_inode(Filesystem &fs, uint32_t goal_group, FileType type);
+
+tl::expected<monostate, std::string> free_inode(Filesystem &fs, uint32_t ino, FileType type);
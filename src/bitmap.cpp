@@ -0,0 +1,219 @@
+#include <cstring>
+
+#include <immintrin.h>
+
+#include "bitmap.hpp"
+
+// Each kernel returns the index of the first byte in [0, len) that isn't value, or len
+
+static size_t skip_bytes_scalar(const uint8_t *p, size_t len, uint8_t value)
+{
+    size_t i = 0;
+    uint64_t pattern = 0x0101010101010101ull * value;
+
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, p + i, sizeof(word));
+        if (word != pattern)
+            break;
+    }
+
+    for (; i < len; i++)
+    {
+        if (p[i] != value)
+            return i;
+    }
+    return len;
+}
+
+__attribute__((target("sse4.1"))) static size_t skip_bytes_sse41(const uint8_t *p, size_t len, uint8_t value)
+{
+    size_t i = 0;
+    __m128i pattern = _mm_set1_epi8((char)value);
+    __m128i ones = _mm_set1_epi8((char)0xFF);
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i eq = _mm_cmpeq_epi8(v, pattern);
+
+        // ptest: carry is set only when every byte matched
+        if (!_mm_testc_si128(eq, ones))
+        {
+            unsigned mask = ~_mm_movemask_epi8(eq) & 0xFFFF;
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + skip_bytes_scalar(p + i, len - i, value);
+}
+
+__attribute__((target("avx2"))) static size_t skip_bytes_avx2(const uint8_t *p, size_t len, uint8_t value)
+{
+    size_t i = 0;
+    __m256i pattern = _mm256_set1_epi8((char)value);
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + skip_bytes_scalar(p + i, len - i, value);
+}
+
+typedef size_t (*SkipBytes)(const uint8_t *, size_t, uint8_t);
+
+struct Kernel
+{
+    SkipBytes skip;
+    const char *name;
+};
+
+static Kernel pick_kernel()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return Kernel{skip_bytes_avx2, "avx2"};
+    if (__builtin_cpu_supports("sse4.1"))
+        return Kernel{skip_bytes_sse41, "sse4.1"};
+    return Kernel{skip_bytes_scalar, "scalar"};
+}
+
+static const Kernel &kernel()
+{
+    static const Kernel k = pick_kernel();
+    return k;
+}
+
+const char *bitmap_kernel()
+{
+    return kernel().name;
+}
+
+/*
+    Shared search for find_first_zero/find_first_one, want is the bit value being
+    looked for. Returns nbits if there's no match
+*/
+static uint32_t find_bit(const uint8_t *bitmap, uint32_t nbits, uint32_t start, bool want)
+{
+    if (start >= nbits)
+        return nbits;
+
+    // flipping every byte turns a search for a clear bit into one for a set bit
+    uint8_t flip = want ? 0x00 : 0xFF;
+    uint32_t byte = start / 8;
+
+    // partial first byte
+    if (start % 8)
+    {
+        uint8_t bits = (bitmap[byte] ^ flip) & (0xFF << (start % 8));
+        if (bits)
+        {
+            uint32_t idx = byte * 8 + __builtin_ctz(bits);
+            return idx < nbits ? idx : nbits;
+        }
+        byte++;
+    }
+
+    uint32_t nbytes = (nbits + 7) / 8;
+    if (byte >= nbytes)
+        return nbits;
+
+    // whole bytes with nothing of interest in them are skipped by the vector kernel
+    uint32_t found = byte + kernel().skip(bitmap + byte, nbytes - byte, flip);
+    if (found == nbytes)
+        return nbits;
+
+    uint32_t idx = found * 8 + __builtin_ctz((uint8_t)(bitmap[found] ^ flip));
+    return idx < nbits ? idx : nbits;
+}
+
+int64_t find_first_zero(const uint8_t *bitmap, uint32_t nbits, uint32_t start)
+{
+    uint32_t idx = find_bit(bitmap, nbits, start, false);
+    return idx < nbits ? (int64_t)idx : -1;
+}
+
+uint32_t find_first_one(const uint8_t *bitmap, uint32_t nbits, uint32_t start)
+{
+    return find_bit(bitmap, nbits, start, true);
+}
+
+int64_t find_zero_run(const uint8_t *bitmap, uint32_t nbits, uint32_t start, uint32_t len)
+{
+    while (start < nbits)
+    {
+        int64_t zero = find_first_zero(bitmap, nbits, start);
+        if (zero < 0)
+            return -1;
+
+        uint32_t one = find_first_one(bitmap, nbits, zero);
+        if (one - zero >= len)
+            return zero;
+
+        start = one;
+    }
+
+    return -1;
+}
+
+uint32_t count_ones(const uint8_t *bitmap, uint32_t nbits)
+{
+    uint32_t count = 0;
+    uint32_t i = 0;
+
+    for (; i + 64 <= nbits; i += 64)
+    {
+        uint64_t word;
+        std::memcpy(&word, bitmap + i / 8, sizeof(word));
+        count += __builtin_popcountll(word);
+    }
+
+    for (; i < nbits; i++)
+        count += test_bit(bitmap, i);
+
+    return count;
+}
+
+bool test_bit(const uint8_t *bitmap, uint32_t bit)
+{
+    return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+void set_bits(uint8_t *bitmap, uint32_t start, uint32_t count)
+{
+    uint32_t end = start + count;
+
+    for (; start < end && start % 8; start++)
+        bitmap[start / 8] |= 1 << (start % 8);
+
+    if (end - start >= 8)
+    {
+        std::memset(bitmap + start / 8, 0xFF, (end - start) / 8);
+        start += (end - start) / 8 * 8;
+    }
+
+    for (; start < end; start++)
+        bitmap[start / 8] |= 1 << (start % 8);
+}
+
+void clear_bits(uint8_t *bitmap, uint32_t start, uint32_t count)
+{
+    uint32_t end = start + count;
+
+    for (; start < end && start % 8; start++)
+        bitmap[start / 8] &= ~(1 << (start % 8));
+
+    if (end - start >= 8)
+    {
+        std::memset(bitmap + start / 8, 0x00, (end - start) / 8);
+        start += (end - start) / 8 * 8;
+    }
+
+    for (; start < end; start++)
+        bitmap[start / 8] &= ~(1 << (start % 8));
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+    Bit scanning over the block and inode bitmaps
+
+    The searches skip over runs of bytes that can't contain a match (all set when
+    looking for a free bit, all clear when looking for a used one) with the widest
+    kernel the CPU has: AVX2 (32 bytes at a time), SSE4.1 (16 bytes) or a scalar
+    fallback working on 64-bit words. The kernel is picked once at runtime, so the
+    binary doesn't need to be built for a particular CPU
+
+    Bit i lives in byte i / 8 at position i % 8, same as ext2
+*/
+
+// Index of the first clear bit in [start, nbits), or -1 if they're all set
+int64_t find_first_zero(const uint8_t *bitmap, uint32_t nbits, uint32_t start);
+
+// Index of the first set bit in [start, nbits), or nbits if they're all clear
+uint32_t find_first_one(const uint8_t *bitmap, uint32_t nbits, uint32_t start);
+
+// Start of the first run of at least len clear bits in [start, nbits), or -1 if there isn't one
+int64_t find_zero_run(const uint8_t *bitmap, uint32_t nbits, uint32_t start, uint32_t len);
+
+// Number of set bits in [0, nbits)
+uint32_t count_ones(const uint8_t *bitmap, uint32_t nbits);
+
+bool test_bit(const uint8_t *bitmap, uint32_t bit);
+void set_bits(uint8_t *bitmap, uint32_t start, uint32_t count);
+void clear_bits(uint8_t *bitmap, uint32_t start, uint32_t count);
+
+// Name of the scanning kernel picked for this CPU, "avx2", "sse4.1" or "scalar"
+const char *bitmap_kernel();
@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block_device.hpp"
+
+static std::string error_string(const std::string &what)
+{
+    return what + ": " + std::strerror(errno);
+}
+
+tl::expected<IOBackend, std::string> parse_backend(const std::string &name)
+{
+    if (name == "pread")
+        return IOBackend::Pread;
+    if (name == "mmap")
+        return IOBackend::Mmap;
+    if (name == "uring")
+        return IOBackend::Uring;
+
+    return tl::make_unexpected("Unknown I/O backend '" + name + "', expected pread, mmap or uring");
+}
+
+BlockDevice::~BlockDevice()
+{
+    close();
+}
+
+tl::expected<monostate, std::string> BlockDevice::open(const std::string &path, uint32_t block_size, bool create,
+                                                       IOBackend backend)
+{
+    close();
+
+    int flags = O_RDWR;
+    if (create)
+        flags |= O_CREAT | O_TRUNC;
+
+    fd = ::open(path.c_str(), flags, 0644);
+    if (fd < 0)
+        return tl::make_unexpected(error_string("Unable to open " + path));
+
+    bsize = block_size;
+
+    // an image that already has storage behind every byte was preallocated, keep it that way
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return tl::make_unexpected(error_string("Unable to stat " + path));
+
+    sparse = st.st_size == 0 || (uint64_t)st.st_blocks * 512 < (uint64_t)st.st_size;
+
+    io = backend;
+    if (io == IOBackend::Mmap)
+        return remap(st.st_size);
+
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> BlockDevice::remap(uint64_t size)
+{
+    if (map)
+    {
+        munmap(map, map_len);
+        map = nullptr;
+        map_len = 0;
+    }
+
+    // nothing to map yet, accesses go through pread/pwrite until the image has a size
+    if (size == 0)
+        return monostate{};
+
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return tl::make_unexpected(error_string("Unable to map image"));
+
+    map = (char *)addr;
+    map_len = size;
+    return monostate{};
+}
+
+char *BlockDevice::data(uint64_t offset, size_t len) const
+{
+    if (!map || offset + len > map_len)
+        return nullptr;
+
+    return map + offset;
+}
+
+void BlockDevice::advise(Access access, uint64_t offset, uint64_t len)
+{
+    if (map)
+    {
+        static const int madvice[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED};
+
+        if (len == 0 || offset + len > map_len)
+            len = offset < map_len ? map_len - offset : 0;
+
+        // madvise wants a page aligned start
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t start = offset / page * page;
+        if (len > 0)
+            madvise(map + start, len + (offset - start), madvice[(int)access]);
+    }
+    else
+    {
+        static const int fadvice[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM,
+                                      POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED};
+
+        posix_fadvise(fd, offset, len, fadvice[(int)access]);
+    }
+}
+
+void BlockDevice::close()
+{
+    if (map)
+    {
+        munmap(map, map_len);
+        map = nullptr;
+        map_len = 0;
+    }
+
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+tl::expected<uint64_t, std::string> BlockDevice::size() const
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return tl::make_unexpected(error_string("Unable to stat image"));
+
+    return (uint64_t)st.st_size;
+}
+
+tl::expected<monostate, std::string> BlockDevice::resize(uint64_t size)
+{
+    if (ftruncate(fd, size) < 0)
+        return tl::make_unexpected(error_string("Unable to resize image"));
+
+    if (io == IOBackend::Mmap)
+        return remap(size);
+
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> BlockDevice::preallocate(uint64_t offset, uint64_t len)
+{
+    // posix_fallocate emulates by writing zeroes on filesystems without fallocate support
+    int err = posix_fallocate(fd, offset, len);
+    if (err != 0)
+    {
+        errno = err;
+        return tl::make_unexpected(error_string("Unable to preallocate image"));
+    }
+
+    sparse = false;
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> BlockDevice::zero_range(uint64_t offset, uint64_t len)
+{
+    int mode = sparse ? FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE : FALLOC_FL_ZERO_RANGE;
+    if (fallocate(fd, mode, offset, len) == 0)
+        return monostate{};
+
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+        return tl::make_unexpected(error_string("Unable to zero range"));
+
+    // no fallocate support underneath, fall back to writing the zeroes out
+    std::vector<char> zeroes(std::min<uint64_t>(len, 1 << 20), 0);
+    while (len > 0)
+    {
+        size_t chunk = std::min<uint64_t>(len, zeroes.size());
+        auto written = write(offset, zeroes.data(), chunk);
+        if (!written)
+            return written;
+
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> BlockDevice::read_block(uint64_t block, void *buf) const
+{
+    return read(block * bsize, buf, bsize);
+}
+
+tl::expected<monostate, std::string> BlockDevice::write_block(uint64_t block, const void *buf)
+{
+    return write(block * bsize, buf, bsize);
+}
+
+tl::expected<monostate, std::string> BlockDevice::read(uint64_t offset, void *buf, size_t len) const
+{
+    char *dst = (char *)buf;
+
+    const char *src = data(offset, len);
+    if (src)
+    {
+        std::memcpy(dst, src, len);
+        return monostate{};
+    }
+
+    // pread can return short counts, so keep going until everything is in
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, dst, len, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return tl::make_unexpected(error_string("Read failed"));
+        }
+        if (n == 0)
+            return tl::make_unexpected("Read past end of image");
+
+        dst += n;
+        len -= n;
+        offset += n;
+    }
+
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> BlockDevice::write(uint64_t offset, const void *buf, size_t len)
+{
+    const char *src = (const char *)buf;
+
+    // anything outside the mapping (the image grew behind our back) still goes through pwrite
+    char *dst = data(offset, len);
+    if (dst)
+    {
+        std::memcpy(dst, src, len);
+        return monostate{};
+    }
+
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, src, len, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return tl::make_unexpected(error_string("Write failed"));
+        }
+
+        src += n;
+        len -= n;
+        offset += n;
+    }
+
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> BlockDevice::sync()
+{
+    if (map && msync(map, map_len, MS_SYNC) < 0)
+        return tl::make_unexpected(error_string("Sync failed"));
+
+    if (fsync(fd) < 0)
+        return tl::make_unexpected(error_string("Sync failed"));
+
+    return monostate{};
+}
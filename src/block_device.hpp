@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "expected.hpp"
+#include "monostate.hpp"
+
+/*
+    How the block device moves data to and from the image
+*/
+enum class IOBackend
+{
+    // pread/pwrite on the file descriptor
+    Pread,
+    // whole image mapped into memory, reads and writes are memcpys and
+    // structures can be accessed in place through data()
+    Mmap,
+    // single reads/writes are pread/pwrite, batches queued on an IOQueue
+    // go through io_uring
+    Uring
+};
+
+tl::expected<IOBackend, std::string> parse_backend(const std::string &name);
+
+/*
+    Access pattern hints, passed on as madvise/posix_fadvise
+*/
+enum class Access
+{
+    Normal,
+    Sequential,
+    Random,
+    WillNeed,
+    DontNeed
+};
+
+/*
+    Long lived handle to the filesystem image
+
+    Everything that touches the image (mkfs, the on-disk structures and anything
+    reading the filesystem back) shares one of these, so the file is opened once
+    and every access is a single positional read or write rather than an
+    open/seek/write/close round trip through an fstream
+
+    The backend is picked at open, everything above the device is the same either way
+*/
+class BlockDevice
+{
+public:
+    BlockDevice() = default;
+    ~BlockDevice();
+
+    BlockDevice(const BlockDevice &) = delete;
+    BlockDevice &operator=(const BlockDevice &) = delete;
+
+    /*
+        Opens the image at path, if create is set the file is created (or truncated)
+
+        block_size can be changed later with set_block_size, which is needed when the
+        block size is only known after reading the superblock
+    */
+    tl::expected<monostate, std::string> open(const std::string &path, uint32_t block_size, bool create = false,
+                                              IOBackend backend = IOBackend::Pread);
+    void close();
+    bool is_open() const { return fd >= 0; }
+
+    IOBackend backend() const { return io; }
+    int native_handle() const { return fd; }
+
+    /*
+        Pointer straight into the mapped image for zero-copy access, or nullptr when
+        the range isn't mapped (Pread backend, or past the end of the mapping)
+    */
+    char *data(uint64_t offset, size_t len) const;
+
+    // Hint how a range (or the whole image when len is 0) is about to be accessed
+    void advise(Access access, uint64_t offset = 0, uint64_t len = 0);
+
+    uint32_t block_size() const { return bsize; }
+    void set_block_size(uint32_t block_size) { bsize = block_size; }
+
+    // Size of the image in bytes
+    tl::expected<uint64_t, std::string> size() const;
+
+    // Grows or shrinks the image, anything new is a hole that reads back as zeroes
+    tl::expected<monostate, std::string> resize(uint64_t size);
+
+    // Allocates backing storage for the whole range up front, the image stops being sparse
+    tl::expected<monostate, std::string> preallocate(uint64_t offset, uint64_t len);
+
+    /*
+        Makes the range read back as zeroes without writing them, on a sparse image
+        the range is punched out into a hole, on a fully allocated one it stays allocated
+    */
+    tl::expected<monostate, std::string> zero_range(uint64_t offset, uint64_t len);
+
+    // Whether zeroed ranges get punched into holes, detected from the image when opened
+    bool is_sparse() const { return sparse; }
+
+    // Read/write whole blocks addressed by block number
+    tl::expected<monostate, std::string> read_block(uint64_t block, void *buf) const;
+    tl::expected<monostate, std::string> write_block(uint64_t block, const void *buf);
+
+    // Read/write arbitrary byte ranges addressed by byte offset
+    tl::expected<monostate, std::string> read(uint64_t offset, void *buf, size_t len) const;
+    tl::expected<monostate, std::string> write(uint64_t offset, const void *buf, size_t len);
+
+    // Flushes everything written so far to disk, msyncing the mapping first if there is one
+    tl::expected<monostate, std::string> sync();
+
+private:
+    tl::expected<monostate, std::string> remap(uint64_t size);
+
+    int fd = -1;
+    uint32_t bsize = 0;
+    bool sparse = true;
+
+    IOBackend io = IOBackend::Pread;
+    char *map = nullptr;
+    uint64_t map_len = 0;
+};
+
+/*
+    In-memory stand-in for an fstream so the WRITE and READ macros can (de)serialize
+    structures field by field through a buffer that moves to and from the block
+    device in one go
+*/
+struct ByteBuffer
+{
+    std::vector<char> data;
+    size_t pos = 0;
+
+    explicit ByteBuffer(size_t size) : data(size, 0) {}
+
+    void seekp(size_t off) { pos = off; }
+    void seekg(size_t off) { pos = off; }
+
+    void write(const char *src, size_t len)
+    {
+        if (pos + len > data.size())
+            data.resize(pos + len, 0);
+
+        std::copy(src, src + len, data.begin() + pos);
+        pos += len;
+    }
+
+    void read(char *dst, size_t len)
+    {
+        std::copy(data.begin() + pos, data.begin() + pos + len, dst);
+        pos += len;
+    }
+
+    const char *bytes() const { return data.data(); }
+    size_t size() const { return data.size(); }
+};
@@ -0,0 +1,954 @@
+#include <algorithm>
+
+#include "cache.hpp"
+
+BufferRef &BufferRef::operator=(BufferRef &&other)
+{
+    if (this != &other)
+    {
+        reset();
+        cache = other.cache;
+        buf = other.buf;
+        other.buf = nullptr;
+    }
+    return *this;
+}
+
+void BufferRef::mark_dirty()
+{
+    cache->mark_dirty(buf, true);
+}
+
+void BufferRef::mark_data_dirty()
+{
+    cache->mark_dirty(buf, false);
+}
+
+void BufferRef::reset()
+{
+    if (buf)
+    {
+        cache->release(buf);
+        buf = nullptr;
+    }
+}
+
+BlockCache::BlockCache(BlockDevice &dev, size_t capacity) : dev(dev), cap(std::max<size_t>(capacity, 1)), io(dev)
+{
+}
+
+BlockCache::~BlockCache()
+{
+    // nowhere to report errors from here, callers that care flush first
+    flush();
+
+    for (auto &entry : buffers)
+        delete entry.second;
+    for (Buffer *buf : spare)
+        delete buf;
+}
+
+tl::expected<BufferRef, std::string> BlockCache::get(uint64_t block, const BlockChecksum *checksum)
+{
+    return lookup(block, true, checksum);
+}
+
+tl::expected<BufferRef, std::string> BlockCache::get_new(uint64_t block, const BlockChecksum *checksum)
+{
+    return lookup(block, false, checksum);
+}
+
+void BlockCache::move_to(Buffer *buf, int list)
+{
+    if (buf->list == T1)
+        t1.erase(buf->pos);
+    else if (buf->list == T2)
+        t2.erase(buf->pos);
+
+    std::list<Buffer *> &to = list == T1 ? t1 : t2;
+    to.push_front(buf);
+    buf->pos = to.begin();
+    buf->list = list;
+}
+
+void BlockCache::drop_ghost(std::list<uint64_t> &ghost)
+{
+    if (ghost.empty())
+        return;
+
+    ghosts.erase(ghost.back());
+    ghost.pop_back();
+}
+
+Buffer *BlockCache::alloc_buffer(uint64_t block)
+{
+    Buffer *buf;
+    if (!spare.empty())
+    {
+        buf = spare.back();
+        spare.pop_back();
+    }
+    else
+    {
+        buf = new Buffer;
+    }
+
+    buf->block = block;
+    buf->data.assign(dev.block_size(), 0);
+    buf->pins = 0;
+    buf->loading = false;
+    buf->dirty = false;
+    buf->tid = 0;
+    buf->ordered = false;
+    buf->checksum = nullptr;
+    buf->verified = false;
+    buf->list = 0;
+    return buf;
+}
+
+// Takes an unpinned buffer out of the cache, mtx has to be held
+void BlockCache::discard(Buffer *buf)
+{
+    (buf->list == T1 ? t1 : t2).erase(buf->pos);
+    buffers.erase(buf->block);
+    spare.push_back(buf);
+}
+
+/*
+    Evicts the least recently used unpinned buffer of a list and remembers its block
+    number on the ghost list if given one. A dirty one goes on evicted to be written
+    back once mtx is let go, see write_evicted. Returns false if everything on the
+    list is pinned
+*/
+bool BlockCache::evict_from(std::list<Buffer *> &from, std::list<uint64_t> *ghost, int ghost_list)
+{
+    // uncommitted metadata stays put like pinned blocks do, writing it back would get ahead of the journal.
+    // Neither can a block already on its way home be evicted, a second write could overtake the first
+    auto victim = std::find_if(from.rbegin(), from.rend(), [this](Buffer *buf)
+                               { return buf->pins == 0 && !is_held(buf) && !being_written(buf->block); });
+    if (victim == from.rend())
+        return false;
+
+    Buffer *buf = *victim;
+    from.erase(std::next(victim).base());
+    buffers.erase(buf->block);
+    buf->list = 0;
+
+    if (ghost)
+    {
+        ghost->push_front(buf->block);
+        ghosts[buf->block] = std::make_pair(ghost_list, ghost->begin());
+    }
+
+    if (buf->dirty)
+    {
+        writing[buf->block]++;
+        evicted.push_back(buf);
+    }
+    else
+    {
+        spare.push_back(buf);
+    }
+    return true;
+}
+
+/*
+    Writes back the dirty buffers evicted so far, letting go of mtx meanwhile. Their
+    blocks are marked as being written until then, so nobody reads them back from
+    the image early. One that fails to write goes back in the cache still dirty
+*/
+tl::expected<monostate, std::string> BlockCache::write_evicted(std::unique_lock<std::mutex> &lock)
+{
+    if (evicted.empty())
+        return monostate{};
+
+    std::vector<Buffer *> out;
+    out.swap(evicted);
+
+    lock.unlock();
+    tl::expected<monostate, std::string> result = monostate{};
+    std::vector<bool> failed(out.size());
+    for (size_t i = 0; i < out.size(); i++)
+    {
+        // nobody else can reach an evicted buffer, no need for its lock
+        seal(out[i], out[i]->data.data());
+        auto written = dev.write_block(out[i]->block, out[i]->data.data());
+        if (!written)
+        {
+            failed[i] = true;
+            result = written;
+        }
+    }
+    lock.lock();
+
+    for (size_t i = 0; i < out.size(); i++)
+    {
+        done_writing(out[i]->block);
+        if (failed[i])
+        {
+            buffers[out[i]->block] = out[i];
+            move_to(out[i], T1);
+        }
+        else
+        {
+            spare.push_back(out[i]);
+        }
+    }
+
+    io_done.notify_all();
+    return result;
+}
+
+void BlockCache::done_writing(uint64_t block)
+{
+    auto found = writing.find(block);
+    if (--found->second == 0)
+        writing.erase(found);
+}
+
+bool BlockCache::in_run(uint64_t block) const
+{
+    for (auto &run : runs)
+    {
+        if (block >= run.first && block < run.first + run.second)
+            return true;
+    }
+    return false;
+}
+
+/*
+    Locks a pinned buffer and mtx for copying the buffer out to write it, once no
+    write_run over its block is in flight. That write could otherwise land after
+    this one and put older contents back
+*/
+void BlockCache::lock_for_write(Buffer *buf, std::unique_lock<std::mutex> &data_lock, std::unique_lock<std::mutex> &lock)
+{
+    while (true)
+    {
+        data_lock = std::unique_lock<std::mutex>(buf->lock);
+        lock = std::unique_lock<std::mutex>(mtx);
+        if (!in_run(buf->block))
+            return;
+
+        // the run copies into the buffer under its lock, it can't be held while waiting
+        data_lock.unlock();
+        io_done.wait(lock, [&]
+                     { return !in_run(buf->block); });
+        lock.unlock();
+    }
+}
+
+// Waits until none of count blocks from start is being read in or written home, with mtx held
+void BlockCache::wait_idle(std::unique_lock<std::mutex> &lock, uint64_t start, uint32_t count)
+{
+    io_done.wait(lock, [&]
+                 {
+        for (uint64_t block = start; block < start + count; block++)
+        {
+            if (being_written(block))
+                return false;
+
+            auto found = buffers.find(block);
+            if (found != buffers.end() && found->second->loading)
+                return false;
+        }
+        return true; });
+}
+
+/*
+    ARC's REPLACE, frees up one resident slot from T1 or T2 depending on where p says
+    the balance should be. Falls back to the other list when one only has pinned blocks,
+    and if everything is pinned lets the cache run over capacity for now
+*/
+void BlockCache::replace(bool in_b2)
+{
+    if (t1.size() + t2.size() < cap)
+        return;
+
+    bool from_t1 = !t1.empty() && (t1.size() > p || (in_b2 && t1.size() == p));
+
+    if (from_t1 ? evict_from(t1, &b1, B1) : evict_from(t2, &b2, B2))
+        return;
+
+    if (from_t1)
+        evict_from(t2, &b2, B2);
+    else
+        evict_from(t1, &b1, B1);
+}
+
+/*
+    ARC bookkeeping for a block that's about to be brought in: adapts p on ghost hits
+    and evicts to make room. Returns the list the new buffer belongs on
+*/
+int BlockCache::admit(uint64_t block)
+{
+    int list = T1;
+    auto ghost = ghosts.find(block);
+    if (ghost != ghosts.end())
+    {
+        // recently evicted, grow whichever side it was evicted from
+        bool in_b2 = ghost->second.first == B2;
+        if (in_b2)
+        {
+            size_t delta = std::max<size_t>(b1.size() / std::max<size_t>(b2.size(), 1), 1);
+            p = p > delta ? p - delta : 0;
+            b2.erase(ghost->second.second);
+        }
+        else
+        {
+            size_t delta = std::max<size_t>(b2.size() / std::max<size_t>(b1.size(), 1), 1);
+            p = std::min(cap, p + delta);
+            b1.erase(ghost->second.second);
+        }
+        ghosts.erase(ghost);
+
+        replace(in_b2);
+        list = T2;
+    }
+    else if (t1.size() + b1.size() >= cap)
+    {
+        if (t1.size() < cap)
+        {
+            drop_ghost(b1);
+            replace(false);
+        }
+        else
+        {
+            // T1 alone fills the cache, throw its oldest block out without a ghost
+            evict_from(t1, nullptr, 0);
+        }
+    }
+    else if (t1.size() + t2.size() + b1.size() + b2.size() >= cap)
+    {
+        if (t1.size() + t2.size() + b1.size() + b2.size() >= 2 * cap)
+            drop_ghost(b2);
+
+        replace(false);
+    }
+
+    return list;
+}
+
+tl::expected<BufferRef, std::string> BlockCache::lookup(uint64_t block, bool read, const BlockChecksum *checksum)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+
+    Buffer *buf;
+    while (true)
+    {
+        auto found = buffers.find(block);
+        if (found != buffers.end())
+        {
+            buf = found->second;
+
+            // someone else is reading it in, wait for them rather than read it twice
+            if (buf->loading)
+            {
+                io_done.wait(lock);
+                continue;
+            }
+
+            // hit, anything seen twice moves to the frequent side
+            move_to(buf, T2);
+            hit_count++;
+            buf->pins++;
+            break;
+        }
+
+        // its last copy is still on its way home, reading it now could get the one before
+        if (being_written(block))
+        {
+            io_done.wait(lock);
+            continue;
+        }
+
+        // miss, the buffer goes in right away so lookups of the same block wait for this one's read
+        miss_count++;
+        int list = admit(block);
+
+        buf = alloc_buffer(block);
+        buf->loading = read;
+        buf->pins++;
+        buffers[block] = buf;
+        move_to(buf, list);
+        break;
+    }
+
+    auto written = write_evicted(lock);
+
+    if (buf->loading)
+    {
+        lock.unlock();
+        auto got = dev.read_block(block, buf->data.data());
+        lock.lock();
+
+        buf->loading = false;
+        io_done.notify_all();
+        if (!got)
+        {
+            buf->pins--;
+            discard(buf);
+            return tl::make_unexpected(got.error());
+        }
+    }
+
+    if (!written)
+    {
+        buf->pins--;
+        return tl::make_unexpected(written.error());
+    }
+
+    // get_new hands the block to whoever is about to fill it, a freed directory block may come back as file data
+    if (!read)
+        buf->checksum = checksum;
+
+    // only what came from the image needs checking, once, changes made in memory are sealed on the way out
+    if (checksum)
+    {
+        buf->checksum = checksum;
+        if (!buf->verified && read && !buf->dirty &&
+            !checksum->verify(buf->data.data(), dev.block_size(), block))
+        {
+            buf->pins--;
+            return tl::make_unexpected("Checksum mismatch in " + std::string(checksum->what) + " block " +
+                                       std::to_string(block));
+        }
+        buf->verified = true;
+    }
+
+    return BufferRef(this, buf);
+}
+
+// Fills in the checksum of a copy of buf's data before it's written anywhere
+void BlockCache::seal(const Buffer *buf, char *data)
+{
+    if (buf->checksum)
+        buf->checksum->seal(data, dev.block_size(), buf->block);
+}
+
+tl::expected<monostate, std::string> BlockCache::prefetch(const std::vector<uint64_t> &blocks)
+{
+    // every missing block goes in as a pinned placeholder before the reads start, so lookups wait for
+    // the read rather than do their own, and nothing loaded, changed and written back meanwhile can
+    // be overwritten with what the read brings in. Blocks on their way home are left out
+    std::vector<Buffer *> loading;
+    tl::expected<monostate, std::string> written = monostate{};
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        for (uint64_t block : blocks)
+        {
+            if (buffers.count(block) || being_written(block))
+                continue;
+
+            int list = admit(block);
+
+            Buffer *buf = alloc_buffer(block);
+            buf->loading = true;
+            buf->pins++;
+            buffers[block] = buf;
+            move_to(buf, list);
+            loading.push_back(buf);
+        }
+
+        written = write_evicted(lock);
+    }
+
+    if (loading.empty())
+        return written;
+
+    // read outside the lock so foreground lookups of other blocks aren't stuck behind the batch
+    tl::expected<monostate, std::string> got;
+    {
+        std::lock_guard<std::mutex> io_lock(io_mtx);
+        for (Buffer *buf : loading)
+            io.read_block(buf->block, buf->data.data());
+
+        got = io.flush();
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    for (Buffer *buf : loading)
+    {
+        buf->loading = false;
+        buf->pins--;
+
+        // nothing to keep from a failed batch, lookups waiting on it read the block themselves
+        if (!got)
+            discard(buf);
+    }
+    io_done.notify_all();
+
+    if (!got)
+        return got;
+    return written;
+}
+
+tl::expected<monostate, std::string> BlockCache::read_run(uint64_t start, uint32_t count, char *buf)
+{
+    uint32_t block_size = dev.block_size();
+
+    // stretches that aren't cached, as (first block, length)
+    std::vector<std::pair<uint64_t, uint32_t>> gaps;
+    std::vector<Buffer *> cached;
+    {
+        // a block being read in has nothing to copy yet, and one on its way home would read back old
+        std::unique_lock<std::mutex> lock(mtx);
+        wait_idle(lock, start, count);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            auto found = buffers.find(start + i);
+            if (found == buffers.end())
+            {
+                if (!gaps.empty() && gaps.back().first + gaps.back().second == start + i)
+                    gaps.back().second++;
+                else
+                    gaps.push_back(std::make_pair(start + i, 1u));
+                miss_count++;
+                continue;
+            }
+
+            found->second->pins++;
+            cached.push_back(found->second);
+            hit_count++;
+        }
+    }
+
+    copy_out(cached, start, buf);
+
+    // read outside the lock, like prefetch
+    for (auto &gap : gaps)
+    {
+        auto got = dev.read(gap.first * block_size, buf + (gap.first - start) * block_size, (uint64_t)gap.second * block_size);
+        if (!got)
+            return got;
+    }
+
+    // anything cached (and maybe changed) while we were reading is newer than what was read,
+    // unless it's still being read in, then it's the same
+    cached.clear();
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto &gap : gaps)
+        {
+            for (uint64_t block = gap.first; block < gap.first + gap.second; block++)
+            {
+                auto found = buffers.find(block);
+                if (found != buffers.end() && !found->second->loading)
+                {
+                    found->second->pins++;
+                    cached.push_back(found->second);
+                }
+            }
+        }
+    }
+
+    copy_out(cached, start, buf);
+    return monostate{};
+}
+
+// Copies pinned buffers into their place in a run starting at start, each under its lock, then unpins them
+void BlockCache::copy_out(const std::vector<Buffer *> &bufs, uint64_t start, char *run)
+{
+    for (Buffer *buf : bufs)
+    {
+        std::lock_guard<std::mutex> data_lock(buf->lock);
+        std::copy(buf->data.begin(), buf->data.end(), run + (buf->block - start) * dev.block_size());
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    for (Buffer *buf : bufs)
+        buf->pins--;
+}
+
+tl::expected<monostate, std::string> BlockCache::write_run(uint64_t start, uint32_t count, const char *buf)
+{
+    uint32_t block_size = dev.block_size();
+
+    // cached copies are brought up to date first, writing one back early only writes the same data.
+    // A write-back still in flight has to land first or it would put the old contents back over these,
+    // and blocks still being read in would come in with what's there now
+    std::vector<Buffer *> cached;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        wait_idle(lock, start, count);
+        runs.push_back(std::make_pair(start, count));
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            auto found = buffers.find(start + i);
+            if (found != buffers.end())
+            {
+                found->second->pins++;
+                cached.push_back(found->second);
+            }
+        }
+    }
+
+    for (Buffer *cached_buf : cached)
+    {
+        std::lock_guard<std::mutex> data_lock(cached_buf->lock);
+        const char *from = buf + (cached_buf->block - start) * block_size;
+        std::copy(from, from + block_size, cached_buf->data.begin());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (Buffer *cached_buf : cached)
+            cached_buf->pins--;
+    }
+
+    auto written = dev.write(start * block_size, buf, (uint64_t)count * block_size);
+
+    std::lock_guard<std::mutex> lock(mtx);
+    runs.erase(std::find(runs.begin(), runs.end(), std::make_pair(start, count)));
+    io_done.notify_all();
+    return written;
+}
+
+void BlockCache::release(Buffer *buf)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    buf->pins--;
+}
+
+void BlockCache::mark_dirty(Buffer *buf, bool metadata)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    buf->dirty = true;
+
+    if (metadata && journaling && buf->tid != running_tid)
+    {
+        buf->tid = running_tid;
+        running.push_back(buf->block);
+    }
+    else if (!metadata && ordered_data && !buf->ordered)
+    {
+        buf->ordered = true;
+        ordered.push_back(buf->block);
+    }
+}
+
+void BlockCache::enable_journal(uint64_t first_tid, bool ordered)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    journaling = true;
+    ordered_data = ordered;
+    running_tid = first_tid;
+    committed_tid = first_tid - 1;
+}
+
+uint64_t BlockCache::close_transaction(std::vector<uint64_t> &blocks, std::vector<char> &data)
+{
+    std::vector<Buffer *> closing;
+    uint64_t tid;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+
+        std::sort(running.begin(), running.end());
+        running.erase(std::unique(running.begin(), running.end()), running.end());
+
+        for (uint64_t block : running)
+        {
+            // blocks freed (and forgotten) since they were changed are left out
+            auto found = buffers.find(block);
+            if (found == buffers.end() || found->second->tid != running_tid)
+                continue;
+
+            found->second->pins++;
+            closing.push_back(found->second);
+        }
+
+        running.clear();
+        tid = running_tid++;
+    }
+
+    // copied under their locks so nothing half changed goes in the log, the copies are sealed rather than the blocks
+    for (Buffer *buf : closing)
+    {
+        std::lock_guard<std::mutex> data_lock(buf->lock);
+        size_t at = data.size();
+        blocks.push_back(buf->block);
+        data.insert(data.end(), buf->data.begin(), buf->data.end());
+        seal(buf, &data[at]);
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    for (Buffer *buf : closing)
+        buf->pins--;
+
+    return tid;
+}
+
+void BlockCache::commit_transaction(uint64_t tid)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    committed_tid = std::max(committed_tid, tid);
+}
+
+void BlockCache::reopen_transaction(uint64_t tid, const std::vector<uint64_t> &blocks,
+                                    const std::vector<uint64_t> &ordered_blocks)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    // held blocks can't have been evicted or written back, only changed again and moved on already
+    for (uint64_t block : blocks)
+    {
+        auto found = buffers.find(block);
+        if (found == buffers.end() || !found->second->dirty || found->second->tid != tid)
+            continue;
+
+        found->second->tid = running_tid;
+        running.push_back(block);
+    }
+
+    // skipping ones freed and reused as metadata meanwhile, or ordered again already
+    for (uint64_t block : ordered_blocks)
+    {
+        auto found = buffers.find(block);
+        if (found == buffers.end() || !found->second->dirty || found->second->ordered || found->second->tid != 0)
+            continue;
+
+        found->second->ordered = true;
+        ordered.push_back(block);
+    }
+}
+
+uint64_t BlockCache::running_transaction()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return running_tid;
+}
+
+size_t BlockCache::running_size()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return running.size();
+}
+
+bool BlockCache::in_running(uint64_t block)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    auto found = buffers.find(block);
+    return journaling && found != buffers.end() && found->second->tid == running_tid;
+}
+
+bool BlockCache::held(uint64_t block)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    auto found = buffers.find(block);
+    return found != buffers.end() && is_held(found->second);
+}
+
+void BlockCache::forget(uint64_t block)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto found = buffers.find(block);
+    if (found == buffers.end() || found->second->pins > 0)
+        return;
+
+    discard(found->second);
+}
+
+void BlockCache::take_ordered(std::vector<uint64_t> &blocks)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    for (uint64_t block : ordered)
+    {
+        // forgotten blocks (or ones reused since) were freed, nothing to order
+        auto found = buffers.find(block);
+        if (found == buffers.end() || !found->second->ordered)
+            continue;
+
+        found->second->ordered = false;
+        blocks.push_back(block);
+    }
+
+    ordered.clear();
+}
+
+tl::expected<monostate, std::string> BlockCache::write_back(const std::vector<uint64_t> &blocks)
+{
+    std::vector<Buffer *> dirty;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (uint64_t block : blocks)
+        {
+            auto found = buffers.find(block);
+            if (found != buffers.end() && found->second->dirty && !is_held(found->second))
+            {
+                found->second->pins++;
+                dirty.push_back(found->second);
+            }
+        }
+    }
+
+    return write_pinned(dirty);
+}
+
+tl::expected<bool, std::string> BlockCache::write_committed(uint64_t block, const char *committed)
+{
+    std::lock_guard<std::mutex> io_lock(io_mtx);
+
+    Buffer *buf;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+
+        // an eviction's write (or a run's) has to land before the log can stop covering the block. If it
+        // failed the buffer is back in the cache, still dirty
+        wait_idle(lock, block, 1);
+
+        // evicted blocks were written back on the way out, clean ones are already home
+        auto found = buffers.find(block);
+        if (found == buffers.end() || !found->second->dirty)
+            return true;
+
+        buf = found->second;
+        buf->pins++;
+    }
+
+    std::vector<char> copy(dev.block_size());
+    bool own;
+    {
+        std::unique_lock<std::mutex> data_lock, lock;
+        lock_for_write(buf, data_lock, lock);
+
+        own = !is_held(buf);
+        if (own && !buf->dirty)
+        {
+            buf->pins--;
+            return true;
+        }
+
+        if (own)
+        {
+            std::copy(buf->data.begin(), buf->data.end(), copy.begin());
+            seal(buf, copy.data());
+            buf->dirty = false;
+        }
+        else if (committed)
+        {
+            // the buffer stays dirty, its own changes go home once they're committed
+            std::copy(committed, committed + dev.block_size(), copy.begin());
+        }
+        else
+        {
+            buf->pins--;
+            return false;
+        }
+
+        writing[block]++;
+    }
+
+    auto written = dev.write_block(block, copy.data());
+
+    std::lock_guard<std::mutex> lock(mtx);
+    done_writing(block);
+    if (!written && own)
+        buf->dirty = true;
+    buf->pins--;
+    io_done.notify_all();
+
+    if (!written)
+        return tl::make_unexpected(written.error());
+    return true;
+}
+
+tl::expected<monostate, std::string> BlockCache::flush()
+{
+    std::vector<Buffer *> dirty;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto &entry : buffers)
+        {
+            if (entry.second->dirty && !is_held(entry.second))
+            {
+                entry.second->pins++;
+                dirty.push_back(entry.second);
+            }
+        }
+    }
+
+    return write_pinned(dirty);
+}
+
+/*
+    Writes back whichever of bufs are still dirty and not held as one batch, then
+    unpins them, the caller pins them under mtx. Each is copied out under its lock,
+    so it goes home whole and with a checksum that matches, and the writes happen
+    with mtx let go
+*/
+tl::expected<monostate, std::string> BlockCache::write_pinned(std::vector<Buffer *> &bufs)
+{
+    if (bufs.empty())
+        return monostate{};
+
+    // in block order so the writes sweep across the image once
+    std::sort(bufs.begin(), bufs.end(), [](const Buffer *a, const Buffer *b)
+              { return a->block < b->block; });
+
+    std::lock_guard<std::mutex> io_lock(io_mtx);
+
+    uint32_t block_size = dev.block_size();
+    std::vector<Buffer *> out;
+    std::vector<char> copies;
+    for (Buffer *buf : bufs)
+    {
+        std::unique_lock<std::mutex> data_lock, lock;
+        lock_for_write(buf, data_lock, lock);
+
+        // written back or tagged with a newer transaction since it was picked
+        if (!buf->dirty || is_held(buf))
+            continue;
+
+        size_t at = copies.size();
+        copies.insert(copies.end(), buf->data.begin(), buf->data.end());
+        seal(buf, &copies[at]);
+
+        // changes made from here on dirty it again
+        buf->dirty = false;
+        writing[buf->block]++;
+        out.push_back(buf);
+    }
+
+    for (size_t i = 0; i < out.size(); i++)
+        io.write_block(out[i]->block, &copies[i * block_size]);
+
+    auto written = io.flush();
+
+    std::lock_guard<std::mutex> lock(mtx);
+    for (Buffer *buf : out)
+    {
+        done_writing(buf->block);
+        if (!written)
+            buf->dirty = true;
+    }
+    for (Buffer *buf : bufs)
+        buf->pins--;
+
+    io_done.notify_all();
+    return written;
+}
+
+size_t BlockCache::hits()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return hit_count;
+}
+
+size_t BlockCache::misses()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return miss_count;
+}
+
+tl::expected<monostate, std::string> BlockCache::sync()
+{
+    auto flushed = flush();
+    if (!flushed)
+        return flushed;
+
+    return dev.sync();
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "block_device.hpp"
+#include "expected.hpp"
+#include "io_queue.hpp"
+#include "monostate.hpp"
+
+class BlockCache;
+
+/*
+    How a kind of block carries a checksum of itself. Blocks fetched with one are
+    verified the first time they come in from the image and have their checksum
+    filled in whenever they're written back, so code changing them never has to
+    think about it. block is the block's number, for seeding
+*/
+struct BlockChecksum
+{
+    void (*seal)(char *data, uint32_t size, uint64_t block);
+    bool (*verify)(const char *data, uint32_t size, uint64_t block);
+    // what kind of block it is, for the error when one doesn't verify
+    const char *what;
+};
+
+/*
+    One cached block. Only valid while pinned, once the last pin goes
+    the cache is free to write it back and reuse it
+*/
+struct Buffer
+{
+    uint64_t block = 0;
+    std::vector<char> data;
+    // held while data is changed or copied out for writing, see BufferRef::lock
+    std::mutex lock;
+    unsigned pins = 0;
+    // still being read in from the image, data isn't valid yet
+    bool loading = false;
+    bool dirty = false;
+    // journal transaction that last changed it as metadata, 0 if none
+    uint64_t tid = 0;
+    // changed as file contents since the last commit, in ordered journal mode
+    bool ordered = false;
+    // set once the block has been fetched as a kind of block that has one
+    const BlockChecksum *checksum = nullptr;
+    bool verified = false;
+
+    // which ARC list the buffer is on and where
+    int list = 0;
+    std::list<Buffer *>::iterator pos;
+};
+
+/*
+    Pin on a cached block, unpins when it goes out of scope so early
+    returns on errors can't leak pins
+*/
+class BufferRef
+{
+public:
+    BufferRef() = default;
+    BufferRef(BlockCache *cache, Buffer *buf) : cache(cache), buf(buf) {}
+    ~BufferRef() { reset(); }
+
+    BufferRef(BufferRef &&other) : cache(other.cache), buf(other.buf) { other.buf = nullptr; }
+    BufferRef &operator=(BufferRef &&other);
+
+    BufferRef(const BufferRef &) = delete;
+    BufferRef &operator=(const BufferRef &) = delete;
+
+    char *data() const { return buf->data.data(); }
+    uint64_t block() const { return buf->block; }
+    explicit operator bool() const { return buf != nullptr; }
+
+    /*
+        Keeps the block from being copied out for write-back or the journal. Hold it from
+        the first change to data() until after mark_dirty, so the block never goes out
+        half changed. Flushing while holding it deadlocks
+    */
+    std::unique_lock<std::mutex> lock() const { return std::unique_lock<std::mutex>(buf->lock); }
+
+    // Marks the block as needing write back, call after modifying data(). With a journal the block is logged as metadata
+    void mark_dirty();
+
+    // Same, for file contents, which are never logged
+    void mark_data_dirty();
+
+    void reset();
+
+private:
+    BlockCache *cache = nullptr;
+    Buffer *buf = nullptr;
+};
+
+/*
+    Block buffer cache sitting in front of the image
+
+    Blocks are kept in memory up to capacity, evicted with ARC (adaptive replacement)
+    so one big sequential scan, like walking every inode table, can't push out the
+    bitmaps and directory blocks that keep getting hit. Dirty blocks are only written
+    when evicted or flushed, and flush writes them back in block address order as
+    one batch through an IOQueue
+
+    No I/O happens under the cache's lock, lookups of other blocks carry on while a
+    block is read in or written out. A block being read in, or on its way to the
+    image, is waited for rather than read from the image a second time
+
+    Pinned blocks are never evicted, if everything is pinned the cache grows past
+    capacity rather than fail. All operations are thread safe
+*/
+class BlockCache
+{
+public:
+    // capacity is in blocks
+    BlockCache(BlockDevice &dev, size_t capacity);
+    ~BlockCache();
+
+    BlockCache(const BlockCache &) = delete;
+    BlockCache &operator=(const BlockCache &) = delete;
+
+    /*
+        Pins block, reading it from the image if it isn't cached. With a checksum the
+        block fails to load if it doesn't verify, see BlockChecksum
+    */
+    tl::expected<BufferRef, std::string> get(uint64_t block, const BlockChecksum *checksum = nullptr);
+
+    // Pins block without reading it, for when the caller is about to overwrite all of it. Starts zeroed if not cached
+    tl::expected<BufferRef, std::string> get_new(uint64_t block, const BlockChecksum *checksum = nullptr);
+
+    /*
+        Brings blocks into the cache unpinned, blocks already cached are left alone.
+        Lookups of other blocks carry on while the reads are in flight, lookups of
+        the blocks being read wait for them. Used for readahead
+    */
+    tl::expected<monostate, std::string> prefetch(const std::vector<uint64_t> &blocks);
+
+    /*
+        Reads count consecutive blocks into buf without bringing them into the cache.
+        Blocks that are cached are copied out of it and every stretch in between is
+        one read from the image, so bulk file data doesn't push everything else out
+    */
+    tl::expected<monostate, std::string> read_run(uint64_t start, uint32_t count, char *buf);
+
+    /*
+        Writes count consecutive blocks straight to the image in one go, updating any
+        cached copies on the way. Until the write lands the blocks count as on their
+        way home, like a write-back, so nothing reads them back or writes them early
+    */
+    tl::expected<monostate, std::string> write_run(uint64_t start, uint32_t count, const char *buf);
+
+    // Writes every dirty block back, in block order, as one batch. Uncommitted metadata is left for the journal
+    tl::expected<monostate, std::string> flush();
+
+    // Flush then make sure it's all on disk
+    tl::expected<monostate, std::string> sync();
+
+    // Drops a block from the cache without writing it back (it must not be pinned)
+    void forget(uint64_t block);
+
+    /*
+        Journal support, see journal.hpp. Once enabled, blocks marked dirty as metadata
+        are tagged with the running transaction and aren't written back until it's
+        committed. Transaction ids count up from first_tid. In ordered mode the blocks
+        marked dirty as file contents are remembered too, see take_ordered
+    */
+    void enable_journal(uint64_t first_tid, bool ordered);
+
+    /*
+        Ends the running transaction and starts the next one. Every block it changed
+        is listed in blocks and its contents copied into data, in the same order.
+        Returns its id, the blocks stay held until commit_transaction
+    */
+    uint64_t close_transaction(std::vector<uint64_t> &blocks, std::vector<char> &data);
+
+    // Lets blocks of transactions up to tid be written back
+    void commit_transaction(uint64_t tid);
+
+    /*
+        Undoes close_transaction for a transaction that couldn't be committed: those of
+        its blocks not changed again since go back into the running transaction, and the
+        ones take_ordered handed over for it that are still dirty are ordered again
+    */
+    void reopen_transaction(uint64_t tid, const std::vector<uint64_t> &blocks, const std::vector<uint64_t> &ordered_blocks);
+
+    uint64_t running_transaction();
+
+    // Number of blocks changed in the running transaction so far
+    size_t running_size();
+
+    // Whether block was changed as metadata in the running transaction
+    bool in_running(uint64_t block);
+
+    // Whether block is dirty with changes that haven't been committed yet
+    bool held(uint64_t block);
+
+    // Hands over the blocks marked dirty as file contents since the last call, in ordered mode
+    void take_ordered(std::vector<uint64_t> &blocks);
+
+    // Writes back whichever of blocks are cached and dirty, leaving uncommitted metadata alone
+    tl::expected<monostate, std::string> write_back(const std::vector<uint64_t> &blocks);
+
+    /*
+        For checkpoints, gets block's last committed contents to its home location.
+        committed is its copy from the journal, only written if the cached block is held
+        by a newer transaction, otherwise the block is written back if dirty. An evicted
+        block counts as home once its write has landed, which this waits for. Returns
+        false without writing anything if the copy is needed but wasn't given
+    */
+    tl::expected<bool, std::string> write_committed(uint64_t block, const char *committed);
+
+    BlockDevice &device() { return dev; }
+    uint32_t block_size() const { return dev.block_size(); }
+    size_t capacity() const { return cap; }
+
+    size_t hits();
+    size_t misses();
+
+private:
+    friend class BufferRef;
+
+    enum
+    {
+        T1 = 1, // resident, seen once recently
+        T2,     // resident, seen at least twice
+        B1,     // ghost of something evicted from T1
+        B2,     // ghost of something evicted from T2
+    };
+
+    tl::expected<BufferRef, std::string> lookup(uint64_t block, bool read, const BlockChecksum *checksum);
+    int admit(uint64_t block);
+    void replace(bool in_b2);
+    bool evict_from(std::list<Buffer *> &from, std::list<uint64_t> *ghost, int ghost_list);
+    tl::expected<monostate, std::string> write_evicted(std::unique_lock<std::mutex> &lock);
+    Buffer *alloc_buffer(uint64_t block);
+    void discard(Buffer *buf);
+    void move_to(Buffer *buf, int list);
+    void drop_ghost(std::list<uint64_t> &ghost);
+    void release(Buffer *buf);
+    void mark_dirty(Buffer *buf, bool metadata);
+    bool is_held(const Buffer *buf) const { return buf->dirty && buf->tid > committed_tid; }
+    void done_writing(uint64_t block);
+    bool in_run(uint64_t block) const;
+    bool being_written(uint64_t block) const { return writing.count(block) || in_run(block); }
+    void lock_for_write(Buffer *buf, std::unique_lock<std::mutex> &data_lock, std::unique_lock<std::mutex> &lock);
+    void wait_idle(std::unique_lock<std::mutex> &lock, uint64_t start, uint32_t count);
+    void copy_out(const std::vector<Buffer *> &bufs, uint64_t start, char *run);
+    tl::expected<monostate, std::string> write_pinned(std::vector<Buffer *> &bufs);
+    void seal(const Buffer *buf, char *data);
+
+    BlockDevice &dev;
+    size_t cap;
+    // ARC's target size for T1, shifts towards whichever side is getting ghost hits
+    size_t p = 0;
+
+    std::mutex mtx;
+
+    // batches go through one ring for the life of the cache instead of setting one up per call. Taken
+    // before any buffer's lock and mtx, and held through a whole write-back so an older copy of a
+    // block can never land after a newer one
+    IOQueue io;
+    std::mutex io_mtx;
+
+    // blocks with writes to their home location in flight, and how many
+    std::unordered_map<uint64_t, unsigned> writing;
+    // runs write_run has on their way to the image, as (first block, length)
+    std::vector<std::pair<uint64_t, uint32_t>> runs;
+    // dirty buffers evicted under mtx, whoever evicted them writes them once it lets go of it
+    std::vector<Buffer *> evicted;
+    // a block finished loading or writing
+    std::condition_variable io_done;
+
+    std::unordered_map<uint64_t, Buffer *> buffers;
+    std::list<Buffer *> t1, t2;
+
+    // ghosts only remember block numbers of recently evicted blocks
+    std::list<uint64_t> b1, b2;
+    std::unordered_map<uint64_t, std::pair<int, std::list<uint64_t>::iterator>> ghosts;
+
+    // evicted buffers are kept around so their memory can be reused
+    std::vector<Buffer *> spare;
+
+    bool journaling = false;
+    uint64_t running_tid = 0;
+    uint64_t committed_tid = 0;
+    // blocks tagged with the running transaction, can hold duplicates
+    std::vector<uint64_t> running;
+    bool ordered_data = false;
+    // file content blocks to write back before the next commit
+    std::vector<uint64_t> ordered;
+
+    size_t hit_count = 0;
+    size_t miss_count = 0;
+};
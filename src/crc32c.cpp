@@ -0,0 +1,108 @@
+#include <cstring>
+
+#include <immintrin.h>
+
+#include "crc32c.hpp"
+
+// Reflected Castagnoli polynomial
+const uint32_t CRC32C_POLY = 0x82F63B78;
+
+/*
+    table[0] is the usual byte at a time table, table[k] advances a byte's
+    contribution through k more zero bytes, so 8 bytes can be folded in at once
+*/
+struct SlicingTables
+{
+    uint32_t table[8][256];
+
+    SlicingTables()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+            table[0][i] = crc;
+        }
+
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            for (int k = 1; k < 8; k++)
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+        }
+    }
+};
+
+// Both kernels work on the raw register, without the inversions at either end
+
+static uint32_t crc32c_slicing(uint32_t crc, const uint8_t *p, size_t len)
+{
+    static const SlicingTables tables;
+    const uint32_t(*t)[256] = tables.table;
+
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint32_t lo;
+        uint32_t hi;
+        std::memcpy(&lo, p, sizeof(lo));
+        std::memcpy(&hi, p + 4, sizeof(hi));
+        lo ^= crc;
+
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+
+    for (; len > 0; p++, len--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+
+    return crc;
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = crc64;
+    for (; len > 0; p++, len--)
+        crc = _mm_crc32_u8(crc, *p);
+
+    return crc;
+}
+
+typedef uint32_t (*Crc32c)(uint32_t, const uint8_t *, size_t);
+
+struct CrcKernel
+{
+    Crc32c update;
+    const char *name;
+};
+
+static CrcKernel pick_kernel()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return CrcKernel{crc32c_sse42, "sse4.2"};
+    return CrcKernel{crc32c_slicing, "slicing-by-8"};
+}
+
+static const CrcKernel &kernel()
+{
+    static const CrcKernel k = pick_kernel();
+    return k;
+}
+
+const char *crc32c_kernel()
+{
+    return kernel().name;
+}
+
+uint32_t crc32c(uint32_t seed, const void *data, size_t len)
+{
+    return ~kernel().update(~seed, (const uint8_t *)data, len);
+}
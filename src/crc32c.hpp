@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+    CRC-32C (Castagnoli), the checksum kept on metadata
+
+    Computed with the SSE4.2 crc32 instruction 8 bytes at a time when the CPU has it,
+    otherwise with slicing-by-8 tables. As with the bitmap kernels the choice is made
+    once at runtime, so the binary doesn't need to be built for a particular CPU
+
+    seed is the checksum of whatever came before, so crc32c(crc32c(0, a), b) is the
+    checksum of a followed by b
+*/
+uint32_t crc32c(uint32_t seed, const void *data, size_t len);
+
+// Name of the implementation picked for this CPU, "sse4.2" or "slicing-by-8"
+const char *crc32c_kernel();
@@ -0,0 +1,145 @@
+#include <algorithm>
+
+#include "dentry.hpp"
+#include "dir.hpp"
+#include "filesystem.hpp"
+
+DentryCache::DentryCache(size_t capacity) : cap(std::max<size_t>(capacity, 1))
+{
+}
+
+tl::optional<DentryCache::Dentry> DentryCache::lookup(uint32_t parent, const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto found = entries.find(Key{parent, name});
+    if (found == entries.end())
+    {
+        miss_count++;
+        return tl::nullopt;
+    }
+
+    hit_count++;
+    lru.splice(lru.begin(), lru, found->second);
+    return found->second->second;
+}
+
+void DentryCache::insert(uint32_t parent, const std::string &name, uint32_t inode, FileType type)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    Key key{parent, name};
+    Dentry dentry{inode, type};
+
+    auto found = entries.find(key);
+    if (found != entries.end())
+    {
+        found->second->second = dentry;
+        lru.splice(lru.begin(), lru, found->second);
+        return;
+    }
+
+    lru.push_front(std::make_pair(key, dentry));
+    entries[key] = lru.begin();
+
+    if (lru.size() > cap)
+    {
+        entries.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+void DentryCache::forget(uint32_t parent, const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    auto found = entries.find(Key{parent, name});
+    if (found == entries.end())
+        return;
+
+    lru.erase(found->second);
+    entries.erase(found);
+}
+
+void DentryCache::forget_dir(uint32_t parent)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    for (auto it = lru.begin(); it != lru.end();)
+    {
+        if (it->first.parent == parent)
+        {
+            entries.erase(it->first);
+            it = lru.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void DentryCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    lru.clear();
+    entries.clear();
+}
+
+size_t DentryCache::size()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return lru.size();
+}
+
+tl::expected<uint32_t, std::string> path_lookup(Filesystem &fs, const std::string &path)
+{
+    uint32_t ino = ROOT_INO;
+    FileType type = FileType::Directory;
+
+    size_t pos = 0;
+    while (pos < path.size())
+    {
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos)
+            end = path.size();
+
+        std::string name = path.substr(pos, end - pos);
+        size_t start = pos;
+        pos = end + 1;
+
+        if (name.empty() || name == ".")
+            continue;
+
+        if (type != FileType::Directory)
+            return tl::make_unexpected(path.substr(0, start - 1) + " is not a directory");
+
+        auto cached = fs.dentries->lookup(ino, name);
+        if (!cached)
+        {
+            // only on a miss does the directory itself need reading
+            auto dir = fs.read_inode(ino);
+            if (!dir)
+                return tl::make_unexpected(dir.error());
+
+            auto found = dir_lookup(fs, *dir, name);
+            if (!found)
+                return tl::make_unexpected(found.error());
+
+            if (found->inode == 0)
+                fs.dentries->insert_negative(ino, name);
+            else
+                fs.dentries->insert(ino, name, found->inode, found->type);
+
+            cached = DentryCache::Dentry{found->inode, found->type};
+        }
+
+        if (cached->inode == 0)
+            return 0;
+
+        ino = cached->inode;
+        type = cached->type;
+    }
+
+    return ino;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "expected.hpp"
+#include "fs.hpp"
+#include "optional.hpp"
+
+struct Filesystem;
+
+/*
+    Cache of directory lookups, (parent inode, name) to the child's inode and type
+
+    Names that turned out not to exist are cached too (as inode 0), so repeatedly
+    looking for something that isn't there doesn't read the directory every time.
+    Least recently used entries are dropped past capacity. Thread safe
+
+    Whoever adds or removes directory entries has to keep it in step, with insert
+    and forget
+*/
+class DentryCache
+{
+public:
+    explicit DentryCache(size_t capacity = 65536);
+
+    struct Dentry
+    {
+        // 0 for a name known not to exist
+        uint32_t inode;
+        FileType type;
+    };
+
+    // Empty if (parent, name) hasn't been cached
+    tl::optional<Dentry> lookup(uint32_t parent, const std::string &name);
+
+    void insert(uint32_t parent, const std::string &name, uint32_t inode, FileType type);
+    void insert_negative(uint32_t parent, const std::string &name) { insert(parent, name, 0, FileType::Unused); }
+
+    void forget(uint32_t parent, const std::string &name);
+
+    // Drops everything cached under a directory that's been removed, walks the whole cache
+    void forget_dir(uint32_t parent);
+    void clear();
+
+    size_t size();
+    size_t hits() const { return hit_count; }
+    size_t misses() const { return miss_count; }
+
+private:
+    struct Key
+    {
+        uint32_t parent;
+        std::string name;
+
+        bool operator==(const Key &other) const { return parent == other.parent && name == other.name; }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const { return std::hash<std::string>()(key.name) ^ (key.parent * 0x9E3779B97F4A7C15ull); }
+    };
+
+    typedef std::list<std::pair<Key, Dentry>> LruList;
+
+    size_t cap;
+    std::mutex mtx;
+
+    // most recently used at the front
+    LruList lru;
+    std::unordered_map<Key, LruList::iterator, KeyHash> entries;
+
+    size_t hit_count = 0;
+    size_t miss_count = 0;
+};
+
+/*
+    Resolves a path from the root directory to an inode number, 0 if some component
+    doesn't exist. Every component is looked up in the dentry cache first, so paths
+    that were walked before resolve without reading any directory blocks. Paths are
+    always taken from the root, "." and empty components are skipped
+*/
+tl::expected<uint32_t, std::string> path_lookup(Filesystem &fs, const std::string &path);
@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <cstring>
+
+#include "alloc.hpp"
+#include "dir.hpp"
+#include "extent.hpp"
+#include "htree.hpp"
+#include "inode_map.hpp"
+
+uint32_t dir_entry_len(uint32_t name_len)
+{
+    return (DIR_ENTRY_HEADER + name_len + 3) & ~3u;
+}
+
+DirEntry make_dir_entry(const std::string &name, uint32_t ino, FileType type)
+{
+    DirEntry entry;
+    entry.inode = ino;
+    entry.type = type;
+    entry.name_len = std::min<size_t>(name.size(), MAX_NAME_LEN);
+    std::memcpy(entry.name, name.data(), entry.name_len);
+    entry.entry_size = dir_entry_len(entry.name_len);
+    return entry;
+}
+
+// Reads the entry at off, false if it doesn't make sense or runs off the end of the block
+static bool read_entry(const char *block, uint32_t block_size, uint32_t off, DirEntry &entry)
+{
+    if (off + DIR_ENTRY_HEADER > block_size)
+        return false;
+
+    const char *src = block + off;
+    std::memcpy(&entry.inode, src, sizeof(entry.inode));
+    std::memcpy(&entry.entry_size, src + 4, sizeof(entry.entry_size));
+    std::memcpy(&entry.type, src + 6, sizeof(entry.type));
+    entry.name_len = src[8];
+
+    if (entry.entry_size < DIR_ENTRY_HEADER || entry.entry_size % 4 != 0 || off + entry.entry_size > block_size ||
+        DIR_ENTRY_HEADER + entry.name_len > entry.entry_size)
+    {
+        return false;
+    }
+
+    std::memcpy(entry.name, src + DIR_ENTRY_HEADER, entry.name_len);
+    return true;
+}
+
+static void write_entry(char *block, uint32_t off, const DirEntry &entry)
+{
+    char *dst = block + off;
+    std::memcpy(dst, &entry.inode, sizeof(entry.inode));
+    std::memcpy(dst + 4, &entry.entry_size, sizeof(entry.entry_size));
+    std::memcpy(dst + 6, &entry.type, sizeof(entry.type));
+    dst[8] = entry.name_len;
+    std::memcpy(dst + DIR_ENTRY_HEADER, entry.name, entry.name_len);
+}
+
+static bool name_matches(const DirEntry &entry, const std::string &name)
+{
+    return entry.name_len == name.size() && std::memcmp(entry.name, name.data(), entry.name_len) == 0;
+}
+
+uint32_t dir_block_space(uint32_t block_size)
+{
+    return block_size - DIR_TAIL_SIZE;
+}
+
+static void seal_dir_block(char *data, uint32_t size, uint64_t block)
+{
+    uint32_t crc = crc32c(block, data, dir_block_space(size));
+    std::memcpy(data + dir_block_space(size), &crc, sizeof(crc));
+}
+
+static bool verify_dir_block(const char *data, uint32_t size, uint64_t block)
+{
+    uint32_t crc;
+    std::memcpy(&crc, data + dir_block_space(size), sizeof(crc));
+    return crc == crc32c(block, data, dir_block_space(size));
+}
+
+const BlockChecksum DIR_BLOCK_CHECKSUM = {seal_dir_block, verify_dir_block, "directory"};
+
+void dir_block_init(char *block, uint32_t block_size)
+{
+    std::memset(block, 0, block_size);
+
+    DirEntry empty;
+    empty.entry_size = dir_block_space(block_size);
+    write_entry(block, 0, empty);
+}
+
+tl::expected<DirEntry, std::string> dir_block_find(const char *block, uint32_t block_size, const std::string &name)
+{
+    uint32_t space = dir_block_space(block_size);
+    DirEntry entry;
+    for (uint32_t off = 0; off < space; off += entry.entry_size)
+    {
+        if (!read_entry(block, space, off, entry))
+            return tl::make_unexpected("Corrupt directory block");
+
+        if (entry.inode != 0 && name_matches(entry, name))
+            return entry;
+    }
+
+    return DirEntry();
+}
+
+tl::expected<bool, std::string> dir_block_add(char *block, uint32_t block_size, const DirEntry &entry)
+{
+    uint32_t space = dir_block_space(block_size);
+    uint32_t needed = dir_entry_len(entry.name_len);
+
+    DirEntry existing;
+    for (uint32_t off = 0; off < space; off += existing.entry_size)
+    {
+        if (!read_entry(block, space, off, existing))
+            return tl::make_unexpected("Corrupt directory block");
+
+        DirEntry added = entry;
+
+        // an unused entry is taken over whole
+        if (existing.inode == 0 && existing.entry_size >= needed)
+        {
+            added.entry_size = existing.entry_size;
+            write_entry(block, off, added);
+            return true;
+        }
+
+        // otherwise split the free space off the end of a live one
+        uint32_t used = dir_entry_len(existing.name_len);
+        if (existing.inode != 0 && existing.entry_size >= used + needed)
+        {
+            added.entry_size = existing.entry_size - used;
+            existing.entry_size = used;
+            write_entry(block, off, existing);
+            write_entry(block, off + used, added);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+tl::expected<bool, std::string> dir_block_remove(char *block, uint32_t block_size, const std::string &name)
+{
+    uint32_t space = dir_block_space(block_size);
+    DirEntry prev;
+    uint32_t prev_off = 0;
+
+    DirEntry entry;
+    for (uint32_t off = 0; off < space; off += entry.entry_size)
+    {
+        if (!read_entry(block, space, off, entry))
+            return tl::make_unexpected("Corrupt directory block");
+
+        if (entry.inode != 0 && name_matches(entry, name))
+        {
+            if (off == 0)
+            {
+                // nothing before it to fold into, so the first entry just becomes unused
+                entry.inode = 0;
+                entry.name_len = 0;
+                write_entry(block, off, entry);
+            }
+            else
+            {
+                prev.entry_size += entry.entry_size;
+                write_entry(block, prev_off, prev);
+            }
+            return true;
+        }
+
+        prev = entry;
+        prev_off = off;
+    }
+
+    return false;
+}
+
+tl::expected<monostate, std::string> dir_block_list(const char *block, uint32_t block_size, std::vector<DirEntry> &entries)
+{
+    uint32_t space = dir_block_space(block_size);
+    DirEntry entry;
+    for (uint32_t off = 0; off < space; off += entry.entry_size)
+    {
+        if (!read_entry(block, space, off, entry))
+            return tl::make_unexpected("Corrupt directory block");
+
+        if (entry.inode != 0)
+            entries.push_back(entry);
+    }
+
+    return monostate{};
+}
+
+tl::expected<BufferRef, std::string> dir_grow(Filesystem &fs, Inode &dir, uint64_t goal)
+{
+    uint32_t block_size = fs.block_size();
+    uint32_t lblock = dir.size / block_size;
+
+    auto block = alloc_block(fs, goal);
+    if (!block)
+        return tl::make_unexpected(block.error());
+
+    auto buf = fs.cache->get_new(*block, &DIR_BLOCK_CHECKSUM);
+    if (!buf)
+        return tl::make_unexpected(buf.error());
+
+    {
+        auto guard = buf->lock();
+        dir_block_init(buf->data(), block_size);
+        buf->mark_dirty();
+    }
+
+    auto mapped = map_insert(fs, dir, lblock, *block, 1);
+    if (!mapped)
+        return tl::make_unexpected(mapped.error());
+
+    dir.size += block_size;
+    return buf;
+}
+
+tl::expected<monostate, std::string> dir_init(Filesystem &fs, Inode &dir, uint32_t self, uint32_t parent)
+{
+    dir.type = FileType::Directory;
+    dir.link_count = 2;
+    dir.size = 0;
+    extent_init(dir);
+
+    auto block = dir_grow(fs, dir, fs.group_start((self - 1) / fs.sb.inodes_per_group));
+    if (!block)
+        return tl::make_unexpected(block.error());
+
+    uint32_t block_size = fs.block_size();
+
+    auto guard = block->lock();
+    auto added = dir_block_add(block->data(), block_size, make_dir_entry(".", self, FileType::Directory));
+    if (added && *added)
+        added = dir_block_add(block->data(), block_size, make_dir_entry("..", parent, FileType::Directory));
+    if (!added)
+        return tl::make_unexpected(added.error());
+
+    block->mark_dirty();
+    return monostate{};
+}
+
+tl::expected<DirEntry, std::string> dir_lookup(Filesystem &fs, const Inode &dir, const std::string &name)
+{
+    if (dir.flags & INODE_INDEX)
+        return dx_lookup(fs, dir, name);
+
+    uint32_t block_size = fs.block_size();
+
+    for (uint32_t lblock = 0; lblock < dir.size / block_size; lblock++)
+    {
+        auto mapping = map_block(fs, dir, lblock);
+        if (!mapping)
+            return tl::make_unexpected(mapping.error());
+        if (mapping->start == 0)
+            continue;
+
+        auto block = fs.cache->get(mapping->start, &DIR_BLOCK_CHECKSUM);
+        if (!block)
+            return tl::make_unexpected(block.error());
+
+        auto found = dir_block_find(block->data(), block_size, name);
+        if (!found || found->inode != 0)
+            return found;
+    }
+
+    return DirEntry();
+}
+
+static tl::expected<monostate, std::string> check_name(const std::string &name)
+{
+    if (name.empty() || name.size() > MAX_NAME_LEN)
+        return tl::make_unexpected("Names must be between 1 and " + std::to_string(MAX_NAME_LEN) + " bytes long");
+
+    if (name.find('/') != std::string::npos || name.find('\0') != std::string::npos)
+        return tl::make_unexpected("Names can't contain '/' or NUL");
+
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> dir_add(Filesystem &fs, Inode &dir, const std::string &name, uint32_t ino,
+                                             FileType type)
+{
+    auto valid = check_name(name);
+    if (!valid)
+        return valid;
+
+    auto existing = dir_lookup(fs, dir, name);
+    if (!existing)
+        return tl::make_unexpected(existing.error());
+    if (existing->inode != 0)
+        return tl::make_unexpected(name + " already exists");
+
+    uint32_t block_size = fs.block_size();
+    DirEntry entry = make_dir_entry(name, ino, type);
+
+    if (dir.flags & INODE_INDEX)
+        return dx_add(fs, dir, entry);
+
+    uint64_t last = 0;
+    for (uint32_t lblock = 0; lblock < dir.size / block_size; lblock++)
+    {
+        auto mapping = map_block(fs, dir, lblock);
+        if (!mapping)
+            return tl::make_unexpected(mapping.error());
+        if (mapping->start == 0)
+            continue;
+
+        last = mapping->start;
+
+        auto block = fs.cache->get(mapping->start, &DIR_BLOCK_CHECKSUM);
+        if (!block)
+            return tl::make_unexpected(block.error());
+
+        auto guard = block->lock();
+        auto added = dir_block_add(block->data(), block_size, entry);
+        if (!added)
+            return tl::make_unexpected(added.error());
+
+        if (*added)
+        {
+            block->mark_dirty();
+            return monostate{};
+        }
+    }
+
+    // a directory outgrowing its first block gets indexed instead of scanned from then on
+    if (dir.size == block_size)
+    {
+        auto indexed = dx_convert(fs, dir);
+        if (!indexed)
+            return indexed;
+
+        return dx_add(fs, dir, entry);
+    }
+
+    // every block is full, keep the new one next to the last
+    auto block = dir_grow(fs, dir, last ? last + 1 : 0);
+    if (!block)
+        return tl::make_unexpected(block.error());
+
+    auto guard = block->lock();
+    auto added = dir_block_add(block->data(), block_size, entry);
+    if (!added)
+        return tl::make_unexpected(added.error());
+
+    block->mark_dirty();
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> dir_remove(Filesystem &fs, Inode &dir, const std::string &name)
+{
+    if (name == "." || name == "..")
+        return tl::make_unexpected("Can't remove " + name);
+
+    if (dir.flags & INODE_INDEX)
+        return dx_remove(fs, dir, name);
+
+    uint32_t block_size = fs.block_size();
+
+    for (uint32_t lblock = 0; lblock < dir.size / block_size; lblock++)
+    {
+        auto mapping = map_block(fs, dir, lblock);
+        if (!mapping)
+            return tl::make_unexpected(mapping.error());
+        if (mapping->start == 0)
+            continue;
+
+        auto block = fs.cache->get(mapping->start, &DIR_BLOCK_CHECKSUM);
+        if (!block)
+            return tl::make_unexpected(block.error());
+
+        auto guard = block->lock();
+        auto removed = dir_block_remove(block->data(), block_size, name);
+        if (!removed)
+            return tl::make_unexpected(removed.error());
+
+        if (*removed)
+        {
+            block->mark_dirty();
+            return monostate{};
+        }
+    }
+
+    return tl::make_unexpected(name + " doesn't exist");
+}
+
+tl::expected<std::vector<DirEntry>, std::string> dir_list(Filesystem &fs, const Inode &dir)
+{
+    uint32_t block_size = fs.block_size();
+    std::vector<DirEntry> entries;
+
+    for (uint32_t lblock = 0; lblock < dir.size / block_size; lblock++)
+    {
+        auto mapping = map_block(fs, dir, lblock);
+        if (!mapping)
+            return tl::make_unexpected(mapping.error());
+        if (mapping->start == 0)
+            continue;
+
+        auto block = fs.cache->get(mapping->start, &DIR_BLOCK_CHECKSUM);
+        if (!block)
+            return tl::make_unexpected(block.error());
+
+        auto listed = dir_block_list(block->data(), block_size, entries);
+        if (!listed)
+            return tl::make_unexpected(listed.error());
+    }
+
+    return entries;
+}
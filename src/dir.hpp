@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "expected.hpp"
+#include "filesystem.hpp"
+#include "fs.hpp"
+#include "monostate.hpp"
+
+/*
+    Directories are files made of blocks of variable length DirEntry records
+
+    -----------------------------------------------------------------------
+    | inode | entry_size | type | name_len | name ... | free space        |
+    -----------------------------------------------------------------------
+    |   4   |     2      |  2   |    1     | name_len | up to entry_size  |
+    -----------------------------------------------------------------------
+
+    Every block is covered by its entries end to end. A new entry takes over free
+    space left after an existing one, and removing an entry hands its space to the
+    one before it, so free space is always in one piece behind a live entry (or in
+    the first entry of a block, which is just marked unused)
+
+    The last DIR_TAIL_SIZE bytes of a block are left out of the entries and hold a
+    crc32c of the rest seeded with the block's number. Directory blocks go through
+    the cache with DIR_BLOCK_CHECKSUM, which keeps it up to date
+*/
+
+const uint32_t DIR_TAIL_SIZE = sizeof(uint32_t);
+
+extern const BlockChecksum DIR_BLOCK_CHECKSUM;
+
+// Bytes of a directory block the entries cover
+uint32_t dir_block_space(uint32_t block_size);
+
+// Bytes an entry with a name this long needs on disk
+uint32_t dir_entry_len(uint32_t name_len);
+
+DirEntry make_dir_entry(const std::string &name, uint32_t ino, FileType type);
+
+/*
+    Operations on a single directory block in memory, block_size being the whole block.
+    The add/remove ones return false when the entry doesn't fit or isn't there, errors
+    are for corrupt blocks
+*/
+void dir_block_init(char *block, uint32_t block_size);
+tl::expected<DirEntry, std::string> dir_block_find(const char *block, uint32_t block_size, const std::string &name);
+tl::expected<bool, std::string> dir_block_add(char *block, uint32_t block_size, const DirEntry &entry);
+tl::expected<bool, std::string> dir_block_remove(char *block, uint32_t block_size, const std::string &name);
+tl::expected<monostate, std::string> dir_block_list(const char *block, uint32_t block_size, std::vector<DirEntry> &entries);
+
+/*
+    Allocates and maps a new, empty block at the end of the directory, near goal.
+    Returns it pinned, the caller writes dir back after
+*/
+tl::expected<BufferRef, std::string> dir_grow(Filesystem &fs, Inode &dir, uint64_t goal);
+
+/*
+    Sets up a new directory with its "." and ".." entries, dir should be a freshly
+    allocated inode. Links are counted for both entries, so the parent's link_count
+    (for "..") is left to the caller
+*/
+tl::expected<monostate, std::string> dir_init(Filesystem &fs, Inode &dir, uint32_t self, uint32_t parent);
+
+/*
+    Directories that outgrow a single block are switched over to a hashed index (see
+    htree.hpp) automatically, these all work the same either way
+*/
+
+// Finds name in dir, the returned entry has inode 0 if it isn't there
+tl::expected<DirEntry, std::string> dir_lookup(Filesystem &fs, const Inode &dir, const std::string &name);
+
+// Adds an entry, growing the directory by a block if none has room. The caller writes dir back after
+tl::expected<monostate, std::string> dir_add(Filesystem &fs, Inode &dir, const std::string &name, uint32_t ino,
+                                             FileType type);
+
+tl::expected<monostate, std::string> dir_remove(Filesystem &fs, Inode &dir, const std::string &name);
+
+// Every entry in use, in on-disk order
+tl::expected<std::vector<DirEntry>, std::string> dir_list(Filesystem &fs, const Inode &dir);
@@ -0,0 +1,514 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "alloc.hpp"
+#include "extent.hpp"
+
+// Result of inserting into a node, block is 0 unless the node had to split in two
+struct Split
+{
+    uint32_t lblock;
+    uint32_t block;
+};
+
+static ExtentHeader *node_header(char *node)
+{
+    return (ExtentHeader *)node;
+}
+
+template <typename T>
+static T *node_entries(char *node)
+{
+    return (T *)(node + sizeof(ExtentHeader));
+}
+
+static uint16_t node_capacity(size_t bytes)
+{
+    return (bytes - sizeof(ExtentHeader)) / sizeof(Extent);
+}
+
+/*
+    Index of the last entry starting at or before lblock, -1 if they all start after it.
+    Both kinds of entry start with their logical block so one search does for both
+*/
+template <typename T>
+static int last_at_or_before(const T *entries, uint16_t count, uint32_t lblock)
+{
+    int lo = 0;
+    int hi = count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (entries[mid].lblock <= lblock)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+static void init_node(char *node, size_t bytes, uint16_t depth)
+{
+    std::memset(node, 0, bytes);
+
+    ExtentHeader *header = node_header(node);
+    header->magic = EXTENT_MAGIC;
+    header->entries = 0;
+    header->max = node_capacity(bytes);
+    header->depth = depth;
+}
+
+void extent_init(Inode &inode)
+{
+    init_node((char *)inode.block_ptrs, sizeof(inode.block_ptrs), 0);
+    inode.flags |= INODE_EXTENTS;
+}
+
+tl::expected<BlockMapping, std::string> extent_lookup(Filesystem &fs, const Inode &inode, uint32_t lblock)
+{
+    char *node = (char *)inode.block_ptrs;
+    BufferRef ref;
+
+    // where the subtree being walked ends, as far as the index above it says
+    uint32_t bound = UINT32_MAX;
+
+    while (true)
+    {
+        ExtentHeader *header = node_header(node);
+        if (header->magic != EXTENT_MAGIC || header->entries > header->max)
+            return tl::make_unexpected("Corrupt extent tree");
+
+        if (header->depth == 0)
+        {
+            Extent *extents = node_entries<Extent>(node);
+            int i = last_at_or_before(extents, header->entries, lblock);
+
+            if (i >= 0 && lblock - extents[i].lblock < extents[i].len)
+            {
+                uint32_t offset = lblock - extents[i].lblock;
+                return BlockMapping{extents[i].start + offset, extents[i].len - offset};
+            }
+
+            // a hole, running up to the next extent, which may be in a later leaf
+            uint32_t next = i + 1 < header->entries ? extents[i + 1].lblock : bound;
+            return BlockMapping{0, next - lblock};
+        }
+
+        // the first child also covers anything before its key
+        ExtentIndex *index = node_entries<ExtentIndex>(node);
+        int i = std::max(last_at_or_before(index, header->entries, lblock), 0);
+        if (header->entries == 0)
+            return tl::make_unexpected("Corrupt extent tree");
+
+        if (i + 1 < header->entries)
+            bound = index[i + 1].lblock;
+
+        auto child = fs.cache->get(index[i].child);
+        if (!child)
+            return tl::make_unexpected(child.error());
+
+        ref = std::move(*child);
+        node = ref.data();
+    }
+}
+
+static void mark_node_dirty(BufferRef *ref)
+{
+    if (ref)
+        ref->mark_dirty();
+}
+
+// Locks a node's block for changing it, the root lives in the inode and goes with it
+static std::unique_lock<std::mutex> lock_node(BufferRef *ref)
+{
+    return ref ? ref->lock() : std::unique_lock<std::mutex>();
+}
+
+/*
+    Puts entry at pos in a node, if the node is full it's split: the upper half moves
+    out to a new block taken from spare, or when appending to the end just the new
+    entry does, so sequentially written files end up with full leaves
+*/
+template <typename T>
+static tl::expected<Split, std::string> insert_entry(Filesystem &fs, char *node, BufferRef *ref, int pos,
+                                                     const T &entry, std::vector<BufferRef> &spare)
+{
+    ExtentHeader *header = node_header(node);
+    T *entries = node_entries<T>(node);
+
+    if (header->entries < header->max)
+    {
+        auto guard = lock_node(ref);
+        std::memmove(&entries[pos + 1], &entries[pos], (header->entries - pos) * sizeof(T));
+        entries[pos] = entry;
+        header->entries++;
+        mark_node_dirty(ref);
+        return Split{0, 0};
+    }
+
+    if (spare.empty())
+        return tl::make_unexpected("Extent tree split past the blocks set aside for it");
+
+    BufferRef sibling = std::move(spare.back());
+    spare.pop_back();
+
+    auto guard = lock_node(ref);
+    auto sibling_guard = sibling.lock();
+
+    char *other = sibling.data();
+    init_node(other, fs.block_size(), header->depth);
+
+    ExtentHeader *other_header = node_header(other);
+    T *other_entries = node_entries<T>(other);
+
+    int keep = pos == header->entries ? header->entries : header->entries / 2;
+    int moved = header->entries - keep;
+
+    std::memcpy(other_entries, &entries[keep], moved * sizeof(T));
+    other_header->entries = moved;
+    header->entries = keep;
+
+    if (pos <= keep && moved > 0)
+    {
+        std::memmove(&entries[pos + 1], &entries[pos], (keep - pos) * sizeof(T));
+        entries[pos] = entry;
+        header->entries++;
+    }
+    else
+    {
+        pos -= keep;
+        std::memmove(&other_entries[pos + 1], &other_entries[pos], (moved - pos) * sizeof(T));
+        other_entries[pos] = entry;
+        other_header->entries++;
+    }
+
+    mark_node_dirty(ref);
+    sibling.mark_dirty();
+
+    return Split{other_entries[0].lblock, (uint32_t)sibling.block()};
+}
+
+static bool follows(const Extent &first, const Extent &second)
+{
+    return first.lblock + first.len == second.lblock && first.start + first.len == second.start &&
+           (uint32_t)first.len + second.len <= MAX_EXTENT_LEN;
+}
+
+static tl::expected<Split, std::string> insert_node(Filesystem &fs, char *node, BufferRef *ref, const Extent &ext,
+                                                    std::vector<BufferRef> &spare)
+{
+    ExtentHeader *header = node_header(node);
+    if (header->magic != EXTENT_MAGIC || header->entries > header->max)
+        return tl::make_unexpected("Corrupt extent tree");
+
+    if (header->depth == 0)
+    {
+        Extent *extents = node_entries<Extent>(node);
+        int i = last_at_or_before(extents, header->entries, ext.lblock);
+
+        // grow a neighbour rather than add an entry when the blocks line up
+        if (i >= 0 && follows(extents[i], ext))
+        {
+            auto guard = lock_node(ref);
+            extents[i].len += ext.len;
+            if (i + 1 < header->entries && follows(extents[i], extents[i + 1]))
+            {
+                extents[i].len += extents[i + 1].len;
+                std::memmove(&extents[i + 1], &extents[i + 2], (header->entries - i - 2) * sizeof(Extent));
+                header->entries--;
+            }
+            mark_node_dirty(ref);
+            return Split{0, 0};
+        }
+
+        if (i + 1 < header->entries && follows(ext, extents[i + 1]))
+        {
+            auto guard = lock_node(ref);
+            extents[i + 1].lblock = ext.lblock;
+            extents[i + 1].start = ext.start;
+            extents[i + 1].len += ext.len;
+            mark_node_dirty(ref);
+            return Split{0, 0};
+        }
+
+        return insert_entry(fs, node, ref, i + 1, ext, spare);
+    }
+
+    if (header->entries == 0)
+        return tl::make_unexpected("Corrupt extent tree");
+
+    ExtentIndex *index = node_entries<ExtentIndex>(node);
+    int i = std::max(last_at_or_before(index, header->entries, ext.lblock), 0);
+
+    auto child = fs.cache->get(index[i].child);
+    if (!child)
+        return tl::make_unexpected(child.error());
+
+    auto split = insert_node(fs, child->data(), &*child, ext, spare);
+    if (!split || split->block == 0)
+        return split;
+
+    ExtentIndex entry = {split->lblock, split->block, 0};
+    return insert_entry(fs, node, ref, i + 1, entry, spare);
+}
+
+/*
+    How many new blocks inserting at lblock can take. A split only carries on up while
+    the parent is full too, so one for every full node from the leaf up, and if that
+    reaches the root another for the root's entries to move out to
+*/
+static tl::expected<uint32_t, std::string> split_blocks(Filesystem &fs, char *root, uint32_t lblock)
+{
+    std::vector<bool> full;
+    char *node = root;
+    BufferRef ref;
+
+    while (true)
+    {
+        ExtentHeader *header = node_header(node);
+        if (header->magic != EXTENT_MAGIC || header->entries > header->max)
+            return tl::make_unexpected("Corrupt extent tree");
+
+        full.push_back(header->entries == header->max);
+        if (header->depth == 0)
+            break;
+
+        if (header->entries == 0)
+            return tl::make_unexpected("Corrupt extent tree");
+
+        ExtentIndex *index = node_entries<ExtentIndex>(node);
+        int i = std::max(last_at_or_before(index, header->entries, lblock), 0);
+
+        auto child = fs.cache->get(index[i].child);
+        if (!child)
+            return tl::make_unexpected(child.error());
+
+        ref = std::move(*child);
+        node = ref.data();
+    }
+
+    uint32_t needed = 0;
+    while (needed < full.size() && full[full.size() - 1 - needed])
+        needed++;
+
+    return needed == full.size() ? needed + 1 : needed;
+}
+
+// Frees whatever of the blocks set aside for a split went unused
+static void release_spare(Filesystem &fs, std::vector<BufferRef> &spare)
+{
+    for (BufferRef &ref : spare)
+    {
+        uint64_t block = ref.block();
+        ref.reset();
+        free_blocks(fs, block, 1);
+    }
+    spare.clear();
+}
+
+/*
+    Allocates every block inserting ext can split into ahead of time, so running out
+    of space fails the insert before the tree is touched rather than halfway through
+    a split, with entries already moved to a block nothing points at yet
+*/
+static tl::expected<monostate, std::string> reserve_split(Filesystem &fs, char *root, const Extent &ext,
+                                                          std::vector<BufferRef> &spare)
+{
+    auto needed = split_blocks(fs, root, ext.lblock);
+    if (!needed)
+        return tl::make_unexpected(needed.error());
+
+    for (uint32_t i = 0; i < *needed; i++)
+    {
+        auto block = alloc_block(fs, ext.start);
+        if (!block)
+        {
+            release_spare(fs, spare);
+            return tl::make_unexpected(block.error());
+        }
+
+        auto fresh = fs.cache->get_new(*block);
+        if (!fresh)
+        {
+            free_blocks(fs, *block, 1);
+            release_spare(fs, spare);
+            return tl::make_unexpected(fresh.error());
+        }
+
+        spare.push_back(std::move(*fresh));
+    }
+
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> extent_insert(Filesystem &fs, Inode &inode, uint32_t lblock, uint32_t start,
+                                                   uint32_t len)
+{
+    if (!(inode.flags & INODE_EXTENTS))
+        return tl::make_unexpected("Inode isn't mapped with extents");
+
+    char *root = (char *)inode.block_ptrs;
+
+    while (len > 0)
+    {
+        Extent ext = {lblock, start, (uint16_t)std::min(len, MAX_EXTENT_LEN), 0};
+
+        std::vector<BufferRef> spare;
+        auto reserved = reserve_split(fs, root, ext, spare);
+        if (!reserved)
+            return reserved;
+
+        auto split = insert_node(fs, root, nullptr, ext, spare);
+        if (!split)
+        {
+            release_spare(fs, spare);
+            return tl::make_unexpected(split.error());
+        }
+
+        if (split->block != 0)
+        {
+            // the root can't split in place, its remaining half moves out into a block too
+            // and the root becomes an index over the two, making the tree a level deeper
+            if (spare.empty())
+                return tl::make_unexpected("Extent tree split past the blocks set aside for it");
+
+            BufferRef moved = std::move(spare.back());
+            spare.pop_back();
+
+            ExtentHeader *header = node_header(root);
+            uint16_t depth = header->depth;
+
+            auto guard = moved.lock();
+            init_node(moved.data(), fs.block_size(), depth);
+            node_header(moved.data())->entries = header->entries;
+            std::memcpy(node_entries<Extent>(moved.data()), node_entries<Extent>(root), header->entries * sizeof(Extent));
+            moved.mark_dirty();
+
+            uint32_t first = node_entries<Extent>(root)[0].lblock;
+
+            init_node(root, sizeof(inode.block_ptrs), depth + 1);
+            ExtentIndex *index = node_entries<ExtentIndex>(root);
+            index[0] = ExtentIndex{first, (uint32_t)moved.block(), 0};
+            index[1] = ExtentIndex{split->lblock, split->block, 0};
+            node_header(root)->entries = 2;
+        }
+
+        // a neighbour grew instead, or the split stopped short of the root
+        release_spare(fs, spare);
+
+        lblock += ext.len;
+        start += ext.len;
+        len -= ext.len;
+    }
+
+    return monostate{};
+}
+
+// Cuts a node down to the blocks before from, returns whether it's left empty
+static tl::expected<bool, std::string> truncate_node(Filesystem &fs, char *node, BufferRef *ref, uint32_t from,
+                                                     BlockReleaser &released)
+{
+    ExtentHeader *header = node_header(node);
+    if (header->magic != EXTENT_MAGIC || header->entries > header->max)
+        return tl::make_unexpected("Corrupt extent tree");
+
+    // the node is only locked while it's cut down, not while the children are or the blocks freed, as
+    // freeing takes the allocator's lock, which comes before any block's
+    std::vector<BlockRun> freed;
+    std::vector<bool> dropped(header->entries);
+
+    if (header->depth > 0)
+    {
+        ExtentIndex *index = node_entries<ExtentIndex>(node);
+        for (uint16_t i = 0; i < header->entries; i++)
+        {
+            // everything under a child ends before the next child's key
+            if (i + 1 < header->entries && index[i + 1].lblock <= from)
+                continue;
+
+            auto child = fs.cache->get(index[i].child);
+            if (!child)
+                return tl::make_unexpected(child.error());
+
+            auto emptied = truncate_node(fs, child->data(), &*child, from, released);
+            if (!emptied)
+                return emptied;
+
+            if (*emptied)
+            {
+                dropped[i] = true;
+                freed.push_back(BlockRun{index[i].child, 1});
+            }
+        }
+    }
+
+    uint16_t kept = 0;
+    {
+        auto guard = lock_node(ref);
+        bool changed = false;
+
+        if (header->depth == 0)
+        {
+            Extent *extents = node_entries<Extent>(node);
+            for (uint16_t i = 0; i < header->entries; i++)
+            {
+                Extent &ext = extents[i];
+                uint32_t cut = ext.lblock >= from ? 0 : std::min<uint32_t>(from - ext.lblock, ext.len);
+
+                if (cut < ext.len)
+                {
+                    freed.push_back(BlockRun{ext.start + cut, ext.len - cut});
+                    ext.len = cut;
+                    changed = true;
+                }
+
+                if (ext.len > 0)
+                    extents[kept++] = ext;
+            }
+        }
+        else
+        {
+            ExtentIndex *index = node_entries<ExtentIndex>(node);
+            for (uint16_t i = 0; i < header->entries; i++)
+            {
+                if (!dropped[i])
+                    index[kept++] = index[i];
+            }
+        }
+
+        if (changed || kept != header->entries)
+        {
+            header->entries = kept;
+            mark_node_dirty(ref);
+        }
+    }
+
+    for (const BlockRun &run : freed)
+    {
+        auto added = released.add(run.start, run.len);
+        if (!added)
+            return tl::make_unexpected(added.error());
+    }
+
+    return kept == 0;
+}
+
+tl::expected<monostate, std::string> extent_truncate(Filesystem &fs, Inode &inode, uint32_t from)
+{
+    if (!(inode.flags & INODE_EXTENTS))
+        return tl::make_unexpected("Inode isn't mapped with extents");
+
+    char *root = (char *)inode.block_ptrs;
+    BlockReleaser released(fs);
+
+    auto empty = truncate_node(fs, root, nullptr, from, released);
+    if (!empty)
+        return tl::make_unexpected(empty.error());
+
+    // with nothing left under it the root goes back to being an empty leaf
+    if (*empty)
+        init_node(root, sizeof(inode.block_ptrs), 0);
+
+    return released.flush();
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "expected.hpp"
+#include "filesystem.hpp"
+#include "fs.hpp"
+#include "monostate.hpp"
+
+/*
+    Extent tree mapping a file's logical blocks to physical blocks
+
+    Each extent covers a run of contiguous blocks, so a file written sequentially
+    maps with a handful of entries however big it gets. The root node lives in the
+    inode's block_ptrs (room for 4 entries), once that fills up entries spill out
+    into extent blocks and the root turns into an index over them. Every node starts
+    with a header, leaves (depth 0) hold extents and index nodes hold pointers to
+    the next level down, both sorted by logical block
+
+    ---------------------------------------------------
+    | Header | Entry 0 | Entry 1 | ... | Entry max - 1 |
+    ---------------------------------------------------
+    | 8 Bytes| 12 Bytes| 12 Bytes| ... |   12 Bytes    |
+    ---------------------------------------------------
+*/
+
+const uint16_t EXTENT_MAGIC = 0xF30A;
+
+// longest run a single extent can describe
+const uint32_t MAX_EXTENT_LEN = 0xFFFF;
+
+struct ExtentHeader
+{
+    uint16_t magic;
+    uint16_t entries;
+    uint16_t max;
+    // 0 for leaves
+    uint16_t depth;
+};
+
+struct Extent
+{
+    uint32_t lblock;
+    uint32_t start;
+    uint16_t len;
+    uint16_t _pad;
+};
+
+struct ExtentIndex
+{
+    uint32_t lblock;
+    uint32_t child;
+    uint32_t _pad;
+};
+
+static_assert(sizeof(Extent) == sizeof(ExtentIndex), "Leaf and index entries must be the same size");
+
+/*
+    Where a logical block lives, start is 0 for a hole. len is how many blocks from
+    there on are laid out contiguously (or for a hole, how far it's known to go)
+*/
+struct BlockMapping
+{
+    uint32_t start;
+    uint32_t len;
+};
+
+// Sets up an empty tree in the inode and flags it INODE_EXTENTS
+void extent_init(Inode &inode);
+
+tl::expected<BlockMapping, std::string> extent_lookup(Filesystem &fs, const Inode &inode, uint32_t lblock);
+
+/*
+    Maps len blocks at lblock to physical blocks starting at start, merging into a
+    neighbouring extent when they line up. The range must currently be a hole.
+    Extent blocks are allocated as needed, the caller writes the inode back after
+*/
+tl::expected<monostate, std::string> extent_insert(Filesystem &fs, Inode &inode, uint32_t lblock, uint32_t start,
+                                                   uint32_t len);
+
+/*
+    Unmaps everything from logical block from onwards and frees the blocks, extent
+    blocks left empty included. The caller writes the inode back after
+*/
+tl::expected<monostate, std::string> extent_truncate(Filesystem &fs, Inode &inode, uint32_t from);
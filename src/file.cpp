@@ -0,0 +1,611 @@
+#include <algorithm>
+#include <cstring>
+
+#include "alloc.hpp"
+#include "dir.hpp"
+#include "file.hpp"
+#include "inline_data.hpp"
+#include "inode_map.hpp"
+
+tl::expected<monostate, std::string> File::open(Filesystem &fs, uint32_t ino)
+{
+    close();
+
+    auto got = fs.inodes->get(ino);
+    if (!got)
+        return tl::make_unexpected(got.error());
+    if ((*got)->type == FileType::Unused)
+        return tl::make_unexpected("Inode " + std::to_string(ino) + " isn't in use");
+
+    this->fs = &fs;
+    inode = std::move(*got);
+    pos = 0;
+
+    auto guard = inode.lock();
+    map_generation = inode.map_generation();
+    return monostate{};
+}
+
+void File::close()
+{
+    map_cache.clear();
+    inode.reset();
+    fs = nullptr;
+}
+
+// Drops the indirect blocks map_cache holds if another File on the inode has unmapped blocks since, they may be freed and reused
+void File::check_map_cache()
+{
+    if (inode.map_generation() != map_generation)
+    {
+        map_cache.clear();
+        map_generation = inode.map_generation();
+    }
+}
+
+tl::expected<BlockMapping, std::string> File::map(uint32_t lblock)
+{
+    auto mapping = map_block(*fs, *inode, lblock, &map_cache);
+    if (mapping && mapping->len == 0)
+        return tl::make_unexpected("Corrupt block mapping in inode " + std::to_string(inode.ino()));
+    return mapping;
+}
+
+// Maps up to count new blocks at lblock, which has to be a hole, placed right after the block before it if possible
+tl::expected<BlockMapping, std::string> File::allocate(uint32_t lblock, uint32_t count)
+{
+    uint64_t goal = fs->group_start((inode.ino() - 1) / fs->sb.inodes_per_group);
+    if (lblock > 0)
+    {
+        auto before = map(lblock - 1);
+        if (!before)
+            return before;
+        if (before->start != 0)
+            goal = before->start + 1;
+    }
+
+    // indirect blocks the new blocks need come from the same allocation, in front of the data,
+    // so the next run can carry straight on from where this one ends
+    uint32_t meta = 0;
+    if (!(inode->flags & INODE_EXTENTS))
+    {
+        auto needed = indirect_needed(*fs, *inode, lblock, count, &map_cache);
+        if (!needed)
+            return tl::make_unexpected(needed.error());
+        meta = *needed;
+    }
+
+    auto run = alloc_blocks(*fs, goal, count + meta);
+    if (!run)
+        return tl::make_unexpected(run.error());
+
+    // a short run still has to leave at least a block for data
+    BlockRun reserved = {run->start, std::min(meta, run->len - 1)};
+    uint64_t start = run->start + reserved.len;
+    uint32_t len = run->len - reserved.len;
+
+    auto mapped = map_insert(*fs, *inode, lblock, start, len, &map_cache, &reserved);
+    inode.mark_dirty();
+
+    if (reserved.len > 0)
+        free_blocks(*fs, reserved.start, reserved.len);
+    if (!mapped)
+    {
+        free_blocks(*fs, start, len);
+        return tl::make_unexpected(mapped.error());
+    }
+
+    return BlockMapping{(uint32_t)start, len};
+}
+
+void File::read_ahead(uint32_t first, uint32_t last)
+{
+    if (!fs->readahead)
+        return;
+
+    uint32_t block_size = fs->block_size();
+    uint64_t num_blocks = (inode->size + block_size - 1) / block_size;
+
+    // the map runs later on the readahead thread, against the mapping as it is by then, so it takes
+    // its turn on the inode like any File
+    Filesystem *filesystem = fs;
+    uint32_t ino = inode.ino();
+    fs->readahead->access(ino, first, last, num_blocks, [filesystem, ino](uint64_t l) -> uint64_t
+                          {
+        auto ref = filesystem->inodes->get(ino);
+        if (!ref)
+            return 0;
+
+        auto guard = ref->lock();
+        auto mapping = map_block(*filesystem, **ref, l);
+        return mapping ? mapping->start : 0; });
+}
+
+uint64_t File::size() const
+{
+    auto guard = inode.lock();
+    return inode->size;
+}
+
+tl::expected<size_t, std::string> File::read(void *buf, size_t len)
+{
+    auto got = pread(pos, buf, len);
+    if (got)
+        pos += *got;
+    return got;
+}
+
+tl::expected<size_t, std::string> File::write(const void *buf, size_t len)
+{
+    auto put = pwrite(pos, buf, len);
+    if (put)
+        pos += *put;
+    return put;
+}
+
+tl::expected<size_t, std::string> File::pread(uint64_t offset, void *buf, size_t len)
+{
+    if (!fs)
+        return tl::make_unexpected("File isn't open");
+
+    auto guard = inode.lock();
+    check_map_cache();
+
+    if (offset >= inode->size)
+        return 0;
+    len = std::min<uint64_t>(len, inode->size - offset);
+
+    if (inode->flags & INODE_INLINE_DATA)
+        return inline_read(*inode, offset, buf, len);
+
+    char *out = (char *)buf;
+    uint32_t block_size = fs->block_size();
+
+    size_t done = 0;
+    while (done < len)
+    {
+        uint64_t at = offset + done;
+        uint32_t lblock = at / block_size;
+        uint32_t in_block = at % block_size;
+
+        auto mapping = map(lblock);
+        if (!mapping)
+            return tl::make_unexpected(mapping.error());
+
+        // as much as this mapping covers in one go
+        size_t n = std::min<uint64_t>(len - done, (uint64_t)mapping->len * block_size - in_block);
+
+        if (mapping->start == 0)
+        {
+            std::memset(out + done, 0, n);
+        }
+        else if (in_block == 0 && n >= block_size)
+        {
+            n -= n % block_size;
+            auto got = fs->cache->read_run(mapping->start, n / block_size, out + done);
+            if (!got)
+                return tl::make_unexpected(got.error());
+        }
+        else
+        {
+            n = std::min<size_t>(n, block_size - in_block);
+            auto block = fs->cache->get(mapping->start);
+            if (!block)
+                return tl::make_unexpected(block.error());
+            std::memcpy(out + done, block->data() + in_block, n);
+        }
+
+        done += n;
+    }
+
+    read_ahead(offset / block_size, (offset + len - 1) / block_size);
+    return len;
+}
+
+tl::expected<size_t, std::string> File::pwrite(uint64_t offset, const void *buf, size_t len)
+{
+    if (!fs)
+        return tl::make_unexpected("File isn't open");
+    if (is_dir(*inode))
+        return tl::make_unexpected("Can't write to a directory");
+    if (len == 0)
+        return 0;
+
+    uint32_t block_size = fs->block_size();
+    uint64_t last = (offset + len - 1) / block_size;
+    if (last > UINT32_MAX)
+        return tl::make_unexpected("Write goes past the largest possible file");
+
+    JournalHandle handle = fs->start_update(last - offset / block_size + 1);
+    auto guard = inode.lock();
+    check_map_cache();
+
+    if (inode->flags & INODE_INLINE_DATA)
+    {
+        if (offset + len <= INLINE_DATA_MAX)
+        {
+            auto written = inline_write(*inode, offset, buf, len);
+            if (!written)
+                return tl::make_unexpected(written.error());
+            inode.mark_dirty();
+            return len;
+        }
+
+        auto spilled = inline_spill(*fs, *inode, fs->group_start((inode.ino() - 1) / fs->sb.inodes_per_group));
+        if (!spilled)
+            return tl::make_unexpected(spilled.error());
+        inode.mark_dirty();
+    }
+
+    const char *in = (const char *)buf;
+    uint64_t old_blocks = (inode->size + block_size - 1) / block_size;
+
+    // nothing may stay mapped past the end of the file, if the write fails whatever it mapped there goes again
+    bool grew = false;
+    auto fail = [&](const std::string &error) -> tl::expected<size_t, std::string>
+    {
+        if (grew)
+        {
+            map_cache.clear();
+            map_truncate(*fs, *inode, old_blocks, &map_cache);
+            inode.unmapped();
+            map_generation = inode.map_generation();
+            inode.mark_dirty();
+        }
+        return tl::make_unexpected(error);
+    };
+
+    // blocks allocated by this write, anything of them not written over has to read back as zeroes
+    uint64_t fresh_start = 0;
+    uint64_t fresh_end = 0;
+
+    size_t done = 0;
+    while (done < len)
+    {
+        uint64_t at = offset + done;
+        uint32_t lblock = at / block_size;
+        uint32_t in_block = at % block_size;
+
+        auto mapping = map(lblock);
+        if (!mapping)
+            return fail(mapping.error());
+
+        if (mapping->start == 0)
+        {
+            // only as far as the hole goes, even past the old end of the file
+            uint64_t count = std::min<uint64_t>(last - lblock + 1, mapping->len);
+
+            mapping = allocate(lblock, count);
+            if (!mapping)
+                return fail(mapping.error());
+
+            if (lblock + mapping->len > old_blocks)
+                grew = true;
+
+            fresh_start = mapping->start;
+            fresh_end = fresh_start + mapping->len;
+        }
+
+        size_t n = std::min<uint64_t>(len - done, (uint64_t)mapping->len * block_size - in_block);
+
+        if (in_block == 0 && n >= block_size)
+        {
+            n -= n % block_size;
+            auto written = fs->cache->write_run(mapping->start, n / block_size, in + done);
+            if (!written)
+                return fail(written.error());
+        }
+        else
+        {
+            n = std::min<size_t>(n, block_size - in_block);
+
+            bool fresh = mapping->start >= fresh_start && mapping->start < fresh_end;
+            auto block = fresh ? fs->cache->get_new(mapping->start) : fs->cache->get(mapping->start);
+            if (!block)
+                return fail(block.error());
+
+            auto guard = block->lock();
+            if (fresh)
+                std::memset(block->data(), 0, block_size);
+            std::memcpy(block->data() + in_block, in + done, n);
+            block->mark_data_dirty();
+        }
+
+        done += n;
+    }
+
+    if (offset + len > inode->size)
+    {
+        inode->size = offset + len;
+        inode.mark_dirty();
+    }
+
+    return len;
+}
+
+tl::expected<monostate, std::string> File::truncate(uint64_t size)
+{
+    if (!fs)
+        return tl::make_unexpected("File isn't open");
+    if (is_dir(*inode))
+        return tl::make_unexpected("Can't truncate a directory");
+
+    uint32_t block_size = fs->block_size();
+    uint64_t new_blocks = (size + block_size - 1) / block_size;
+    if (new_blocks > UINT32_MAX)
+        return tl::make_unexpected("Truncating past the largest possible file");
+
+    // growing only leaves a hole, shrinking unmaps what's past the new end. The size is looked at
+    // again once the handle is taken, the lock can't be held while waiting for one
+    uint64_t old_blocks;
+    {
+        auto guard = inode.lock();
+        old_blocks = (inode->size + block_size - 1) / block_size;
+    }
+    JournalHandle handle = fs->start_update(new_blocks < old_blocks ? old_blocks - new_blocks : 0);
+
+    auto guard = inode.lock();
+    check_map_cache();
+    if (size == inode->size)
+        return monostate{};
+
+    if (inode->flags & INODE_INLINE_DATA)
+    {
+        if (size <= INLINE_DATA_MAX)
+        {
+            // whatever's past the end has to be zero for the file to grow back over it
+            if (size < inode->size)
+                std::memset((char *)inode->block_ptrs + size, 0, INLINE_DATA_MAX - size);
+
+            inode->size = size;
+            inode.mark_dirty();
+            return monostate{};
+        }
+
+        auto spilled = inline_spill(*fs, *inode, fs->group_start((inode.ino() - 1) / fs->sb.inodes_per_group));
+        if (!spilled)
+            return spilled;
+    }
+    else if (size < inode->size)
+    {
+        map_cache.clear();
+        auto freed = map_truncate(*fs, *inode, new_blocks, &map_cache);
+        inode.unmapped();
+        map_generation = inode.map_generation();
+        inode.mark_dirty();
+        if (!freed)
+            return freed;
+
+        // same for the rest of the new last block
+        if (size % block_size)
+        {
+            auto mapping = map(size / block_size);
+            if (!mapping)
+                return tl::make_unexpected(mapping.error());
+
+            if (mapping->start != 0)
+            {
+                auto block = fs->cache->get(mapping->start);
+                if (!block)
+                    return tl::make_unexpected(block.error());
+
+                auto guard = block->lock();
+                std::memset(block->data() + size % block_size, 0, block_size - size % block_size);
+                block->mark_data_dirty();
+            }
+        }
+
+        if (fs->readahead)
+            fs->readahead->forget(inode.ino());
+    }
+
+    inode->size = size;
+    inode.mark_dirty();
+    return monostate{};
+}
+
+tl::expected<FileSpan, std::string> File::span(uint64_t offset, size_t len)
+{
+    if (!fs)
+        return tl::make_unexpected("File isn't open");
+
+    auto guard = inode.lock();
+    check_map_cache();
+
+    FileSpan span;
+    if (offset >= inode->size)
+        return span;
+    len = std::min<uint64_t>(len, inode->size - offset);
+
+    if (inode->flags & INODE_INLINE_DATA)
+    {
+        span.data = (const char *)inode->block_ptrs + offset;
+        span.len = len;
+        return span;
+    }
+
+    uint32_t block_size = fs->block_size();
+    uint32_t lblock = offset / block_size;
+    uint32_t in_block = offset % block_size;
+
+    auto mapping = map(lblock);
+    if (!mapping)
+        return tl::make_unexpected(mapping.error());
+
+    span.len = std::min<size_t>(len, block_size - in_block);
+
+    if (mapping->start == 0)
+    {
+        zeroes.resize(block_size);
+        span.data = zeroes.data() + in_block;
+    }
+    else
+    {
+        auto block = fs->cache->get(mapping->start);
+        if (!block)
+            return tl::make_unexpected(block.error());
+
+        span.ref = std::move(*block);
+        span.data = span.ref.data() + in_block;
+    }
+
+    read_ahead(lblock, lblock);
+    return span;
+}
+
+// The type is checked under the lock since an unlink clears it; callers still check link_count once they lock
+static tl::expected<InodeRef, std::string> get_dir(Filesystem &fs, uint32_t dir)
+{
+    auto got = fs.inodes->get(dir);
+    if (!got)
+        return got;
+
+    auto guard = got->lock();
+    if (!is_dir(**got))
+        return tl::make_unexpected("Inode " + std::to_string(dir) + " is not a directory");
+    return got;
+}
+
+tl::expected<uint32_t, std::string> file_create(Filesystem &fs, uint32_t dir, const std::string &name, FileType type)
+{
+    if (type == FileType::Unused)
+        return tl::make_unexpected("Can't create a file without a type");
+
+    JournalHandle handle = fs.start_update();
+
+    auto parent = get_dir(fs, dir);
+    if (!parent)
+        return tl::make_unexpected(parent.error());
+
+    auto dir_guard = parent->lock();
+    if ((*parent)->link_count == 0)
+        return tl::make_unexpected("Directory " + std::to_string(dir) + " was removed");
+
+    auto ino = alloc_inode(fs, (dir - 1) / fs.sb.inodes_per_group, type);
+    if (!ino)
+        return ino;
+
+    Inode inode;
+    inode.type = type;
+    inode.link_count = 1;
+
+    if (type == FileType::Directory)
+    {
+        auto made = dir_init(fs, inode, *ino, dir);
+        if (!made)
+        {
+            free_inode(fs, *ino, type);
+            return tl::make_unexpected(made.error());
+        }
+    }
+    else
+    {
+        inline_init(inode);
+    }
+
+    auto added = dir_add(fs, **parent, name, *ino, type);
+    parent->mark_dirty();
+    if (!added)
+    {
+        if (!(inode.flags & INODE_INLINE_DATA))
+            map_truncate(fs, inode, 0);
+        free_inode(fs, *ino, type);
+        return tl::make_unexpected(added.error());
+    }
+
+    if (type == FileType::Directory)
+        (*parent)->link_count++;
+
+    auto child = fs.inodes->get(*ino);
+    if (!child)
+        return tl::make_unexpected(child.error());
+    **child = inode;
+    child->mark_dirty();
+
+    fs.dentries->insert(dir, name, *ino, type);
+    return *ino;
+}
+
+tl::expected<monostate, std::string> file_unlink(Filesystem &fs, uint32_t dir, const std::string &name)
+{
+    if (name == "." || name == "..")
+        return tl::make_unexpected("Can't unlink " + name);
+
+    JournalHandle handle = fs.start_update();
+
+    auto parent = get_dir(fs, dir);
+    if (!parent)
+        return tl::make_unexpected(parent.error());
+
+    auto dir_guard = parent->lock();
+    if ((*parent)->link_count == 0)
+        return tl::make_unexpected("Directory " + std::to_string(dir) + " was removed");
+
+    auto entry = dir_lookup(fs, **parent, name);
+    if (!entry)
+        return tl::make_unexpected(entry.error());
+    if (entry->inode == 0)
+        return tl::make_unexpected(name + " doesn't exist");
+
+    uint32_t ino = entry->inode;
+    auto child = fs.inodes->get(ino);
+    if (!child)
+        return tl::make_unexpected(child.error());
+
+    // the child is locked too, so nothing gets created in a directory between checking it's empty and removing it
+    auto child_guard = child->lock();
+    bool directory = is_dir(**child);
+    if (directory)
+    {
+        auto entries = dir_list(fs, **child);
+        if (!entries)
+            return tl::make_unexpected(entries.error());
+        if (entries->size() > 2)
+            return tl::make_unexpected(name + " isn't empty");
+    }
+
+    auto removed = dir_remove(fs, **parent, name);
+    parent->mark_dirty();
+    if (!removed)
+        return removed;
+
+    fs.dentries->forget(dir, name);
+
+    if (directory)
+    {
+        // its ".." goes away with it
+        (*parent)->link_count--;
+        (*child)->link_count = 0;
+        fs.dentries->forget_dir(ino);
+    }
+    else
+    {
+        (*child)->link_count--;
+    }
+
+    child->mark_dirty();
+    if ((*child)->link_count > 0)
+        return monostate{};
+
+    // last link gone, the file goes with it
+    if (!((*child)->flags & INODE_INLINE_DATA))
+    {
+        uint64_t blocks = ((*child)->size + fs.block_size() - 1) / fs.block_size();
+        handle.extend(fs.update_credits(blocks) - fs.update_credits(0));
+
+        auto freed = map_truncate(fs, **child, 0);
+        if (!freed)
+            return freed;
+    }
+
+    // cleared through the cache, so whoever else holds it sees it gone and the table gets the empty inode on flush
+    FileType type = (*child)->type;
+    **child = Inode();
+    child->mark_dirty();
+    child_guard.unlock();
+    child->reset();
+    if (fs.readahead)
+        fs.readahead->forget(ino);
+
+    return free_inode(fs, ino, type);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cache.hpp"
+#include "expected.hpp"
+#include "filesystem.hpp"
+#include "fs.hpp"
+#include "indirect.hpp"
+#include "inode_cache.hpp"
+#include "monostate.hpp"
+
+/*
+    File contents, read and written by inode number
+
+    Reads and writes go through the block mapping a run at a time. Whole blocks that
+    are contiguous on disk move as one I/O straight between the caller's buffer and
+    the image (anything of them that's cached is taken from the cache instead), only
+    partial blocks at either end of a request go through the block cache. Sequential
+    readers get readahead, holes read back as zeroes and files small enough stay
+    inline in their inode until a write pushes them past INLINE_DATA_MAX
+*/
+
+/*
+    Borrowed view of part of a file, no copy is made. data stays valid while the span
+    is held, as long as the file isn't written to or truncated in the meantime
+*/
+struct FileSpan
+{
+    const char *data = nullptr;
+    size_t len = 0;
+    // keeps the block data points into pinned, empty for inline data and holes
+    BufferRef ref;
+};
+
+/*
+    An open file, keeps the inode pinned in the inode cache until closed. Not thread
+    safe, each user opens their own like a file descriptor. Files open on the same
+    inode take turns through its InodeRef::lock, so reads never see a half made
+    mapping and writes and truncates don't trip over each other
+*/
+class File
+{
+public:
+    File() = default;
+    ~File() { close(); }
+
+    File(const File &) = delete;
+    File &operator=(const File &) = delete;
+
+    tl::expected<monostate, std::string> open(Filesystem &fs, uint32_t ino);
+    void close();
+    bool is_open() const { return fs != nullptr; }
+
+    // At the current position, which moves past what was read/written
+    tl::expected<size_t, std::string> read(void *buf, size_t len);
+    tl::expected<size_t, std::string> write(const void *buf, size_t len);
+
+    // Reads stop at the end of the file, writes past it leave a hole behind
+    tl::expected<size_t, std::string> pread(uint64_t offset, void *buf, size_t len);
+    tl::expected<size_t, std::string> pwrite(uint64_t offset, const void *buf, size_t len);
+
+    // Shrinking frees the blocks past the new end, growing leaves a hole
+    tl::expected<monostate, std::string> truncate(uint64_t size);
+
+    /*
+        Borrows up to len bytes at offset, stopping at the end of a block (or the file),
+        so it can come back shorter than asked for. Empty at the end of the file
+    */
+    tl::expected<FileSpan, std::string> span(uint64_t offset, size_t len);
+
+    void seek(uint64_t offset) { pos = offset; }
+    uint64_t tell() const { return pos; }
+
+    uint32_t ino() const { return inode.ino(); }
+    uint64_t size() const;
+
+private:
+    tl::expected<BlockMapping, std::string> map(uint32_t lblock);
+    tl::expected<BlockMapping, std::string> allocate(uint32_t lblock, uint32_t count);
+    void read_ahead(uint32_t first, uint32_t last);
+    void check_map_cache();
+
+    Filesystem *fs = nullptr;
+    InodeRef inode;
+    uint64_t pos = 0;
+    IndirectCache map_cache;
+    // the inode's map generation map_cache was filled under
+    uint64_t map_generation = 0;
+    // what a span over a hole points at
+    std::vector<char> zeroes;
+};
+
+/*
+    Creates an empty file called name in directory dir and returns its inode number.
+    Regular files start out with their data inline, directories get "." and "..".
+    Creates and unlinks in the same directory take turns, see InodeRef::lock
+*/
+tl::expected<uint32_t, std::string> file_create(Filesystem &fs, uint32_t dir, const std::string &name, FileType type);
+
+/*
+    Removes name from directory dir, the file itself is freed along with its blocks
+    once that was its last link. It mustn't be open, directories have to be empty
+*/
+tl::expected<monostate, std::string> file_unlink(Filesystem &fs, uint32_t dir, const std::string &name);
@@ -0,0 +1,326 @@
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#include "extent.hpp"
+#include "filesystem.hpp"
+
+Filesystem::~Filesystem()
+{
+    // nowhere to report errors from here, callers that care close first
+    close();
+}
+
+uint32_t Filesystem::blocks_in_group(uint32_t group) const
+{
+    return std::min<uint64_t>(sb.blocks_per_group, sb.num_blocks - group_start(group));
+}
+
+tl::expected<monostate, std::string> Filesystem::open(const std::string &path, const MountOptions &opts)
+{
+    // the superblock is always at the start of the image, whatever the block size turns out to be
+    auto opened = dev.open(path, 1024, false, opts.backend);
+    if (!opened)
+        return opened;
+
+    auto got = sb.read(dev, 0);
+    if (!got)
+        return got;
+
+    if (sb.log_block_size > 6 || sb.blocks_per_group == 0 || sb.inodes_per_group == 0 ||
+        sb.blocks_reserved >= sb.num_blocks)
+    {
+        return tl::make_unexpected(path + " doesn't contain a valid filesystem");
+    }
+
+    dev.set_block_size(sb.block_size());
+
+    auto size = dev.size();
+    if (!size)
+        return tl::make_unexpected(size.error());
+    if (*size < (uint64_t)sb.num_blocks * sb.block_size())
+        return tl::make_unexpected(path + " is smaller than the filesystem it holds");
+
+    if (sb.journal_blocks > 0)
+    {
+        if (sb.journal_start < sb.blocks_reserved || (uint64_t)sb.journal_start + sb.journal_blocks > sb.num_blocks)
+            return tl::make_unexpected(path + " has a journal outside the filesystem");
+
+        // anything committed but not yet checkpointed when it was last used goes in before the rest is read
+        auto replayed = journal_recover(dev, sb);
+        if (!replayed)
+            return tl::make_unexpected(replayed.error());
+
+        if (*replayed > 0)
+        {
+            got = sb.read(dev, 0);
+            if (!got)
+                return got;
+        }
+    }
+
+    auto read = read_descriptors(dev, sb);
+    if (!read)
+        return tl::make_unexpected(read.error());
+    descriptors = std::move(*read);
+    addressing = InodeAddressing(sb);
+
+    cache.reset(new BlockCache(dev, opts.cache_blocks));
+    dentries.reset(new DentryCache(opts.dentry_cache));
+    inodes.reset(new InodeCache(*this, opts.inode_cache));
+    if (opts.readahead > 0)
+        readahead.reset(new Readahead(*cache, 4, opts.readahead));
+
+    read_only = opts.read_only;
+    if (sb.journal_blocks > 0 && !read_only)
+    {
+        journal.reset(new Journal(*this, opts));
+        auto started = journal->open();
+        if (!started)
+            return started;
+    }
+
+    bool lazy = std::any_of(descriptors.begin(), descriptors.end(), [](const BlockGroupDescriptor &bgd)
+                            { return bgd.flags & BG_INODE_UNINIT; });
+    if (opts.init_itables && lazy && !read_only)
+    {
+        stop_init = false;
+        itable_init = std::thread([this]
+                                  { init_inode_tables(dev, sb, descriptors, meta_mtx, stop_init); });
+    }
+
+    return monostate{};
+}
+
+// Whether an inode sits in the untouched tail of a lazily initialized inode table
+bool Filesystem::inode_unused(const InodeLocation &loc)
+{
+    std::lock_guard<std::mutex> lock(meta_mtx);
+    const BlockGroupDescriptor &bgd = descriptors[loc.group];
+    uint32_t index = loc.ino - 1 - loc.group * sb.inodes_per_group;
+    return (bgd.flags & BG_INODE_UNINIT) && index >= sb.inodes_per_group - bgd.itable_unused;
+}
+
+tl::expected<Inode, std::string> Filesystem::read_inode(uint32_t ino)
+{
+    Inode inode;
+    if (inodes && ino != 0 && ino <= sb.num_inodes && inodes->peek(ino, inode))
+        return inode;
+
+    return load_inode(ino);
+}
+
+tl::expected<Inode, std::string> Filesystem::load_inode(uint32_t ino)
+{
+    if (ino == 0 || ino > sb.num_inodes)
+        return tl::make_unexpected("Inode " + std::to_string(ino) + " doesn't exist");
+
+    InodeLocation loc = locate_inode(ino);
+    if (inode_unused(loc))
+        return Inode();
+
+    auto block = cache->get(loc.block);
+    if (!block)
+        return tl::make_unexpected(block.error());
+
+    // the inode cache calls this unlocked, so a flush may be packing other inodes into the block
+    ByteBuffer buf(sizeof(Inode));
+    {
+        auto guard = block->lock();
+        std::memcpy(buf.data.data(), block->data() + loc.offset, sizeof(Inode));
+    }
+
+    Inode inode;
+    auto unpacked = unpack_inode(buf, inode, ino);
+    if (!unpacked)
+        return tl::make_unexpected(unpacked.error());
+
+    return inode;
+}
+
+tl::expected<std::vector<Inode>, std::string> Filesystem::read_inodes(const std::vector<uint32_t> &inos)
+{
+    for (uint32_t ino : inos)
+    {
+        if (ino == 0 || ino > sb.num_inodes)
+            return tl::make_unexpected("Inode " + std::to_string(ino) + " doesn't exist");
+    }
+
+    std::vector<InodeLocation> locs = addressing.locate_sorted(inos, descriptors);
+
+    // where each inode goes in the result, inode numbers can repeat
+    std::unordered_map<uint32_t, std::vector<size_t>> slots;
+    for (size_t i = 0; i < inos.size(); i++)
+        slots[inos[i]].push_back(i);
+
+    std::vector<Inode> result(inos.size());
+    ByteBuffer buf(sizeof(Inode));
+    BufferRef block;
+
+    for (size_t i = 0; i < locs.size(); i++)
+    {
+        // duplicates sort next to each other and were all filled in the first time round
+        if (i > 0 && locs[i].ino == locs[i - 1].ino)
+            continue;
+
+        // a cached copy may be newer than the table, and saves unpacking it
+        Inode inode;
+        bool cached = inodes && inodes->peek(locs[i].ino, inode);
+        if (!cached && !inode_unused(locs[i]))
+        {
+            if (!block || block.block() != locs[i].block)
+            {
+                auto got = cache->get(locs[i].block);
+                if (!got)
+                    return tl::make_unexpected(got.error());
+                block = std::move(*got);
+            }
+
+            std::memcpy(buf.data.data(), block.data() + locs[i].offset, sizeof(Inode));
+            buf.seekg(0);
+            auto unpacked = unpack_inode(buf, inode, locs[i].ino);
+            if (!unpacked)
+                return tl::make_unexpected(unpacked.error());
+        }
+
+        for (size_t slot : slots[locs[i].ino])
+            result[slot] = inode;
+    }
+
+    return result;
+}
+
+tl::expected<monostate, std::string> Filesystem::write_inode(uint32_t ino, const Inode &inode)
+{
+    if (ino == 0 || ino > sb.num_inodes)
+        return tl::make_unexpected("Inode " + std::to_string(ino) + " doesn't exist");
+
+    InodeLocation loc = locate_inode(ino);
+    auto block = cache->get(loc.block);
+    if (!block)
+        return tl::make_unexpected(block.error());
+
+    ByteBuffer buf(sizeof(Inode));
+    pack_inode(buf, inode, ino);
+
+    auto guard = block->lock();
+    std::memcpy(block->data() + loc.offset, buf.bytes(), sizeof(Inode));
+    block->mark_dirty();
+    return monostate{};
+}
+
+// Puts a block's worth of metadata into the cache, only dirtying it if it changed so idle commits stay empty
+static tl::expected<monostate, std::string> put_block(BlockCache &cache, uint64_t block, const char *data)
+{
+    auto buf = cache.get_new(block);
+    if (!buf)
+        return tl::make_unexpected(buf.error());
+
+    auto guard = buf->lock();
+    if (std::memcmp(buf->data(), data, cache.block_size()) != 0)
+    {
+        std::memcpy(buf->data(), data, cache.block_size());
+        buf->mark_dirty();
+    }
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> Filesystem::write_metadata()
+{
+    auto flushed = inodes->flush();
+    if (!flushed)
+        return flushed;
+
+    std::lock_guard<std::mutex> lock(meta_mtx);
+
+    uint32_t block_size = sb.block_size();
+
+    ByteBuffer super(block_size);
+    sb.serialize(super);
+
+    auto put = put_block(*cache, 0, super.bytes());
+    if (!put)
+        return put;
+
+    // descriptor table goes through the cache too so it's written in the same sweep
+    ByteBuffer gdt((size_t)(sb.blocks_reserved - 1) * block_size);
+    for (size_t i = 0; i < descriptors.size(); i++)
+    {
+        gdt.seekp(i * sizeof(BlockGroupDescriptor));
+        pack_descriptor(gdt, descriptors[i], i);
+    }
+
+    for (uint32_t i = 0; i + 1 < sb.blocks_reserved; i++)
+    {
+        put = put_block(*cache, 1 + i, gdt.bytes() + (size_t)i * block_size);
+        if (!put)
+            return put;
+    }
+
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> Filesystem::sync()
+{
+    if (!cache)
+        return monostate{};
+
+    // committing makes it all durable, the checkpoint leaves nothing for a replay to do
+    if (journal)
+    {
+        auto committed = journal->commit();
+        if (!committed)
+            return committed;
+        return journal->checkpoint();
+    }
+
+    auto written = write_metadata();
+    if (!written)
+        return written;
+
+    return cache->sync();
+}
+
+JournalHandle Filesystem::start_update(uint64_t blocks)
+{
+    return journal ? journal->start(update_credits(blocks)) : JournalHandle();
+}
+
+uint32_t Filesystem::update_credits(uint64_t blocks) const
+{
+    // the superblock, the inode and its directory's, the inode bitmap and the directory blocks a split can touch
+    uint64_t credits = 16;
+
+    // a bitmap and a descriptor for every group the blocks can spread over, and mapping blocks at one entry per block
+    // fragmented as badly as can be, plus a path down the tree at either end (no tree is more than 5 deep)
+    credits += 2 * (blocks / sb.blocks_per_group + 2);
+    credits += blocks / (block_size() / sizeof(Extent)) + 2 * 5;
+
+    return std::min<uint64_t>(credits, UINT32_MAX);
+}
+
+tl::expected<monostate, std::string> Filesystem::close()
+{
+    if (itable_init.joinable())
+    {
+        stop_init = true;
+        itable_init.join();
+    }
+
+    // prefetches in flight still use the cache
+    readahead.reset();
+
+    if (journal)
+        journal->stop();
+
+    // even with nothing changed, a sync would still log (or write) the superblock and descriptor table
+    tl::expected<monostate, std::string> synced = monostate{};
+    if (!read_only)
+        synced = sync();
+    journal.reset();
+    inodes.reset();
+    dentries.reset();
+    cache.reset();
+    dev.close();
+    return synced;
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block_device.hpp"
+#include "cache.hpp"
+#include "dentry.hpp"
+#include "inode_cache.hpp"
+#include "expected.hpp"
+#include "fs.hpp"
+#include "journal.hpp"
+#include "monostate.hpp"
+#include "readahead.hpp"
+
+/*
+    Knobs for how an existing image is opened
+*/
+struct MountOptions
+{
+    IOBackend backend = IOBackend::Pread;
+    // size of the block cache, in blocks
+    size_t cache_blocks = 8192;
+    // zero the inode tables of groups formatted with lazy_itable_init in the background
+    bool init_itables = true;
+    // number of (directory, name) lookups remembered, see DentryCache
+    size_t dentry_cache = 65536;
+    // number of inodes kept in memory, see InodeCache
+    size_t inode_cache = 16384;
+    // most blocks prefetched ahead of a sequential file reader, 0 turns readahead off
+    uint32_t readahead = 256;
+    // milliseconds between journal commits, 0 only commits when the running transaction fills up or on sync
+    uint32_t commit_interval = 5000;
+    // whether file contents reach the image before the metadata pointing at them is committed, see Journal
+    JournalMode journal_mode = JournalMode::Ordered;
+    // percentage of the journal in use at which it's checkpointed in the background, 0 checkpoints after every commit
+    uint32_t checkpoint_fill = 50;
+    // write nothing past the journal replay: no journal is run, inode tables aren't initialized and close doesn't sync.
+    // For looking only, nothing may be changed
+    bool read_only = false;
+};
+
+/*
+    An opened filesystem image
+
+    The superblock and descriptor table are read once and kept in memory, everything
+    else goes through the block cache. In-memory metadata only reaches the image on
+    sync (or close), or with a journal at every commit, meta_mtx guards sb and
+    descriptors while they're being changed
+*/
+struct Filesystem
+{
+    BlockDevice dev;
+    Superblock sb;
+    std::vector<BlockGroupDescriptor> descriptors;
+    InodeAddressing addressing;
+    std::unique_ptr<BlockCache> cache;
+    std::unique_ptr<DentryCache> dentries;
+    std::unique_ptr<InodeCache> inodes;
+    // null when readahead is turned off
+    std::unique_ptr<Readahead> readahead;
+    // null for filesystems made without a journal, or mounted read only
+    std::unique_ptr<Journal> journal;
+    std::mutex meta_mtx;
+    bool read_only = false;
+
+    Filesystem() = default;
+    ~Filesystem();
+
+    Filesystem(const Filesystem &) = delete;
+    Filesystem &operator=(const Filesystem &) = delete;
+
+    tl::expected<monostate, std::string> open(const std::string &path, const MountOptions &opts = MountOptions());
+
+    /*
+        Writes dirty inodes, the superblock, descriptor table and every dirty cached block back and syncs the image.
+        With a journal the running transaction is committed and checkpointed
+    */
+    tl::expected<monostate, std::string> sync();
+
+    // Puts dirty inodes, the superblock and the descriptor table into the block cache
+    tl::expected<monostate, std::string> write_metadata();
+
+    /*
+        Every operation changing metadata runs inside one of these, see JournalHandle. Empty without a journal.
+        blocks is how many file blocks the operation may map or unmap, it sizes the handle's credits
+    */
+    JournalHandle start_update(uint64_t blocks = 0);
+
+    // Credits covering an operation on one file and its directory that maps or unmaps up to blocks file blocks
+    uint32_t update_credits(uint64_t blocks) const;
+
+    // Stops the background initializer and syncs, the filesystem can't be used afterwards
+    tl::expected<monostate, std::string> close();
+
+    uint32_t block_size() const { return sb.block_size(); }
+    uint32_t num_groups() const { return descriptors.size(); }
+
+    uint64_t group_start(uint32_t group) const { return sb.blocks_reserved + (uint64_t)group * sb.blocks_per_group; }
+
+    // Last group can be short
+    uint32_t blocks_in_group(uint32_t group) const;
+
+    // Group a block past the descriptor table belongs to
+    uint32_t block_group(uint64_t block) const { return (block - sb.blocks_reserved) / sb.blocks_per_group; }
+
+    /*
+        Reads/writes an inode through the block cache. Reads take the inode cache's copy
+        if it has one, which may have changes not yet written back, writes bypass it.
+        Inodes past the itable_unused mark of a group whose table hasn't been zeroed yet
+        read back empty without touching it
+    */
+    tl::expected<Inode, std::string> read_inode(uint32_t ino);
+    tl::expected<monostate, std::string> write_inode(uint32_t ino, const Inode &inode);
+
+    // Same as read_inode but always from the inode table, for the inode cache to fill itself from
+    tl::expected<Inode, std::string> load_inode(uint32_t ino);
+
+    // Where an inode lives, ino has to exist
+    InodeLocation locate_inode(uint32_t ino) const { return addressing.locate(ino, descriptors); }
+
+    /*
+        Reads many inodes at once, in the order given, visiting each inode table block
+        only once however the numbers are spread. Cached inodes come from the inode
+        cache like with read_inode. For bulk stat style walks
+    */
+    tl::expected<std::vector<Inode>, std::string> read_inodes(const std::vector<uint32_t> &inos);
+
+private:
+    bool inode_unused(const InodeLocation &loc);
+
+    std::thread itable_init;
+    std::atomic<bool> stop_init{false};
+};
@@ -1,135 +1,538 @@
 #define FMT_HEADER_ONLY
 
-#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <vector>
 
+#include "alloc.hpp"
+#include "dir.hpp"
+#include "filesystem.hpp"
 #include "fs.hpp"
+#include "io_queue.hpp"
+#include "journal.hpp"
+#include "thread_pool.hpp"
 #include "fmt/core.h"
 
 // Have this helper that just calls the writable's write function since I don't want to
 // have to write it myself multiple times
-void write_to_fs(std::string fs_name, const IFSWritable &writable, uint32_t block_addr)
+tl::expected<monostate, std::string> write_to_fs(BlockDevice &dev, const IFSWritable &writable, uint32_t block_addr)
 {
-    writable.write(fs_name, block_addr);
+    return writable.write(dev, block_addr);
 }
 
-tl::expected<monostate, std::string> mkfs(int fs_size, int block_size, std::string fs_name, int inode_ratio)
+// Number of blocks needed to hold a group's inode table
+static uint32_t inode_table_blocks(uint32_t inodes_per_group, uint32_t block_size)
 {
-    // convert from KiB to bytes
-    fs_size = fs_size * 1024;
+    return ((uint64_t)inodes_per_group * sizeof(Inode) + block_size - 1) / block_size;
+}
+
+static void set_bit(char *bitmap, uint32_t bit)
+{
+    bitmap[bit / 8] |= (1 << (bit % 8));
+}
+
+// Descriptor fields in on-disk order
+void pack_descriptor(ByteBuffer &gdt, const BlockGroupDescriptor &bgd, uint32_t group)
+{
+    size_t start = gdt.pos;
+
+    WRITE(gdt, bgd.block_bitmap_addr);
+    WRITE(gdt, bgd.inode_bitmap_addr);
+    WRITE(gdt, bgd.inode_table);
+    WRITE(gdt, bgd.num_dirs);
+    WRITE(gdt, bgd.free_blocks);
+    WRITE(gdt, bgd.free_inodes);
+    WRITE(gdt, bgd.flags);
+    WRITE(gdt, bgd.itable_unused);
+    WRITE(gdt, bgd._pad);
+
+    uint32_t crc = crc32c(group, gdt.bytes() + start, gdt.pos - start);
+    WRITE(gdt, crc);
+}
+
+static tl::expected<monostate, std::string> unpack_descriptor(ByteBuffer &gdt, BlockGroupDescriptor &bgd, uint32_t group)
+{
+    size_t start = gdt.pos;
+
+    READ(gdt, bgd.block_bitmap_addr);
+    READ(gdt, bgd.inode_bitmap_addr);
+    READ(gdt, bgd.inode_table);
+    READ(gdt, bgd.num_dirs);
+    READ(gdt, bgd.free_blocks);
+    READ(gdt, bgd.free_inodes);
+    READ(gdt, bgd.flags);
+    READ(gdt, bgd.itable_unused);
+    READ(gdt, bgd._pad);
+
+    uint32_t crc = crc32c(group, gdt.bytes() + start, gdt.pos - start);
+    READ(gdt, bgd.checksum);
+    if (bgd.checksum != crc)
+        return tl::make_unexpected(fmt::format("Checksum mismatch in the descriptor of group {}", group));
+
+    return monostate{};
+}
+
+void pack_inode(ByteBuffer &buf, const Inode &inode, uint32_t ino)
+{
+    size_t start = buf.pos;
+
+    WRITE(buf, inode.type);
+    WRITE(buf, inode.link_count);
+    WRITE(buf, inode.flags);
+    WRITE(buf, inode.size);
+    WRITE(buf, inode.block_ptrs);
+    WRITE(buf, inode._pad);
+
+    uint32_t crc = inode.type == FileType::Unused ? 0 : crc32c(ino, buf.bytes() + start, buf.pos - start);
+    WRITE(buf, crc);
+}
+
+tl::expected<monostate, std::string> unpack_inode(ByteBuffer &buf, Inode &inode, uint32_t ino)
+{
+    size_t start = buf.pos;
+
+    READ(buf, inode.type);
+    READ(buf, inode.link_count);
+    READ(buf, inode.flags);
+    READ(buf, inode.size);
+    READ(buf, inode.block_ptrs);
+    READ(buf, inode._pad);
 
-    std::ofstream ofile(fs_name, std::ios::binary);
-    ofile.seekp((fs_size)-1);
-    ofile.write("\0", 1);
+    uint32_t crc = inode.type == FileType::Unused ? 0 : crc32c(ino, buf.bytes() + start, buf.pos - start);
+    READ(buf, inode.checksum);
+    if (inode.checksum != crc)
+        return tl::make_unexpected(fmt::format("Checksum mismatch in inode {}", ino));
 
-    if (block_size % 1024 != 0)
+    return monostate{};
+}
+
+/*
+    Assembles everything stored inside a block group (block bitmap, inode bitmap and
+    inode table, which sit back to back at the start of the group) in one buffer
+    so it can go out with a single write, instead of a stream write per field
+*/
+static ByteBuffer build_group(uint32_t block_size, const BlockGroupDescriptor &bgd, uint32_t group_index,
+                              uint32_t blocks_in_group, uint32_t inodes_per_group)
+{
+    uint32_t itable_blocks = inode_table_blocks(inodes_per_group, block_size);
+    uint32_t bits_per_bitmap = block_size * 8;
+
+    // an uninitialized group only gets its bitmaps, the inode table is zeroed later on demand
+    bool uninit = bgd.flags & BG_INODE_UNINIT;
+    ByteBuffer group((2 + (uninit ? 0 : itable_blocks)) * block_size);
+    char *block_bitmap = group.data.data();
+    char *inode_bitmap = block_bitmap + block_size;
+
+    // the group's own metadata blocks are in use
+    for (uint32_t i = 0; i < 2 + itable_blocks; i++)
+        set_bit(block_bitmap, i);
+
+    // bits past the end of a short group or past the last inode can never be handed out
+    for (uint32_t i = blocks_in_group; i < bits_per_bitmap; i++)
+        set_bit(block_bitmap, i);
+    for (uint32_t i = inodes_per_group; i < bits_per_bitmap; i++)
+        set_bit(inode_bitmap, i);
+
+    for (uint32_t i = 0; !uninit && i < inodes_per_group; i++)
     {
-        return tl::make_unexpected("Block size is not a power of 1024");
+        Inode inode;
+
+        group.seekp((2 * block_size) + (i * sizeof(Inode)));
+
+        pack_inode(group, inode, group_index * inodes_per_group + i + 1);
     }
 
-    int mut_block_size = block_size;
-    int log2_size = 0;
-    while (mut_block_size > 1024)
+    return group;
+}
+
+// Bytes of group images a worker lets pile up on its queue before waiting for them
+const size_t GROUP_BATCH_BYTES = 16 << 20;
+
+/*
+    One mkfs worker, writing groups handed out through next until there are none left.
+    All of them go through the worker's one queue and are only waited for every
+    GROUP_BATCH_BYTES, so with io_uring the writes of many groups are in flight at once
+*/
+static tl::expected<monostate, std::string> write_groups(BlockDevice &dev, const Geometry &geo,
+                                                         const std::vector<BlockGroupDescriptor> &descriptors,
+                                                         const std::vector<uint32_t> &group_sizes,
+                                                         std::atomic<uint32_t> &next)
+{
+    IOQueue queue(dev);
+    // the buffers have to outlive the writes queued from them
+    std::vector<ByteBuffer> pending;
+    size_t pending_bytes = 0;
+
+    for (uint32_t i = next++; i < geo.num_groups; i = next++)
     {
-        mut_block_size >>= 1; // Divide by 2
-        log2_size += 1;
+        pending.push_back(build_group(geo.block_size, descriptors[i], i, group_sizes[i], geo.inodes_per_group));
+        const ByteBuffer &group = pending.back();
+
+        // the image is fresh, so the all-zero inode table blocks don't need writing at all
+        queue.write_nonzero((uint64_t)descriptors[i].block_bitmap_addr * geo.block_size, group.bytes(), group.size());
+        pending_bytes += group.size();
+
+        if (pending_bytes >= GROUP_BATCH_BYTES)
+        {
+            auto written = queue.flush();
+            if (!written)
+                return written;
+
+            pending.clear();
+            pending_bytes = 0;
+        }
     }
 
+    return queue.flush();
+}
+
+tl::expected<Geometry, std::string> compute_geometry(uint64_t fs_size, uint32_t block_size, uint32_t inode_ratio)
+{
+    if (block_size < 1024 || block_size > 65536 || (block_size & (block_size - 1)) != 0)
+    {
+        return tl::make_unexpected("Block size must be a power of 2 between 1024 and 65536");
+    }
+
+    if (inode_ratio == 0)
+    {
+        return tl::make_unexpected("Inode ratio must be greater than 0");
+    }
+
+    Geometry geo;
+
+    geo.block_size = block_size;
+    geo.log_block_size = 0;
+    while ((1024u << geo.log_block_size) < block_size)
+        geo.log_block_size++;
+
     // This will lead to a bit of wasted space, but it's easiest to just make
     // full sized blocks and ignore the little bit left over
-    int num_blocks = fs_size / block_size;
-    int num_inodes = (num_blocks * block_size) / inode_ratio;
-    int blocks_per_group = block_size * 8;
-    int num_groups = std::ceil((double)num_blocks / (double)blocks_per_group);
-    int inodes_per_group = std::ceil((double)num_inodes / (double)num_groups);
+    geo.num_blocks = fs_size / block_size;
 
-    // fmt::println("Log Block Size: {}, Num Blocks: {}, Num Inodes: {}, Blocks Per Group: {}, Inodes Per Group: {}",
-    //              log2_size, num_blocks, num_inodes, blocks_per_group, inodes_per_group);
+    // one bitmap block per group, but free_blocks is only 16 bits
+    geo.blocks_per_group = std::min<uint32_t>(block_size * 8, 65536);
 
-    Superblock sb;
+    uint64_t num_groups = (geo.num_blocks + geo.blocks_per_group - 1) / geo.blocks_per_group;
+    if (num_groups == 0)
+    {
+        return tl::make_unexpected("Filesystem is too small to hold a single block group");
+    }
 
-    sb.num_blocks = num_blocks;
-    sb.num_inodes = num_inodes;
-    sb.num_free_blocks = num_blocks;
-    sb.num_free_inodes = num_inodes;
-    sb.log_block_size = log2_size;
-    sb.blocks_per_group = blocks_per_group;
-    sb.inodes_per_group = inodes_per_group;
-    sb.blocks_reserved = 1; // reserve superblock
+    uint64_t num_inodes = geo.num_blocks * block_size / inode_ratio;
+    uint64_t inodes_per_group = (num_inodes + num_groups - 1) / num_groups;
 
-    // ===========Block Group Descriptor Table===================
+    // inode bitmap is a single block and free_inodes/itable_unused are 16 bits,
+    // so a group can't track more than this many inodes no matter the ratio
+    uint64_t max_inodes_per_group = std::min<uint64_t>(block_size * 8, 65535);
+    geo.inodes_per_group = std::max<uint64_t>(1, std::min(inodes_per_group, max_inodes_per_group));
+
+    geo.gdt_blocks = (num_groups * sizeof(BlockGroupDescriptor) + block_size - 1) / block_size;
+
+    // groups start right after the superblock and the descriptor table
+    geo.first_group_block = 1 + geo.gdt_blocks;
+    geo.itable_blocks = inode_table_blocks(geo.inodes_per_group, block_size);
+
+    if (geo.num_blocks <= geo.first_group_block)
+    {
+        return tl::make_unexpected("Filesystem is too small to hold a single block group");
+    }
+
+    num_groups = (geo.num_blocks - geo.first_group_block + geo.blocks_per_group - 1) / geo.blocks_per_group;
+
+    // the last group can be partial, if it can't even hold its own metadata just drop it
+    uint64_t last_group_blocks = geo.num_blocks - geo.first_group_block - (num_groups - 1) * geo.blocks_per_group;
+    if (last_group_blocks <= geo.group_overhead())
+    {
+        num_groups--;
+        geo.num_blocks = geo.first_group_block + num_groups * geo.blocks_per_group;
+    }
 
-    write_to_fs(fs_name, sb, 0);
+    if (num_groups == 0 || geo.group_overhead() >= geo.blocks_per_group)
+    {
+        return tl::make_unexpected("Filesystem is too small to hold a single block group");
+    }
 
-    int gdt_blocks = (num_groups * sizeof(BlockGroupDescriptor)) / block_size;
-    // acount for any partial block needed
-    if ((num_groups * sizeof(BlockGroupDescriptor)) % block_size)
-        gdt_blocks++;
+    geo.num_groups = num_groups;
+    geo.num_inodes = num_groups * geo.inodes_per_group;
+
+    // block numbers and inode numbers are stored in 32 bits on disk
+    if (geo.num_blocks > UINT32_MAX)
+    {
+        return tl::make_unexpected(fmt::format("Filesystem has {} blocks, at most {} can be addressed, use a bigger block size",
+                                               geo.num_blocks, UINT32_MAX));
+    }
+    if (geo.num_inodes > UINT32_MAX)
+    {
+        return tl::make_unexpected(fmt::format("Filesystem has {} inodes, at most {} can be addressed, use a bigger inode ratio",
+                                               geo.num_inodes, UINT32_MAX));
+    }
 
-    sb.blocks_reserved += gdt_blocks;
+    return geo;
+}
 
-    std::ofstream(fs_name, std::ios::binary | std::ios::app);
+tl::expected<monostate, std::string> mkfs(uint64_t fs_size, uint32_t block_size, std::string fs_name, uint32_t inode_ratio,
+                                          const MkfsOptions &opts)
+{
+    // convert from KiB to bytes
+    fs_size = fs_size * 1024;
+
+    // work out and validate the whole layout before touching the image
+    auto layout = compute_geometry(fs_size, block_size, inode_ratio);
+    if (!layout)
+        return tl::make_unexpected(layout.error());
+
+    const Geometry &geo = *layout;
+
+    // one handle for the whole format instead of reopening the image for every structure
+    BlockDevice dev;
+    auto opened = dev.open(fs_name, block_size, true, opts.backend);
+    if (!opened)
+        return opened;
+
+    // the image starts out as one big hole, so anything left unwritten reads back as zeroes
+    auto sized = dev.resize(fs_size);
+    if (!sized)
+        return sized;
+
+    if (opts.preallocate)
+    {
+        sized = dev.preallocate(0, fs_size);
+        if (!sized)
+            return sized;
+    }
 
-    // skip over superblock and the blocks reserved for table
-    int first_free_block = sb.blocks_reserved + gdt_blocks;
+    // groups get written front to back
+    dev.advise(Access::Sequential);
+
+    // fmt::println("Log Block Size: {}, Num Blocks: {}, Num Inodes: {}, Blocks Per Group: {}, Inodes Per Group: {}",
+    //              geo.log_block_size, geo.num_blocks, geo.num_inodes, geo.blocks_per_group, geo.inodes_per_group);
+
+    Superblock sb;
+
+    sb.num_blocks = geo.num_blocks;
+    sb.num_inodes = geo.num_inodes;
+    sb.num_free_blocks = 0;
+    sb.num_free_inodes = 0;
+    sb.log_block_size = geo.log_block_size;
+    sb.blocks_per_group = geo.blocks_per_group;
+    sb.inodes_per_group = geo.inodes_per_group;
+    sb.blocks_reserved = geo.first_group_block; // reserve superblock and descriptor table
+    sb.journal_start = 0;                       // carved out of the data area once the groups are written
+    sb.journal_blocks = 0;
+
+    // ===========Block Group Descriptor Table===================
 
     std::vector<BlockGroupDescriptor> descriptors;
-    std::vector<Inode> inodes;
+    std::vector<uint32_t> group_sizes;
+
+    // descriptors are serialized into the table in memory and written once at the end
+    ByteBuffer gdt((size_t)geo.gdt_blocks * block_size);
 
-    for (int i = 0; i < gdt_blocks; i++)
+    for (uint32_t i = 0; i < geo.num_groups; i++)
     {
         BlockGroupDescriptor bgd;
-        // byte address of start of group
-        int group_start = block_size * (i + 1);
 
-        ofile.seekp(group_start + (i * 32), std::ios::beg);
+        uint64_t group_start = geo.group_start(i);
+        uint32_t blocks_in_group = std::min<uint64_t>(geo.blocks_per_group, geo.num_blocks - group_start);
 
-        bgd.block_bitmap_addr = first_free_block;
-        bgd.inode_bitmap_addr = first_free_block + 1;
-        bgd.inode_table = first_free_block + 2;
+        gdt.seekp(i * sizeof(BlockGroupDescriptor));
+
+        bgd.block_bitmap_addr = group_start;
+        bgd.inode_bitmap_addr = group_start + 1;
+        bgd.inode_table = group_start + 2;
         bgd.num_dirs = 0;
-        bgd.free_blocks = blocks_per_group - 3;
-        bgd.free_inodes = inodes_per_group;
+        bgd.free_blocks = blocks_in_group - geo.group_overhead();
+        bgd.free_inodes = geo.inodes_per_group;
+        bgd.flags = opts.lazy_itable_init ? BG_INODE_UNINIT : 0;
+        bgd.itable_unused = geo.inodes_per_group;
 
         // fmt::println("group_start: {}, seek_pos: {}, bitmap_addr: {}, inode_addr: {}, inode_table: {}, num_dirs: {}, free_blocks: {}, free_inodes: {}",
         //              group_start, group_start + (i * 32), bgd.block_bitmap_addr, bgd.inode_bitmap_addr, bgd.inode_table, bgd.num_dirs, bgd.free_blocks, bgd.free_inodes);
 
-        WRITE(ofile, bgd.block_bitmap_addr);
-        WRITE(ofile, bgd.inode_bitmap_addr);
-        WRITE(ofile, bgd.inode_table);
-        WRITE(ofile, bgd.num_dirs);
-        WRITE(ofile, bgd.free_blocks);
-        WRITE(ofile, bgd.free_inodes);
-        WRITE(ofile, bgd._pad);
+        pack_descriptor(gdt, bgd, i);
 
         descriptors.push_back(bgd);
 
-        // write inodes for this group
-        int addr = bgd.inode_table * block_size;
-        ofile.seekp(addr, std::ios::beg);
+        group_sizes.push_back(blocks_in_group);
 
-        for (int i = 0; i < inodes_per_group; i++)
-        {
-            Inode inode;
-
-            WRITE(ofile, inode.type);
-            WRITE(ofile, inode.size);
-            WRITE(ofile, inode.link_count);
-            WRITE(ofile, inode.block_ptrs);
-            WRITE(ofile, inode._pad);
+        sb.num_free_blocks += bgd.free_blocks;
+        sb.num_free_inodes += bgd.free_inodes;
+    }
 
-            inodes.push_back(inode);
+    // groups don't overlap once the layout is known, so they can be written
+    // concurrently with positional writes through the shared device
+    tl::expected<monostate, std::string> group_result = monostate{};
+    std::mutex result_mtx;
+    std::atomic<uint32_t> next_group(0);
+    {
+        ThreadPool pool(opts.jobs);
+        for (unsigned worker = 0; worker < pool.size(); worker++)
+        {
+            pool.submit([&]
+                        {
+                auto written = write_groups(dev, geo, descriptors, group_sizes, next_group);
+                if (!written)
+                {
+                    std::lock_guard<std::mutex> lock(result_mtx);
+                    group_result = written;
+                } });
         }
+        pool.wait();
     }
 
+    if (!group_result)
+        return group_result;
+
+    auto written = dev.write(block_size, gdt.bytes(), gdt.size());
+    if (!written)
+        return written;
+
+    // superblock goes last so its free counts cover every group
+    written = write_to_fs(dev, sb, 0);
+    if (!written)
+        return written;
+
+    // with the mmap backend nothing is guaranteed to reach the file until it's msynced
+    written = dev.sync();
+    if (!written)
+        return written;
+
+    dev.close();
+
     // ============ Root Directory =============
 
-    BlockGroupDescriptor &first_group = descriptors[0];
-    int inode_table = first_group.inode_table * block_size;
+    // everything the root needs (inode, bitmaps, a directory block) is easiest done on the formatted image
+    Filesystem fs;
+    MountOptions mount;
+    mount.backend = opts.backend;
+    mount.init_itables = false;
+
+    written = fs.open(fs_name, mount);
+    if (!written)
+        return written;
+
+    auto root_ino = alloc_inode(fs, 0, FileType::Directory);
+    if (!root_ino)
+        return tl::make_unexpected(root_ino.error());
+    if (*root_ino != ROOT_INO)
+        return tl::make_unexpected("Root directory didn't get inode " + std::to_string(ROOT_INO));
+
+    Inode root;
+    written = dir_init(fs, root, ROOT_INO, ROOT_INO);
+    if (!written)
+        return written;
+
+    written = fs.write_inode(ROOT_INO, root);
+    if (!written)
+        return written;
+
+    uint32_t journal_blocks = opts.journal_blocks;
+    if (journal_blocks == JOURNAL_AUTO)
+        journal_blocks = journal_size(sb);
+
+    if (journal_blocks > 0)
+    {
+        written = journal_create(fs, journal_blocks);
+        if (!written)
+            return written;
+    }
+
+    return fs.close();
+}
+
+tl::expected<std::vector<BlockGroupDescriptor>, std::string> read_descriptors(BlockDevice &dev, const Superblock &sb)
+{
+    uint32_t num_groups = sb.num_groups();
+    ByteBuffer gdt(num_groups * sizeof(BlockGroupDescriptor));
+
+    auto got = dev.read(sb.block_size(), gdt.data.data(), gdt.size());
+    if (!got)
+        return tl::make_unexpected(got.error());
+
+    std::vector<BlockGroupDescriptor> descriptors(num_groups);
+    for (uint32_t i = 0; i < num_groups; i++)
+    {
+        gdt.seekg(i * sizeof(BlockGroupDescriptor));
+        auto unpacked = unpack_descriptor(gdt, descriptors[i], i);
+        if (!unpacked)
+            return tl::make_unexpected(unpacked.error());
+    }
+
+    return descriptors;
+}
+
+// Zeroes inode table entries [from, to) of a group, widened out to whole blocks
+static tl::expected<monostate, std::string> zero_inodes(BlockDevice &dev, const BlockGroupDescriptor &bgd,
+                                                        uint32_t from, uint32_t to)
+{
+    uint32_t block_size = dev.block_size();
+    uint64_t start = (uint64_t)from * sizeof(Inode) / block_size * block_size;
+    uint64_t end = ((uint64_t)to * sizeof(Inode) + block_size - 1) / block_size * block_size;
 
-    Inode
+    return dev.zero_range((uint64_t)bgd.inode_table * block_size + start, end - start);
+}
 
+tl::expected<monostate, std::string> reserve_inode(BlockDevice &dev, const Superblock &sb,
+                                                   BlockGroupDescriptor &bgd, uint32_t index)
+{
+    uint32_t high_water = sb.inodes_per_group - bgd.itable_unused;
+    if (index < high_water)
         return monostate{};
+
+    if (bgd.flags & BG_INODE_UNINIT)
+    {
+        // zero through the end of index's block and move the mark there, so the mark always
+        // sits on a block boundary and a block that may hold live inodes is never zeroed twice
+        uint32_t per_block = dev.block_size() / sizeof(Inode);
+        uint32_t end = std::min(sb.inodes_per_group, (index / per_block + 1) * per_block);
+
+        auto zeroed = zero_inodes(dev, bgd, high_water, end);
+        if (!zeroed)
+            return zeroed;
+
+        bgd.itable_unused = sb.inodes_per_group - end;
+    }
+    else
+    {
+        bgd.itable_unused = sb.inodes_per_group - (index + 1);
+    }
+
+    if (bgd.itable_unused == 0)
+        bgd.flags &= ~BG_INODE_UNINIT;
+
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> init_inode_table(BlockDevice &dev, const Superblock &sb,
+                                                      BlockGroupDescriptor &bgd)
+{
+    if (!(bgd.flags & BG_INODE_UNINIT))
+        return monostate{};
+
+    auto zeroed = zero_inodes(dev, bgd, sb.inodes_per_group - bgd.itable_unused, sb.inodes_per_group);
+    if (!zeroed)
+        return zeroed;
+
+    // itable_unused stays as is, those inodes are still unused, they're just valid to read now
+    bgd.flags &= ~BG_INODE_UNINIT;
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> init_inode_tables(BlockDevice &dev, const Superblock &sb,
+                                                       std::vector<BlockGroupDescriptor> &descriptors,
+                                                       std::mutex &mtx, const std::atomic<bool> &stop)
+{
+    for (uint32_t group = 0; group < descriptors.size() && !stop; group++)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+
+        auto initialized = init_inode_table(dev, sb, descriptors[group]);
+        if (!initialized)
+            return initialized;
+    }
+
+    return monostate{};
 }
 
 bool is_dir(Inode &inode)
@@ -137,9 +540,46 @@ bool is_dir(Inode &inode)
     return inode.type == FileType::Directory;
 }
 
-uint32_t find_block(uint32_t inode_addr, Superblock &sb)
+static uint32_t shift_for(uint32_t value)
 {
-    uint32_t group = (inode_addr - 1) / sb.inodes_per_group;
-    uint32_t index = (inode_addr - 1) % sb.inodes_per_group;
-    return index * sizeof(Inode) / (1024 << sb.log_block_size);
-}
\ No newline at end of file
+    uint32_t shift = 0;
+    while ((1u << shift) < value)
+        shift++;
+    return shift;
+}
+
+InodeAddressing::InodeAddressing(const Superblock &sb)
+    : inodes_per_group(sb.inodes_per_group), inode_shift(shift_for(sizeof(Inode))), block_shift(10 + sb.log_block_size)
+{
+}
+
+InodeLocation InodeAddressing::locate(uint32_t ino, const std::vector<BlockGroupDescriptor> &descriptors) const
+{
+    uint32_t group = (ino - 1) / inodes_per_group;
+    uint64_t byte = (uint64_t)((ino - 1) - group * inodes_per_group) << inode_shift;
+
+    InodeLocation loc;
+    loc.ino = ino;
+    loc.group = group;
+    loc.block = descriptors[group].inode_table + (byte >> block_shift);
+    loc.offset = byte & ((1u << block_shift) - 1);
+    return loc;
+}
+
+std::vector<InodeLocation> InodeAddressing::locate_sorted(const std::vector<uint32_t> &inos,
+                                                          const std::vector<BlockGroupDescriptor> &descriptors) const
+{
+    std::vector<InodeLocation> locs;
+    locs.reserve(inos.size());
+    for (uint32_t ino : inos)
+        locs.push_back(locate(ino, descriptors));
+
+    std::sort(locs.begin(), locs.end(), [](const InodeLocation &a, const InodeLocation &b)
+              { return a.block != b.block ? a.block < b.block : a.offset < b.offset; });
+    return locs;
+}
+
+uint64_t find_block(uint32_t ino, const Superblock &sb, const std::vector<BlockGroupDescriptor> &descriptors)
+{
+    return InodeAddressing(sb).locate(ino, descriptors).block;
+}
@@ -1,9 +1,15 @@
 
 
+#pragma once
+
+#include <atomic>
 #include <cstdint>
+#include <mutex>
 #include <string>
-#include <fstream>
+#include <vector>
 
+#include "block_device.hpp"
+#include "crc32c.hpp"
 #include "expected.hpp"
 #include "optional.hpp"
 #include "monostate.hpp"
@@ -30,10 +36,11 @@ const int NUM_BLOCK_PTR = 15;
 
 #define BYTE_INFO(x) (char *)&x, sizeof(x)
 #define WRITE(ofile, x) ofile.write(BYTE_INFO(x))
+#define READ(ifile, x) ifile.read(BYTE_INFO(x))
 
 struct IFSWritable
 {
-    virtual void write(std::string fs_name, uint32_t block_addr) const = 0;
+    virtual tl::expected<monostate, std::string> write(BlockDevice &dev, uint32_t block_addr) const = 0;
 };
 
 /*
@@ -54,11 +61,24 @@ struct Superblock : public IFSWritable
     uint32_t blocks_per_group;
     uint32_t inodes_per_group;
     uint32_t blocks_reserved;
+    // metadata journal, a run of journal_blocks blocks from journal_start (0 blocks for none), see journal.hpp
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    // crc32c of everything above, filled in by serialize
+    uint32_t checksum = 0;
+
+    tl::expected<monostate, std::string> write(BlockDevice &dev, uint32_t block_addr) const
+    {
+        ByteBuffer ofile(1024 << log_block_size);
+        serialize(ofile);
+
+        return dev.write((uint64_t)block_addr * ofile.size(), ofile.bytes(), ofile.size());
+    }
 
-    void write(std::string fs_name, uint32_t block_addr) const
+    void serialize(ByteBuffer &ofile) const
     {
-        std::ofstream ofile(fs_name, std::ios::binary | std::ios::app);
-        ofile.seekp((block_addr * (1024 << log_block_size)));
+        size_t start = ofile.pos;
+
         WRITE(ofile, num_inodes);
         WRITE(ofile, num_blocks);
         WRITE(ofile, num_free_blocks);
@@ -69,10 +89,50 @@ struct Superblock : public IFSWritable
         WRITE(ofile, inodes_per_group);
         WRITE(ofile, blocks_reserved);
 
-        ofile.close();
+        WRITE(ofile, journal_start);
+        WRITE(ofile, journal_blocks);
+
+        uint32_t crc = crc32c(0, ofile.bytes() + start, ofile.pos - start);
+        WRITE(ofile, crc);
+    }
+
+    tl::expected<monostate, std::string> read(BlockDevice &dev, uint32_t block_addr)
+    {
+        ByteBuffer ifile(11 * sizeof(uint32_t));
+        auto got = dev.read((uint64_t)block_addr * dev.block_size(), ifile.data.data(), ifile.size());
+        if (!got)
+            return got;
+
+        READ(ifile, num_inodes);
+        READ(ifile, num_blocks);
+        READ(ifile, num_free_blocks);
+        READ(ifile, num_free_inodes);
+
+        READ(ifile, log_block_size);
+        READ(ifile, blocks_per_group);
+        READ(ifile, inodes_per_group);
+        READ(ifile, blocks_reserved);
+
+        READ(ifile, journal_start);
+        READ(ifile, journal_blocks);
+
+        uint32_t crc = crc32c(0, ifile.bytes(), ifile.pos);
+        READ(ifile, checksum);
+        if (checksum != crc)
+            return tl::make_unexpected("Superblock checksum doesn't match, not a rufs image or it's damaged");
+
+        return monostate{};
     }
+
+    uint32_t block_size() const { return 1024 << log_block_size; }
+
+    // Groups start right after the superblock and descriptor table
+    uint32_t num_groups() const { return (num_blocks - blocks_reserved + blocks_per_group - 1) / blocks_per_group; }
 };
 
+// Group's inode table hasn't been fully zeroed yet, see itable_unused
+const uint16_t BG_INODE_UNINIT = 0x1;
+
 /*
     Right after the superblock a table of these will describe every block
     in the filesystem. Size of 32 bytes so we can pack multiple descriptors
@@ -86,7 +146,13 @@ struct BlockGroupDescriptor
     uint16_t free_blocks;
     uint16_t free_inodes;
     uint16_t num_dirs;
-    char _pad[12] = {0};
+    uint16_t flags = 0;
+    // number of inodes at the end of the inode table that have never been handed out,
+    // in an uninitialized group everything from here on may still be garbage on disk
+    uint16_t itable_unused = 0;
+    char _pad[4] = {0};
+    // crc32c of the fields above seeded with the group number, so a descriptor copied into the wrong slot fails too
+    uint32_t checksum = 0;
 };
 
 /*
@@ -102,27 +168,102 @@ enum class FileType : uint16_t
     Text
 };
 
+// Inode flags, how block_ptrs is to be read
+const uint32_t INODE_EXTENTS = 0x1;     // holds the root of an extent tree, see extent.hpp
+const uint32_t INODE_INLINE_DATA = 0x2; // holds the file's contents, see inline_data.hpp
+const uint32_t INODE_INDEX = 0x4;       // directory has a hashed index, see htree.hpp
+
 /*
     Actually points the block containing the file
+
+    Laid out so there's no padding anywhere, every byte of the 128 is spelled out
 */
 struct Inode
 {
     FileType type = FileType::Unused;
-    uint64_t size = 0;
     uint16_t link_count = 0;
+    uint32_t flags = 0;
+    uint64_t size = 0;
     uint32_t block_ptrs[NUM_BLOCK_PTR] = {0};
-    char _pad[42] = {0};
+    char _pad[48] = {0};
+    // crc32c of the rest seeded with the inode number, 0 while the inode is unused
+    uint32_t checksum = 0;
 };
 
+static_assert(sizeof(Inode) == 128, "Inode must stay 128 bytes on disk");
+
+// Longest name a directory entry can hold
+const int MAX_NAME_LEN = 255;
+
+// Inode number of the root directory
+const uint32_t ROOT_INO = 1;
+
 /*
     Describes the layout of a entry into a directory
+
+    Entries are variable length on disk, only the first name_len bytes of name are
+    stored and entry_size is the distance to the next entry, which takes in any free
+    space left after this one. Entries are kept 4 byte aligned, an entry with
+    inode 0 is unused
 */
 struct DirEntry
 {
-    uint32_t inode;
-    uint16_t entry_size;
-    FileType type;
-    char name[11];
+    uint32_t inode = 0;
+    uint16_t entry_size = 0;
+    FileType type = FileType::Unused;
+    uint8_t name_len = 0;
+    char name[MAX_NAME_LEN] = {0};
+};
+
+// Size of an entry on disk before the name
+const uint32_t DIR_ENTRY_HEADER = 9;
+
+/*
+    Layout of a filesystem worked out from the requested size before anything is written.
+    Everything is computed in 64 bits and checked against what the 32/16-bit on-disk
+    fields can hold, so large images either format correctly or fail up front
+*/
+struct Geometry
+{
+    uint32_t block_size;
+    uint32_t log_block_size;
+    uint64_t num_blocks;
+    uint64_t num_inodes;
+    uint32_t num_groups;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    uint32_t gdt_blocks;
+    uint32_t itable_blocks;
+    uint32_t first_group_block;
+
+    // bitmaps + inode table at the start of every group
+    uint32_t group_overhead() const { return 2 + itable_blocks; }
+
+    uint64_t group_start(uint32_t group) const { return first_group_block + (uint64_t)group * blocks_per_group; }
+};
+
+/*
+    fs_size is in bytes here, block_size and inode_ratio as for mkfs
+*/
+tl::expected<Geometry, std::string> compute_geometry(uint64_t fs_size, uint32_t block_size, uint32_t inode_ratio);
+
+// Let mkfs size the journal to the filesystem
+const uint32_t JOURNAL_AUTO = UINT32_MAX;
+
+/*
+    Knobs for how mkfs goes about writing the image, only the journal size changes the layout
+*/
+struct MkfsOptions
+{
+    // size of the metadata journal in blocks, 0 leaves it out
+    uint32_t journal_blocks = JOURNAL_AUTO;
+    // number of threads formatting block groups concurrently, 0 uses one per core
+    int jobs = 1;
+    // skip zeroing inode tables, groups are flagged BG_INODE_UNINIT instead
+    bool lazy_itable_init = false;
+    // reserve disk space for the whole image instead of leaving zeroed regions as holes
+    bool preallocate = false;
+    IOBackend backend = IOBackend::Pread;
 };
 
 /*
@@ -137,11 +278,89 @@ struct DirEntry
     block_size defaults to 1024 bytes
     inode_ratio defaults to 1024 bytes / inode as most of these files should be failry small
 */
-tl::expected<monostate, std::string> mkfs(int fs_size, int block_size, std::string fs_name, int inode_ratio);
+tl::expected<monostate, std::string> mkfs(uint64_t fs_size, uint32_t block_size, std::string fs_name, uint32_t inode_ratio,
+                                          const MkfsOptions &opts = MkfsOptions());
+
+/*
+    Reads the block group descriptor table that follows the superblock
+*/
+tl::expected<std::vector<BlockGroupDescriptor>, std::string> read_descriptors(BlockDevice &dev, const Superblock &sb);
+
+// Serializes group's descriptor into its slot of an in-memory copy of the table, checksum included
+void pack_descriptor(ByteBuffer &gdt, const BlockGroupDescriptor &bgd, uint32_t group);
+
+/*
+    Inode fields in on-disk order. The checksum is worked out on the way in and
+    checked on the way out, except for unused inodes which have none
+*/
+void pack_inode(ByteBuffer &buf, const Inode &inode, uint32_t ino);
+tl::expected<monostate, std::string> unpack_inode(ByteBuffer &buf, Inode &inode, uint32_t ino);
+
+/*
+    Makes inode index (relative to the group) usable, zeroing the part of an uninitialized
+    inode table between the itable_unused mark and the block holding index, and moves
+    the mark past it. Must be called before handing out an inode from a group
+
+    Only bgd itself is changed, it reaches the image with the rest of the descriptor
+    table (through the journal when there is one), after the zeroes it vouches for
+*/
+tl::expected<monostate, std::string> reserve_inode(BlockDevice &dev, const Superblock &sb,
+                                                   BlockGroupDescriptor &bgd, uint32_t index);
+
+/*
+    Zeroes whatever is left of an uninitialized group's inode table and clears BG_INODE_UNINIT,
+    in bgd only like reserve_inode
+*/
+tl::expected<monostate, std::string> init_inode_table(BlockDevice &dev, const Superblock &sb,
+                                                      BlockGroupDescriptor &bgd);
+
+/*
+    Background initializer, walks every group zeroing uninitialized inode tables until done or
+    stop is set. mtx guards the descriptors and is only held for one group at a time so
+    allocations (which take the same lock around reserve_inode) can carry on in between
+*/
+tl::expected<monostate, std::string> init_inode_tables(BlockDevice &dev, const Superblock &sb,
+                                                       std::vector<BlockGroupDescriptor> &descriptors,
+                                                       std::mutex &mtx, const std::atomic<bool> &stop);
 
 bool is_dir(Inode &inode);
 
 /*
-    Returns the address of an block containing an inode address
+    Where an inode lives, block is the absolute address of the inode table block
+    holding it and offset is in bytes within that block
+*/
+struct InodeLocation
+{
+    uint32_t ino;
+    uint32_t group;
+    uint64_t block;
+    uint32_t offset;
+};
+
+static_assert((sizeof(Inode) & (sizeof(Inode) - 1)) == 0, "Inode addressing relies on sizeof(Inode) being a power of 2");
+
+/*
+    Turns inode numbers into locations for one filesystem. Both sizeof(Inode) and
+    the block size are powers of 2, so the shifts are worked out once and only the
+    split into groups needs a division
+*/
+struct InodeAddressing
+{
+    uint32_t inodes_per_group = 1;
+    uint32_t inode_shift = 0;
+    uint32_t block_shift = 0;
+
+    InodeAddressing() = default;
+    explicit InodeAddressing(const Superblock &sb);
+
+    InodeLocation locate(uint32_t ino, const std::vector<BlockGroupDescriptor> &descriptors) const;
+
+    // Locations sorted by inode table block then offset, so bulk reads visit each block once
+    std::vector<InodeLocation> locate_sorted(const std::vector<uint32_t> &inos,
+                                             const std::vector<BlockGroupDescriptor> &descriptors) const;
+};
+
+/*
+    Returns the address of the inode table block containing an inode
 */
-uint32_t find_block(uint32_t inode_addr, Superblock &sb);
\ No newline at end of file
+uint64_t find_block(uint32_t ino, const Superblock &sb, const std::vector<BlockGroupDescriptor> &descriptors);
\ No newline at end of file
@@ -0,0 +1,697 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "fmt/core.h"
+
+#include "bitmap.hpp"
+#include "dir.hpp"
+#include "extent.hpp"
+#include "fsck.hpp"
+#include "indirect.hpp"
+#include "inline_data.hpp"
+#include "thread_pool.hpp"
+
+// Inode table blocks read in one go
+const uint32_t FSCK_TABLE_CHUNK = 256;
+
+// What's left to know about an inode in use once its group has been scanned
+struct InodeInfo
+{
+    FileType type;
+    uint16_t link_count;
+};
+
+// An entry of directory dir
+struct EntryRef
+{
+    uint32_t dir;
+    uint32_t ino;
+    FileType type;
+    std::string name;
+};
+
+// Everything one worker found, merged once every group is done
+struct WorkerResult
+{
+    // tagged with the group they were found in, so the report comes out in group order
+    std::vector<std::pair<uint32_t, std::string>> problems;
+    uint64_t free_blocks = 0;
+    uint64_t free_inodes = 0;
+    uint64_t blocks_used = 0;
+    std::unordered_map<uint32_t, InodeInfo> inodes;
+    std::vector<EntryRef> entries;
+    // first read error, the worker skips whatever is left once it has one
+    std::string error;
+};
+
+/*
+    One bit per block of the filesystem, set once something is found using the
+    block. Shared by all the workers
+*/
+class BlockClaims
+{
+public:
+    explicit BlockClaims(uint64_t blocks) : words((blocks + 63) / 64) {}
+
+    // False if the block was claimed already
+    bool claim(uint64_t block)
+    {
+        uint64_t bit = 1ull << (block % 64);
+        return !(words[block / 64].fetch_or(bit) & bit);
+    }
+
+    bool claimed(uint64_t block) const { return words[block / 64].load() & (1ull << (block % 64)); }
+
+private:
+    std::vector<std::atomic<uint64_t>> words;
+};
+
+/*
+    Runs scan(worker, group) for every group on the pool. Each worker starts on its
+    own contiguous share of the groups, so neighbouring groups (and the blocks their
+    inodes tend to use) are read by the same thread. A worker whose share runs out
+    takes the back half of whichever share has the most left, so a group that takes
+    long (a huge directory, deep extent trees) doesn't leave the other threads idle
+*/
+static void scan_groups(ThreadPool &pool, uint32_t groups, const std::function<void(unsigned, uint32_t)> &scan)
+{
+    struct Share
+    {
+        std::mutex mtx;
+        uint32_t next = 0;
+        uint32_t end = 0;
+    };
+
+    unsigned workers = pool.size();
+    std::vector<Share> shares(workers);
+    for (unsigned w = 0; w < workers; w++)
+    {
+        shares[w].next = (uint64_t)groups * w / workers;
+        shares[w].end = (uint64_t)groups * (w + 1) / workers;
+    }
+
+    for (unsigned w = 0; w < workers; w++)
+    {
+        pool.submit([&shares, &scan, workers, w]
+                    {
+            Share &own = shares[w];
+            while (true)
+            {
+                bool found = false;
+                uint32_t group = 0;
+                {
+                    std::lock_guard<std::mutex> lock(own.mtx);
+                    if (own.next < own.end)
+                    {
+                        group = own.next++;
+                        found = true;
+                    }
+                }
+
+                if (found)
+                {
+                    scan(w, group);
+                    continue;
+                }
+
+                unsigned victim = w;
+                uint32_t most = 0;
+                for (unsigned v = 0; v < workers; v++)
+                {
+                    std::lock_guard<std::mutex> lock(shares[v].mtx);
+                    if (shares[v].end - shares[v].next > most)
+                    {
+                        most = shares[v].end - shares[v].next;
+                        victim = v;
+                    }
+                }
+
+                if (most == 0)
+                    return;
+
+                uint32_t start;
+                uint32_t end;
+                {
+                    std::lock_guard<std::mutex> lock(shares[victim].mtx);
+                    uint32_t left = shares[victim].end - shares[victim].next;
+                    if (left == 0)
+                        continue;
+
+                    end = shares[victim].end;
+                    start = end - (left + 1) / 2;
+                    shares[victim].end = start;
+                }
+
+                // nobody steals from an empty share, so it's safe to fill in without holding both locks
+                std::lock_guard<std::mutex> lock(own.mtx);
+                own.next = start;
+                own.end = end;
+            } });
+    }
+
+    pool.wait();
+}
+
+class Checker
+{
+public:
+    Checker(Filesystem &fs, unsigned workers)
+        : fs(fs), sb(fs.sb), claims(fs.sb.num_blocks), results(workers)
+    {
+    }
+
+    void claim_metadata();
+    void scan_group(unsigned worker, uint32_t group);
+    void compare_bitmap(unsigned worker, uint32_t group);
+    tl::expected<FsckReport, std::string> merge();
+
+private:
+    void problem(WorkerResult &result, uint32_t group, const std::string &text)
+    {
+        result.problems.push_back(std::make_pair(group, text));
+    }
+
+    void check_inode(WorkerResult &result, uint32_t group, uint32_t ino, const Inode &inode);
+    bool claim(WorkerResult &result, uint32_t group, uint32_t ino, uint64_t block);
+    void walk_extents(WorkerResult &result, uint32_t group, uint32_t ino, const char *node, uint16_t depth, bool root);
+    void walk_indirect(WorkerResult &result, uint32_t group, uint32_t ino, uint32_t block, int level);
+
+    Filesystem &fs;
+    const Superblock &sb;
+    BlockClaims claims;
+    std::vector<WorkerResult> results;
+    // problems found before the groups are scanned, listed first
+    std::vector<std::string> general;
+};
+
+/*
+    Claims the blocks every filesystem has whatever's in it: the superblock and
+    descriptor table, each group's bitmaps and inode table, and the journal
+*/
+void Checker::claim_metadata()
+{
+    for (uint64_t block = 0; block < sb.blocks_reserved; block++)
+        claims.claim(block);
+
+    uint32_t table_blocks = ((uint64_t)sb.inodes_per_group * sizeof(Inode) + fs.block_size() - 1) / fs.block_size();
+
+    for (uint32_t group = 0; group < fs.num_groups(); group++)
+    {
+        const BlockGroupDescriptor &bgd = fs.descriptors[group];
+        uint64_t start = fs.group_start(group);
+        uint64_t end = start + fs.blocks_in_group(group);
+
+        if (bgd.block_bitmap_addr < start || bgd.block_bitmap_addr >= end || bgd.inode_bitmap_addr < start ||
+            bgd.inode_bitmap_addr >= end || bgd.inode_table < start || (uint64_t)bgd.inode_table + table_blocks > end)
+        {
+            general.push_back(fmt::format("group {} has its bitmaps or inode table outside the group", group));
+            continue;
+        }
+
+        uint64_t metadata[] = {bgd.block_bitmap_addr, bgd.inode_bitmap_addr};
+        for (uint64_t block : metadata)
+        {
+            if (!claims.claim(block))
+                general.push_back(fmt::format("block {} holds more than one group's metadata", block));
+        }
+        for (uint64_t block = bgd.inode_table; block < bgd.inode_table + table_blocks; block++)
+        {
+            if (!claims.claim(block))
+                general.push_back(fmt::format("block {} holds more than one group's metadata", block));
+        }
+    }
+
+    for (uint64_t block = sb.journal_start; block < (uint64_t)sb.journal_start + sb.journal_blocks; block++)
+    {
+        if (!claims.claim(block))
+            general.push_back(fmt::format("journal block {} is also group metadata", block));
+    }
+}
+
+// False if the block can't belong to the inode, which has been reported
+bool Checker::claim(WorkerResult &result, uint32_t group, uint32_t ino, uint64_t block)
+{
+    if (block < sb.blocks_reserved || block >= sb.num_blocks)
+    {
+        problem(result, group, fmt::format("inode {} points at block {}, outside the filesystem's groups", ino, block));
+        return false;
+    }
+
+    if (!claims.claim(block))
+    {
+        problem(result, group, fmt::format("inode {} uses block {}, which is already in use", ino, block));
+        return false;
+    }
+
+    result.blocks_used++;
+    return true;
+}
+
+void Checker::walk_extents(WorkerResult &result, uint32_t group, uint32_t ino, const char *node, uint16_t depth, bool root)
+{
+    ExtentHeader header;
+    std::memcpy(&header, node, sizeof(header));
+
+    size_t bytes = root ? sizeof(Inode::block_ptrs) : fs.block_size();
+    uint16_t capacity = (bytes - sizeof(ExtentHeader)) / sizeof(Extent);
+
+    if (header.magic != EXTENT_MAGIC || header.max > capacity || header.entries > header.max ||
+        (!root && header.depth != depth))
+    {
+        problem(result, group, fmt::format("inode {} has a corrupt extent tree node", ino));
+        return;
+    }
+
+    const char *entries = node + sizeof(ExtentHeader);
+    uint64_t next_lblock = 0;
+
+    for (uint16_t i = 0; i < header.entries; i++)
+    {
+        // both kinds of entry start with their logical block
+        uint32_t lblock;
+        std::memcpy(&lblock, entries + i * sizeof(Extent), sizeof(lblock));
+        if (lblock < next_lblock)
+        {
+            problem(result, group, fmt::format("inode {} has extent tree entries out of order", ino));
+            return;
+        }
+
+        if (header.depth == 0)
+        {
+            Extent extent;
+            std::memcpy(&extent, entries + i * sizeof(Extent), sizeof(extent));
+            for (uint32_t b = 0; b < extent.len; b++)
+            {
+                if (!claim(result, group, ino, (uint64_t)extent.start + b))
+                    break;
+            }
+            next_lblock = (uint64_t)lblock + extent.len;
+            continue;
+        }
+
+        ExtentIndex index;
+        std::memcpy(&index, entries + i * sizeof(Extent), sizeof(index));
+        next_lblock = lblock;
+
+        if (!claim(result, group, ino, index.child))
+            continue;
+
+        auto child = fs.cache->get(index.child);
+        if (!child)
+        {
+            result.error = child.error();
+            return;
+        }
+        walk_extents(result, group, ino, child->data(), header.depth - 1, false);
+    }
+}
+
+// level is how many levels of pointers are below block, 0 for a data block
+void Checker::walk_indirect(WorkerResult &result, uint32_t group, uint32_t ino, uint32_t block, int level)
+{
+    if (!claim(result, group, ino, block) || level == 0)
+        return;
+
+    auto got = fs.cache->get(block);
+    if (!got)
+    {
+        result.error = got.error();
+        return;
+    }
+
+    // copied so the walk below doesn't keep a pin per level
+    std::vector<uint32_t> pointers(fs.block_size() / sizeof(uint32_t));
+    std::memcpy(pointers.data(), got->data(), fs.block_size());
+    got->reset();
+
+    for (uint32_t pointer : pointers)
+    {
+        if (pointer != 0)
+            walk_indirect(result, group, ino, pointer, level - 1);
+        if (!result.error.empty())
+            return;
+    }
+}
+
+void Checker::check_inode(WorkerResult &result, uint32_t group, uint32_t ino, const Inode &inode)
+{
+    if (inode.type != FileType::Directory && inode.type != FileType::Program && inode.type != FileType::Text)
+    {
+        problem(result, group, fmt::format("inode {} is marked in use but has no valid type", ino));
+        return;
+    }
+
+    if (inode.flags & INODE_INLINE_DATA)
+    {
+        if (inode.size > INLINE_DATA_MAX)
+            problem(result, group, fmt::format("inode {} has {} bytes of inline data, more than fits", ino, inode.size));
+    }
+    else if (inode.flags & INODE_EXTENTS)
+    {
+        walk_extents(result, group, ino, (const char *)inode.block_ptrs, 0, true);
+    }
+    else
+    {
+        for (int i = 0; i < NUM_BLOCK_PTR && result.error.empty(); i++)
+        {
+            if (inode.block_ptrs[i] != 0)
+                walk_indirect(result, group, ino, inode.block_ptrs[i], i < NUM_DIRECT_PTR ? 0 : i - NUM_DIRECT_PTR + 1);
+        }
+    }
+
+    result.inodes[ino] = InodeInfo{inode.type, inode.link_count};
+
+    if (inode.type != FileType::Directory || !result.error.empty())
+        return;
+
+    auto entries = dir_list(fs, inode);
+    if (!entries)
+    {
+        problem(result, group, fmt::format("directory {} can't be read: {}", ino, entries.error()));
+        return;
+    }
+
+    for (const DirEntry &entry : *entries)
+        result.entries.push_back(EntryRef{ino, entry.inode, entry.type, std::string(entry.name, entry.name_len)});
+}
+
+void Checker::scan_group(unsigned worker, uint32_t group)
+{
+    WorkerResult &result = results[worker];
+    if (!result.error.empty())
+        return;
+
+    const BlockGroupDescriptor &bgd = fs.descriptors[group];
+    uint32_t block_size = fs.block_size();
+    uint32_t ipg = sb.inodes_per_group;
+
+    auto block_bitmap = fs.cache->get(bgd.block_bitmap_addr);
+    if (!block_bitmap)
+    {
+        result.error = block_bitmap.error();
+        return;
+    }
+
+    uint32_t blocks = fs.blocks_in_group(group);
+    uint32_t free_blocks = blocks - count_ones((const uint8_t *)block_bitmap->data(), blocks);
+    result.free_blocks += free_blocks;
+    if (free_blocks != bgd.free_blocks)
+        problem(result, group, fmt::format("group {} has {} free blocks, its descriptor says {}", group, free_blocks, bgd.free_blocks));
+    block_bitmap->reset();
+
+    auto inode_bitmap = fs.cache->get(bgd.inode_bitmap_addr);
+    if (!inode_bitmap)
+    {
+        result.error = inode_bitmap.error();
+        return;
+    }
+
+    // copied, the inode walks below go through the cache too
+    std::vector<uint8_t> used(inode_bitmap->data(), inode_bitmap->data() + block_size);
+    inode_bitmap->reset();
+
+    uint32_t free_inodes = ipg - count_ones(used.data(), ipg);
+    result.free_inodes += free_inodes;
+    if (free_inodes != bgd.free_inodes)
+        problem(result, group, fmt::format("group {} has {} free inodes, its descriptor says {}", group, free_inodes, bgd.free_inodes));
+
+    // nothing past the itable_unused mark of an uninitialized table can be in use
+    uint32_t initialized = ipg;
+    if (bgd.flags & BG_INODE_UNINIT)
+    {
+        initialized = ipg - std::min<uint32_t>(bgd.itable_unused, ipg);
+        uint32_t first = find_first_one(used.data(), ipg, initialized);
+        if (first < ipg)
+            problem(result, group, fmt::format("inode {} is in use but its inode table block was never initialized",
+                                               group * ipg + first + 1));
+    }
+
+    uint32_t per_block = block_size / sizeof(Inode);
+    uint32_t table_blocks = (initialized + per_block - 1) / per_block;
+    std::vector<char> table((size_t)std::min(table_blocks, FSCK_TABLE_CHUNK) * block_size);
+    ByteBuffer buf(sizeof(Inode));
+    uint32_t dirs = 0;
+
+    for (uint32_t chunk = 0; chunk < table_blocks; chunk += FSCK_TABLE_CHUNK)
+    {
+        uint32_t count = std::min(FSCK_TABLE_CHUNK, table_blocks - chunk);
+        uint32_t first = chunk * per_block;
+        uint32_t last = std::min(initialized, (chunk + count) * per_block);
+
+        // whole chunks of free inodes don't need reading
+        if (find_first_one(used.data(), last, first) == last)
+            continue;
+
+        auto read = fs.cache->read_run(bgd.inode_table + chunk, count, table.data());
+        if (!read)
+        {
+            result.error = read.error();
+            return;
+        }
+
+        for (uint32_t index = find_first_one(used.data(), last, first); index < last;
+             index = find_first_one(used.data(), last, index + 1))
+        {
+            std::memcpy(buf.data.data(), &table[(size_t)(index - first) * sizeof(Inode)], sizeof(Inode));
+            buf.seekg(0);
+
+            uint32_t ino = group * ipg + index + 1;
+            Inode inode;
+            auto unpacked = unpack_inode(buf, inode, ino);
+            if (!unpacked)
+                problem(result, group, unpacked.error());
+
+            if (inode.type == FileType::Directory)
+                dirs++;
+
+            check_inode(result, group, ino, inode);
+            if (!result.error.empty())
+                return;
+        }
+    }
+
+    if (dirs != bgd.num_dirs)
+        problem(result, group, fmt::format("group {} has {} directories, its descriptor says {}", group, dirs, bgd.num_dirs));
+}
+
+// Reports runs of blocks whose bitmap bit doesn't match whether anything claimed them
+void Checker::compare_bitmap(unsigned worker, uint32_t group)
+{
+    WorkerResult &result = results[worker];
+    if (!result.error.empty())
+        return;
+
+    auto bitmap = fs.cache->get(fs.descriptors[group].block_bitmap_addr);
+    if (!bitmap)
+    {
+        result.error = bitmap.error();
+        return;
+    }
+
+    const uint8_t *bits = (const uint8_t *)bitmap->data();
+    uint64_t start = fs.group_start(group);
+    uint32_t blocks = fs.blocks_in_group(group);
+
+    uint32_t i = 0;
+    while (i < blocks)
+    {
+        bool marked = test_bit(bits, i);
+        if (marked == claims.claimed(start + i))
+        {
+            i++;
+            continue;
+        }
+
+        uint32_t run = i;
+        while (i < blocks && test_bit(bits, i) == marked && claims.claimed(start + i) != marked)
+            i++;
+
+        std::string blocks_text = i - run == 1 ? fmt::format("block {}", start + run)
+                                               : fmt::format("blocks {}-{}", start + run, start + i - 1);
+        if (marked)
+            problem(result, group, fmt::format("{} marked in use but nothing uses them", blocks_text));
+        else
+            problem(result, group, fmt::format("{} in use but marked free", blocks_text));
+    }
+}
+
+tl::expected<FsckReport, std::string> Checker::merge()
+{
+    FsckReport report;
+
+    // one worker's inodes and entries become the merged set, the rest are folded into it
+    WorkerResult all;
+    std::vector<std::pair<uint32_t, std::string>> problems;
+
+    for (WorkerResult &result : results)
+    {
+        if (!result.error.empty())
+            return tl::make_unexpected(result.error);
+
+        all.free_blocks += result.free_blocks;
+        all.free_inodes += result.free_inodes;
+        all.blocks_used += result.blocks_used;
+        all.inodes.insert(result.inodes.begin(), result.inodes.end());
+        all.entries.insert(all.entries.end(), std::make_move_iterator(result.entries.begin()),
+                           std::make_move_iterator(result.entries.end()));
+        problems.insert(problems.end(), result.problems.begin(), result.problems.end());
+
+        result = WorkerResult();
+    }
+
+    std::stable_sort(problems.begin(), problems.end(), [](const std::pair<uint32_t, std::string> &a, const std::pair<uint32_t, std::string> &b)
+                     { return a.first < b.first; });
+
+    report.problems = std::move(general);
+
+    uint64_t bgd_free_blocks = 0;
+    uint64_t bgd_free_inodes = 0;
+    for (const BlockGroupDescriptor &bgd : fs.descriptors)
+    {
+        bgd_free_blocks += bgd.free_blocks;
+        bgd_free_inodes += bgd.free_inodes;
+    }
+
+    if (sb.num_free_blocks != all.free_blocks)
+        report.problems.push_back(fmt::format("superblock says {} free blocks, the bitmaps have {}", sb.num_free_blocks, all.free_blocks));
+    if (sb.num_free_blocks != bgd_free_blocks)
+        report.problems.push_back(fmt::format("superblock says {} free blocks, the descriptors add up to {}", sb.num_free_blocks, bgd_free_blocks));
+    if (sb.num_free_inodes != all.free_inodes)
+        report.problems.push_back(fmt::format("superblock says {} free inodes, the bitmaps have {}", sb.num_free_inodes, all.free_inodes));
+    if (sb.num_free_inodes != bgd_free_inodes)
+        report.problems.push_back(fmt::format("superblock says {} free inodes, the descriptors add up to {}", sb.num_free_inodes, bgd_free_inodes));
+    if (sb.num_inodes != (uint64_t)sb.inodes_per_group * fs.num_groups())
+        report.problems.push_back(fmt::format("superblock says {} inodes, the groups hold {}", sb.num_inodes, (uint64_t)sb.inodes_per_group * fs.num_groups()));
+
+    for (auto &found : problems)
+        report.problems.push_back(std::move(found.second));
+
+    // what every directory entry points at has to exist and be what the entry says it is
+    std::unordered_map<uint32_t, uint32_t> links;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> children;
+    std::unordered_map<uint32_t, uint32_t> parents;
+
+    for (const EntryRef &entry : all.entries)
+    {
+        auto target = all.inodes.find(entry.ino);
+        if (target == all.inodes.end())
+        {
+            report.problems.push_back(fmt::format("entry \"{}\" in directory {} points at inode {}, which isn't in use",
+                                                  entry.name, entry.dir, entry.ino));
+            continue;
+        }
+
+        if (target->second.type != entry.type)
+            report.problems.push_back(fmt::format("entry \"{}\" in directory {} has a different type than inode {}",
+                                                  entry.name, entry.dir, entry.ino));
+
+        links[entry.ino]++;
+
+        if (entry.name == ".")
+        {
+            if (entry.ino != entry.dir)
+                report.problems.push_back(fmt::format("\".\" in directory {} points at inode {}", entry.dir, entry.ino));
+        }
+        else if (entry.name == "..")
+        {
+            parents[entry.dir] = entry.ino;
+        }
+        else
+        {
+            children[entry.dir].push_back(entry.ino);
+        }
+    }
+
+    auto root = all.inodes.find(ROOT_INO);
+    if (root == all.inodes.end() || root->second.type != FileType::Directory)
+    {
+        report.problems.push_back("root directory is missing");
+    }
+    else
+    {
+        // everything in use has to be reachable from the root, and each directory's ".." has to lead back the way it was found
+        std::unordered_set<uint32_t> reached{ROOT_INO};
+        std::vector<uint32_t> pending{ROOT_INO};
+
+        if (parents[ROOT_INO] != ROOT_INO)
+            report.problems.push_back("\"..\" in the root directory doesn't point at itself");
+
+        while (!pending.empty())
+        {
+            uint32_t dir = pending.back();
+            pending.pop_back();
+
+            for (uint32_t child : children[dir])
+            {
+                auto target = all.inodes.find(child);
+                if (target == all.inodes.end() || target->second.type != FileType::Directory)
+                {
+                    reached.insert(child);
+                    continue;
+                }
+
+                if (!reached.insert(child).second)
+                {
+                    report.problems.push_back(fmt::format("directory {} is linked from more than one place", child));
+                    continue;
+                }
+
+                if (parents[child] != dir)
+                    report.problems.push_back(fmt::format("\"..\" in directory {} points at {}, not {}", child, parents[child], dir));
+                pending.push_back(child);
+            }
+        }
+
+        std::vector<uint32_t> unreached;
+        for (auto &inode : all.inodes)
+        {
+            if (!reached.count(inode.first))
+                unreached.push_back(inode.first);
+        }
+
+        std::sort(unreached.begin(), unreached.end());
+        for (uint32_t ino : unreached)
+            report.problems.push_back(fmt::format("inode {} is in use but can't be reached from the root directory", ino));
+    }
+
+    std::vector<uint32_t> inos;
+    for (auto &inode : all.inodes)
+        inos.push_back(inode.first);
+    std::sort(inos.begin(), inos.end());
+
+    for (uint32_t ino : inos)
+    {
+        const InodeInfo &info = all.inodes[ino];
+        if (info.type == FileType::Directory)
+            report.directories++;
+
+        if (links[ino] != info.link_count)
+            report.problems.push_back(fmt::format("inode {} has a link count of {}, but {} entries point at it", ino, info.link_count, links[ino]));
+    }
+
+    report.inodes_used = all.inodes.size();
+    report.blocks_used = all.blocks_used;
+    return report;
+}
+
+tl::expected<FsckReport, std::string> fsck(Filesystem &fs, unsigned jobs)
+{
+    ThreadPool pool(jobs);
+    Checker checker(fs, pool.size());
+
+    checker.claim_metadata();
+
+    scan_groups(pool, fs.num_groups(), [&checker](unsigned worker, uint32_t group)
+                { checker.scan_group(worker, group); });
+
+    // only once every inode has claimed its blocks can the bitmaps be checked against them
+    scan_groups(pool, fs.num_groups(), [&checker](unsigned worker, uint32_t group)
+                { checker.compare_bitmap(worker, group); });
+
+    return checker.merge();
+}
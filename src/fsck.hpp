@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "expected.hpp"
+#include "filesystem.hpp"
+
+/*
+    Read-only consistency check of a whole filesystem
+
+    Block groups are scanned in parallel, each worker reading a group's bitmaps and
+    inode table and walking the block maps (extent trees or indirect blocks) and
+    directory entries of the inodes in use there. Blocks are claimed in one shared
+    bitmap as they're found, so a block claimed twice shows up straight away, the
+    rest of what the workers find is kept per worker and merged at the end
+
+    Checked are the superblock and descriptor free counts against the bitmaps, the
+    bitmaps against the blocks the group metadata, journal and inodes actually use,
+    every directory entry against the inode it points at, inode and directory block
+    checksums, link counts, and that every inode in use can be reached from the root
+    directory. A superblock or descriptor that fails its checksum stops the mount
+    before fsck gets to run
+*/
+
+struct FsckReport
+{
+    // one line per inconsistency, empty for a clean filesystem
+    std::vector<std::string> problems;
+    uint32_t inodes_used = 0;
+    uint32_t directories = 0;
+    uint64_t blocks_used = 0;
+
+    bool clean() const { return problems.empty(); }
+};
+
+/*
+    Checks fs, which shouldn't be changed while it runs. jobs of 0 uses one thread
+    per core. Errors are for failing to read the image, whatever is wrong with it
+    goes in the report
+*/
+tl::expected<FsckReport, std::string> fsck(Filesystem &fs, unsigned jobs = 0);
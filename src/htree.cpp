@@ -0,0 +1,493 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "dir.hpp"
+#include "htree.hpp"
+#include "inode_map.hpp"
+
+// where the index starts, in the root and in the index blocks below it
+static const uint32_t DX_ROOT_INFO = 24;
+static const uint32_t DX_ROOT_ENTRIES = 32;
+static const uint32_t DX_NODE_ENTRIES = 12;
+
+uint32_t dx_hash(const std::string &name)
+{
+    // FNV-1a, then murmur3's finalizer so names that only differ at the end still spread out
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : name)
+    {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    // low bit is kept for marking collisions
+    return hash & ~1u;
+}
+
+static DxCountLimit *count_limit(DxEntry *entries)
+{
+    return (DxCountLimit *)entries;
+}
+
+static uint16_t root_limit(uint32_t block_size)
+{
+    return (dir_block_space(block_size) - DX_ROOT_ENTRIES) / sizeof(DxEntry);
+}
+
+static uint16_t node_limit(uint32_t block_size)
+{
+    return (dir_block_space(block_size) - DX_NODE_ENTRIES) / sizeof(DxEntry);
+}
+
+static bool valid_index(DxEntry *entries, uint16_t limit)
+{
+    DxCountLimit *cl = count_limit(entries);
+    return cl->limit == limit && cl->count >= 1 && cl->count <= limit;
+}
+
+static tl::expected<BufferRef, std::string> dir_block(Filesystem &fs, const Inode &dir, uint32_t lblock)
+{
+    auto mapping = map_block(fs, dir, lblock);
+    if (!mapping)
+        return tl::make_unexpected(mapping.error());
+    if (mapping->start == 0)
+        return tl::make_unexpected("Directory index points at a hole");
+
+    return fs.cache->get(mapping->start, &DIR_BLOCK_CHECKSUM);
+}
+
+// One level of the walk down the index, at is the entry that was followed
+struct DxFrame
+{
+    BufferRef buf;
+    DxEntry *entries;
+    uint16_t at;
+};
+
+struct DxPath
+{
+    DxFrame frames[DX_MAX_LEVELS + 1];
+    // the frame that points at leaves
+    int levels;
+
+    uint32_t leaf() const { return frames[levels].entries[frames[levels].at].block; }
+};
+
+// Walks from the root down to the leaf hash belongs in
+static tl::expected<monostate, std::string> dx_probe(Filesystem &fs, const Inode &dir, uint32_t hash, DxPath &path)
+{
+    uint32_t block_size = fs.block_size();
+
+    auto root = dir_block(fs, dir, 0);
+    if (!root)
+        return tl::make_unexpected(root.error());
+
+    DxRootInfo *info = (DxRootInfo *)(root->data() + DX_ROOT_INFO);
+    if (info->hash_version != DX_HASH_VERSION || info->info_length != sizeof(DxRootInfo) ||
+        info->indirect_levels > DX_MAX_LEVELS)
+    {
+        return tl::make_unexpected("Corrupt directory index");
+    }
+
+    path.levels = info->indirect_levels;
+
+    BufferRef buf = std::move(*root);
+    DxEntry *entries = (DxEntry *)(buf.data() + DX_ROOT_ENTRIES);
+    uint16_t limit = root_limit(block_size);
+
+    for (int level = 0;; level++)
+    {
+        if (!valid_index(entries, limit))
+            return tl::make_unexpected("Corrupt directory index");
+
+        // last entry whose hash is at or below ours, the first one has no hash and catches the rest
+        int lo = 1;
+        int hi = count_limit(entries)->count;
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (entries[mid].hash <= hash)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        DxFrame &frame = path.frames[level];
+        frame.buf = std::move(buf);
+        frame.entries = entries;
+        frame.at = lo - 1;
+
+        if (level == path.levels)
+            return monostate{};
+
+        auto node = dir_block(fs, dir, entries[frame.at].block);
+        if (!node)
+            return tl::make_unexpected(node.error());
+
+        buf = std::move(*node);
+        entries = (DxEntry *)(buf.data() + DX_NODE_ENTRIES);
+        limit = node_limit(block_size);
+    }
+}
+
+/*
+    Moves the path on to the next leaf if it carries on a run of colliding hashes
+    from the current one, returns false if there's nowhere else hash could be
+*/
+static tl::expected<bool, std::string> dx_next_leaf(Filesystem &fs, const Inode &dir, uint32_t hash, DxPath &path)
+{
+    int level = path.levels;
+    while (path.frames[level].at + 1 >= count_limit(path.frames[level].entries)->count)
+    {
+        if (level == 0)
+            return false;
+        level--;
+    }
+
+    DxFrame &frame = path.frames[level];
+    frame.at++;
+
+    uint32_t next = frame.entries[frame.at].hash;
+    if (!(next & 1) || (next & ~1u) != hash)
+        return false;
+
+    // start the levels below over from their first entry
+    for (; level < path.levels; level++)
+    {
+        DxFrame &parent = path.frames[level];
+        auto node = dir_block(fs, dir, parent.entries[parent.at].block);
+        if (!node)
+            return tl::make_unexpected(node.error());
+
+        DxFrame &child = path.frames[level + 1];
+        child.buf = std::move(*node);
+        child.entries = (DxEntry *)(child.buf.data() + DX_NODE_ENTRIES);
+        child.at = 0;
+
+        if (!valid_index(child.entries, node_limit(fs.block_size())))
+            return tl::make_unexpected("Corrupt directory index");
+    }
+
+    return true;
+}
+
+// Puts a new entry into an index right after at
+static void insert_index(DxFrame &frame, uint32_t hash, uint32_t block)
+{
+    DxCountLimit *cl = count_limit(frame.entries);
+    DxEntry *entries = frame.entries;
+
+    auto guard = frame.buf.lock();
+    std::memmove(&entries[frame.at + 2], &entries[frame.at + 1], (cl->count - frame.at - 1) * sizeof(DxEntry));
+    entries[frame.at + 1] = DxEntry{hash, block};
+    cl->count++;
+
+    frame.buf.mark_dirty();
+}
+
+tl::expected<monostate, std::string> dx_convert(Filesystem &fs, Inode &dir)
+{
+    uint32_t block_size = fs.block_size();
+    if (dir.size != block_size)
+        return tl::make_unexpected("Only single block directories can be indexed");
+
+    auto first = dir_block(fs, dir, 0);
+    if (!first)
+        return tl::make_unexpected(first.error());
+
+    std::vector<DirEntry> entries;
+    auto listed = dir_block_list(first->data(), block_size, entries);
+    if (!listed)
+        return listed;
+
+    // everything but "." and ".." moves out to the first leaf
+    auto leaf = dir_grow(fs, dir, first->block() + 1);
+    if (!leaf)
+        return tl::make_unexpected(leaf.error());
+
+    uint32_t self = 0;
+    uint32_t parent = 0;
+    auto leaf_guard = leaf->lock();
+    for (const DirEntry &entry : entries)
+    {
+        std::string name(entry.name, entry.name_len);
+        if (name == ".")
+        {
+            self = entry.inode;
+            continue;
+        }
+        if (name == "..")
+        {
+            parent = entry.inode;
+            continue;
+        }
+
+        auto added = dir_block_add(leaf->data(), block_size, entry);
+        if (!added)
+            return tl::make_unexpected(added.error());
+        if (!*added)
+            return tl::make_unexpected("Corrupt directory block");
+    }
+    leaf->mark_dirty();
+    leaf_guard.unlock();
+
+    // ".." ends up owning the rest of block 0, which is where the root goes
+    auto guard = first->lock();
+    char *root = first->data();
+    dir_block_init(root, block_size);
+
+    auto added = dir_block_add(root, block_size, make_dir_entry(".", self, FileType::Directory));
+    if (added && *added)
+        added = dir_block_add(root, block_size, make_dir_entry("..", parent, FileType::Directory));
+    if (!added)
+        return tl::make_unexpected(added.error());
+
+    DxRootInfo *info = (DxRootInfo *)(root + DX_ROOT_INFO);
+    info->reserved = 0;
+    info->hash_version = DX_HASH_VERSION;
+    info->info_length = sizeof(DxRootInfo);
+    info->indirect_levels = 0;
+    info->flags = 0;
+
+    DxEntry *index = (DxEntry *)(root + DX_ROOT_ENTRIES);
+    count_limit(index)->limit = root_limit(block_size);
+    count_limit(index)->count = 1;
+    index[0].block = 1;
+
+    first->mark_dirty();
+    dir.flags |= INODE_INDEX;
+
+    return monostate{};
+}
+
+tl::expected<DirEntry, std::string> dx_lookup(Filesystem &fs, const Inode &dir, const std::string &name)
+{
+    uint32_t hash = dx_hash(name);
+
+    DxPath path;
+    auto probed = dx_probe(fs, dir, hash, path);
+    if (!probed)
+        return tl::make_unexpected(probed.error());
+
+    while (true)
+    {
+        auto leaf = dir_block(fs, dir, path.leaf());
+        if (!leaf)
+            return tl::make_unexpected(leaf.error());
+
+        auto found = dir_block_find(leaf->data(), fs.block_size(), name);
+        if (!found || found->inode != 0)
+            return found;
+
+        auto more = dx_next_leaf(fs, dir, hash, path);
+        if (!more)
+            return tl::make_unexpected(more.error());
+        if (!*more)
+            return DirEntry();
+    }
+}
+
+/*
+    Splits a full leaf in two by hash, the upper half moving to a new block. Equal
+    hashes may have to straddle the split, the new leaf's hash is marked if so
+*/
+static tl::expected<monostate, std::string> split_leaf(Filesystem &fs, Inode &dir, DxPath &path, BufferRef &leaf)
+{
+    uint32_t block_size = fs.block_size();
+
+    std::vector<DirEntry> entries;
+    auto listed = dir_block_list(leaf.data(), block_size, entries);
+    if (!listed)
+        return listed;
+
+    if (entries.size() < 2)
+        return tl::make_unexpected("Directory entry doesn't fit in a block");
+
+    std::vector<std::pair<uint32_t, size_t>> order;
+    for (size_t i = 0; i < entries.size(); i++)
+        order.push_back(std::make_pair(dx_hash(std::string(entries[i].name, entries[i].name_len)), i));
+    std::sort(order.begin(), order.end());
+
+    size_t mid = order.size() / 2;
+    uint32_t split_hash = order[mid].first;
+    if (order[mid - 1].first == split_hash)
+        split_hash |= 1;
+
+    auto fresh = dir_grow(fs, dir, leaf.block() + 1);
+    if (!fresh)
+        return tl::make_unexpected(fresh.error());
+
+    {
+        auto guard = leaf.lock();
+        auto fresh_guard = fresh->lock();
+
+        dir_block_init(leaf.data(), block_size);
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            char *block = i < mid ? leaf.data() : fresh->data();
+            auto added = dir_block_add(block, block_size, entries[order[i].second]);
+            if (!added)
+                return tl::make_unexpected(added.error());
+        }
+
+        leaf.mark_dirty();
+        fresh->mark_dirty();
+    }
+
+    insert_index(path.frames[path.levels], split_hash, dir.size / block_size - 1);
+    return monostate{};
+}
+
+/*
+    Makes room in a full index: a full root has everything moved down into a new
+    index block under it, a full block below the root is split in two
+*/
+static tl::expected<monostate, std::string> grow_index(Filesystem &fs, Inode &dir, DxPath &path)
+{
+    uint32_t block_size = fs.block_size();
+
+    DxFrame &frame = path.frames[path.levels];
+    DxCountLimit *cl = count_limit(frame.entries);
+
+    if (path.levels == 0)
+    {
+        if (DX_MAX_LEVELS == 0)
+            return tl::make_unexpected("Directory index is full");
+
+        auto node = dir_grow(fs, dir, frame.buf.block() + 1);
+        if (!node)
+            return tl::make_unexpected(node.error());
+
+        auto guard = frame.buf.lock();
+        auto node_guard = node->lock();
+        dir_block_init(node->data(), block_size);
+
+        DxEntry *entries = (DxEntry *)(node->data() + DX_NODE_ENTRIES);
+        std::memcpy(entries, frame.entries, cl->count * sizeof(DxEntry));
+        count_limit(entries)->limit = node_limit(block_size);
+
+        cl->count = 1;
+        frame.entries[0].block = dir.size / block_size - 1;
+
+        DxRootInfo *info = (DxRootInfo *)(frame.buf.data() + DX_ROOT_INFO);
+        info->indirect_levels++;
+
+        node->mark_dirty();
+        frame.buf.mark_dirty();
+        return monostate{};
+    }
+
+    DxFrame &parent = path.frames[path.levels - 1];
+    DxCountLimit *parent_cl = count_limit(parent.entries);
+    if (parent_cl->count == parent_cl->limit)
+        return tl::make_unexpected("Directory index is full");
+
+    auto node = dir_grow(fs, dir, frame.buf.block() + 1);
+    if (!node)
+        return tl::make_unexpected(node.error());
+
+    uint16_t keep = cl->count / 2;
+    uint16_t moved = cl->count - keep;
+    uint32_t split_hash = frame.entries[keep].hash;
+
+    {
+        auto guard = frame.buf.lock();
+        auto node_guard = node->lock();
+        dir_block_init(node->data(), block_size);
+
+        // the first moved entry's hash goes up into the parent, its slot takes the count instead
+        DxEntry *entries = (DxEntry *)(node->data() + DX_NODE_ENTRIES);
+        std::memcpy(entries, &frame.entries[keep], moved * sizeof(DxEntry));
+        count_limit(entries)->limit = node_limit(block_size);
+        count_limit(entries)->count = moved;
+
+        cl->count = keep;
+
+        node->mark_dirty();
+        frame.buf.mark_dirty();
+    }
+
+    insert_index(parent, split_hash, dir.size / block_size - 1);
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> dx_add(Filesystem &fs, Inode &dir, const DirEntry &entry)
+{
+    uint32_t block_size = fs.block_size();
+    uint32_t hash = dx_hash(std::string(entry.name, entry.name_len));
+
+    // every pass either adds the entry or makes room for it, a leaf split can take two goes
+    // if it had to be made in the index first
+    for (int pass = 0; pass < 8; pass++)
+    {
+        DxPath path;
+        auto probed = dx_probe(fs, dir, hash, path);
+        if (!probed)
+            return probed;
+
+        auto leaf = dir_block(fs, dir, path.leaf());
+        if (!leaf)
+            return tl::make_unexpected(leaf.error());
+
+        {
+            auto guard = leaf->lock();
+            auto added = dir_block_add(leaf->data(), block_size, entry);
+            if (!added)
+                return tl::make_unexpected(added.error());
+
+            if (*added)
+            {
+                leaf->mark_dirty();
+                return monostate{};
+            }
+        }
+
+        DxCountLimit *cl = count_limit(path.frames[path.levels].entries);
+        auto made = cl->count == cl->limit ? grow_index(fs, dir, path) : split_leaf(fs, dir, path, *leaf);
+        if (!made)
+            return made;
+    }
+
+    return tl::make_unexpected("Directory entry doesn't fit in a block");
+}
+
+tl::expected<monostate, std::string> dx_remove(Filesystem &fs, Inode &dir, const std::string &name)
+{
+    uint32_t hash = dx_hash(name);
+
+    DxPath path;
+    auto probed = dx_probe(fs, dir, hash, path);
+    if (!probed)
+        return probed;
+
+    while (true)
+    {
+        auto leaf = dir_block(fs, dir, path.leaf());
+        if (!leaf)
+            return tl::make_unexpected(leaf.error());
+
+        auto guard = leaf->lock();
+        auto removed = dir_block_remove(leaf->data(), fs.block_size(), name);
+        if (!removed)
+            return tl::make_unexpected(removed.error());
+
+        if (*removed)
+        {
+            leaf->mark_dirty();
+            return monostate{};
+        }
+
+        auto more = dx_next_leaf(fs, dir, hash, path);
+        if (!more)
+            return tl::make_unexpected(more.error());
+        if (!*more)
+            return tl::make_unexpected(name + " doesn't exist");
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "expected.hpp"
+#include "filesystem.hpp"
+#include "fs.hpp"
+#include "monostate.hpp"
+
+/*
+    Hashed directory index, along the lines of ext3's htree
+
+    Names are hashed and the index maps ranges of hashes to the leaf block holding
+    them, so finding a name reads the index and one leaf instead of every block.
+    Leaves are ordinary directory blocks. The root of the index sits in block 0,
+    hidden in the free space of the ".." entry, and a second level of index blocks
+    (each one a single unused entry covering the whole block, followed by the index)
+    is added once the root fills up. To anything walking the directory linearly an
+    indexed directory still looks like a plain one
+
+    Block 0
+    ------------------------------------------------------------------
+    | "." | ".." | Root Info | Limit/Count, Block | Hash, Block | ... |
+    ------------------------------------------------------------------
+    |  12 |  12  |     8     |         8          |      8      | ... |
+    ------------------------------------------------------------------
+
+    The first index entry covers every hash below the second one's. Blocks are logical
+    blocks of the directory. The lowest bit of a hash is left clear, when a leaf split
+    has to put equal hashes on both sides the new leaf's hash gets it set so lookups
+    know to carry on into the next leaf
+*/
+
+const uint8_t DX_HASH_VERSION = 1;
+
+// Index levels below the root, two levels hold a few hundred thousand entries with 1 KiB blocks
+const uint8_t DX_MAX_LEVELS = 1;
+
+struct DxRootInfo
+{
+    uint32_t reserved;
+    uint8_t hash_version;
+    uint8_t info_length;
+    uint8_t indirect_levels;
+    uint8_t flags;
+};
+
+struct DxEntry
+{
+    uint32_t hash;
+    uint32_t block;
+};
+
+// Stands in for the hash of the first entry of every index
+struct DxCountLimit
+{
+    uint16_t limit;
+    uint16_t count;
+};
+
+uint32_t dx_hash(const std::string &name);
+
+/*
+    Builds an index over a directory that's exactly one block long, moving its entries
+    out into the first leaf. The caller writes dir back after
+*/
+tl::expected<monostate, std::string> dx_convert(Filesystem &fs, Inode &dir);
+
+tl::expected<DirEntry, std::string> dx_lookup(Filesystem &fs, const Inode &dir, const std::string &name);
+tl::expected<monostate, std::string> dx_add(Filesystem &fs, Inode &dir, const DirEntry &entry);
+tl::expected<monostate, std::string> dx_remove(Filesystem &fs, Inode &dir, const std::string &name);
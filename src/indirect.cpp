@@ -0,0 +1,381 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "alloc.hpp"
+#include "indirect.hpp"
+
+tl::expected<uint32_t *, std::string> IndirectCache::pointers(BlockCache &cache, int level, uint32_t block)
+{
+    Level &cached = levels[level];
+    if (cached.block != block || !cached.ref)
+    {
+        auto got = cache.get(block);
+        if (!got)
+            return tl::make_unexpected(got.error());
+
+        cached.ref = std::move(*got);
+        cached.block = block;
+    }
+
+    return (uint32_t *)cached.ref.data();
+}
+
+// Locks what ptr points into for a level's pointers, level -1 being the inode's own which go with the inode
+static std::unique_lock<std::mutex> lock_level(IndirectCache *cache, int level)
+{
+    return level >= 0 ? cache->lock(level) : std::unique_lock<std::mutex>();
+}
+
+void IndirectCache::clear()
+{
+    for (Level &level : levels)
+    {
+        level.ref.reset();
+        level.block = 0;
+    }
+}
+
+/*
+    Which block_ptrs slot a logical block hangs off and the index to follow in each
+    indirect block below it, depth is 0 for the direct blocks
+*/
+struct IndirectPath
+{
+    int slot;
+    int depth;
+    uint32_t offsets[3];
+};
+
+static tl::expected<IndirectPath, std::string> resolve(uint64_t lblock, uint64_t per_block)
+{
+    if (lblock < NUM_DIRECT_PTR)
+        return IndirectPath{(int)lblock, 0, {0, 0, 0}};
+
+    lblock -= NUM_DIRECT_PTR;
+    if (lblock < per_block)
+        return IndirectPath{SINGLE_INDIRECT, 1, {(uint32_t)lblock, 0, 0}};
+
+    lblock -= per_block;
+    if (lblock < per_block * per_block)
+        return IndirectPath{DOUBLE_INDIRECT, 2, {(uint32_t)(lblock / per_block), (uint32_t)(lblock % per_block), 0}};
+
+    lblock -= per_block * per_block;
+    if (lblock < per_block * per_block * per_block)
+    {
+        return IndirectPath{TRIPLE_INDIRECT, 3, {(uint32_t)(lblock / (per_block * per_block)),
+                                                 (uint32_t)(lblock / per_block % per_block), (uint32_t)(lblock % per_block)}};
+    }
+
+    return tl::make_unexpected("File is too large to map with indirect blocks");
+}
+
+tl::expected<BlockMapping, std::string> indirect_lookup(Filesystem &fs, const Inode &inode, uint32_t lblock,
+                                                        IndirectCache *cache)
+{
+    uint32_t per_block = fs.block_size() / sizeof(uint32_t);
+
+    auto path = resolve(lblock, per_block);
+    if (!path)
+        return tl::make_unexpected(path.error());
+
+    IndirectCache local;
+    if (!cache)
+        cache = &local;
+
+    const uint32_t *ptrs = inode.block_ptrs;
+    uint32_t index = path->slot;
+    uint32_t count = NUM_DIRECT_PTR;
+
+    uint32_t block = inode.block_ptrs[path->slot];
+    for (int level = 0; level < path->depth; level++)
+    {
+        // a missing pointer block is one hole over everything it would have mapped
+        if (block == 0)
+        {
+            uint64_t span = 1;
+            uint64_t into = 0;
+            for (int below = path->depth - 1; below >= level; below--)
+            {
+                into += path->offsets[below] * span;
+                span *= per_block;
+            }
+            return BlockMapping{0, (uint32_t)std::min<uint64_t>(span - into, UINT32_MAX)};
+        }
+
+        auto got = cache->pointers(*fs.cache, level, block);
+        if (!got)
+            return tl::make_unexpected(got.error());
+
+        ptrs = *got;
+        index = path->offsets[level];
+        count = per_block;
+        block = ptrs[index];
+    }
+
+    // see how far the run goes within this pointer block
+    uint32_t start = ptrs[index];
+    uint32_t len = 1;
+    while (index + len < count && ptrs[index + len] == (start ? start + len : 0))
+        len++;
+
+    return BlockMapping{start, len};
+}
+
+// Whether lblock is the first block under its pointer block at level, the first one a sequential run gets to
+static bool first_under(const IndirectPath &path, int level)
+{
+    for (int l = level; l < path.depth; l++)
+    {
+        if (path.offsets[l] != 0)
+            return false;
+    }
+    return true;
+}
+
+tl::expected<uint32_t, std::string> indirect_needed(Filesystem &fs, const Inode &inode, uint32_t lblock,
+                                                    uint32_t count, IndirectCache *cache)
+{
+    if (inode.flags & INODE_EXTENTS)
+        return tl::make_unexpected("Inode is mapped with extents");
+
+    uint32_t per_block = fs.block_size() / sizeof(uint32_t);
+
+    IndirectCache local;
+    if (!cache)
+        cache = &local;
+
+    uint32_t needed = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        auto path = resolve((uint64_t)lblock + i, per_block);
+        if (!path)
+            return tl::make_unexpected(path.error());
+
+        // past the first block, only one starting a new pointer block can need any
+        if (path->depth == 0 || (i > 0 && !first_under(*path, path->depth - 1)))
+            continue;
+
+        const uint32_t *ptr = &inode.block_ptrs[path->slot];
+        for (int level = 0; level < path->depth; level++)
+        {
+            if (*ptr == 0)
+            {
+                // everything from here down is missing, each counted where the run first gets to it
+                for (int missing = level; missing < path->depth; missing++)
+                {
+                    if (i == 0 || first_under(*path, missing))
+                        needed++;
+                }
+                break;
+            }
+
+            auto got = cache->pointers(*fs.cache, level, *ptr);
+            if (!got)
+                return tl::make_unexpected(got.error());
+
+            ptr = *got + path->offsets[level];
+        }
+    }
+
+    return needed;
+}
+
+tl::expected<monostate, std::string> indirect_insert(Filesystem &fs, Inode &inode, uint32_t lblock, uint32_t start,
+                                                     uint32_t len, IndirectCache *cache, BlockRun *reserved)
+{
+    if (inode.flags & INODE_EXTENTS)
+        return tl::make_unexpected("Inode is mapped with extents");
+
+    uint32_t per_block = fs.block_size() / sizeof(uint32_t);
+
+    IndirectCache local;
+    if (!cache)
+        cache = &local;
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        auto path = resolve((uint64_t)lblock + i, per_block);
+        if (!path)
+            return tl::make_unexpected(path.error());
+
+        uint32_t *ptr = &inode.block_ptrs[path->slot];
+        for (int level = 0; level < path->depth; level++)
+        {
+            if (*ptr == 0)
+            {
+                // indirect blocks come out of what the caller set aside ahead of the data, or else
+                // go right after it
+                uint32_t block;
+                if (reserved && reserved->len > 0)
+                {
+                    block = reserved->start++;
+                    reserved->len--;
+                }
+                else
+                {
+                    auto allocated = alloc_block(fs, start + len);
+                    if (!allocated)
+                        return tl::make_unexpected(allocated.error());
+                    block = *allocated;
+                }
+
+                auto fresh = fs.cache->get_new(block);
+                if (!fresh)
+                    return tl::make_unexpected(fresh.error());
+
+                {
+                    auto guard = fresh->lock();
+                    std::memset(fresh->data(), 0, fs.block_size());
+                    fresh->mark_dirty();
+                }
+
+                auto guard = lock_level(cache, level - 1);
+                *ptr = block;
+                if (level > 0)
+                    cache->mark_dirty(level - 1);
+            }
+
+            auto got = cache->pointers(*fs.cache, level, *ptr);
+            if (!got)
+                return tl::make_unexpected(got.error());
+
+            ptr = *got + path->offsets[level];
+        }
+
+        auto guard = lock_level(cache, path->depth - 1);
+        *ptr = start + i;
+        if (path->depth > 0)
+            cache->mark_dirty(path->depth - 1);
+    }
+
+    return monostate{};
+}
+
+/*
+    Frees everything at or after from under an indirect block depth levels above the
+    data, whose first pointer maps logical block first. Returns whether it's left
+    with no pointers, in which case the caller frees the block itself
+*/
+static tl::expected<bool, std::string> truncate_level(Filesystem &fs, uint32_t block, int depth, uint64_t first,
+                                                      uint64_t from, BlockReleaser &released)
+{
+    uint32_t per_block = fs.block_size() / sizeof(uint32_t);
+
+    uint64_t span = 1;
+    for (int level = 1; level < depth; level++)
+        span *= per_block;
+
+    auto got = fs.cache->get(block);
+    if (!got)
+        return tl::make_unexpected(got.error());
+
+    // only read until the pointers are cleared at the end, so the block isn't locked while the levels below are
+    // worked through. Nothing else changes a file's mapping meanwhile
+    uint32_t *ptrs = (uint32_t *)got->data();
+    bool empty = true;
+    std::vector<uint32_t> cleared;
+
+    for (uint32_t i = 0; i < per_block; i++)
+    {
+        if (ptrs[i] == 0)
+            continue;
+
+        uint64_t child_first = first + i * span;
+        if (child_first + span <= from)
+        {
+            empty = false;
+            continue;
+        }
+
+        if (depth > 1)
+        {
+            auto emptied = truncate_level(fs, ptrs[i], depth - 1, child_first, from, released);
+            if (!emptied)
+                return emptied;
+            if (!*emptied)
+            {
+                empty = false;
+                continue;
+            }
+        }
+
+        cleared.push_back(i);
+    }
+
+    if (cleared.empty())
+        return empty;
+
+    // freeing takes the allocator's lock, which comes before any block's
+    std::vector<uint32_t> blocks;
+    {
+        auto guard = got->lock();
+        for (uint32_t i : cleared)
+        {
+            blocks.push_back(ptrs[i]);
+            ptrs[i] = 0;
+        }
+        got->mark_dirty();
+    }
+
+    for (uint32_t freed_block : blocks)
+    {
+        auto freed = released.add(freed_block, 1);
+        if (!freed)
+            return tl::make_unexpected(freed.error());
+    }
+
+    return empty;
+}
+
+tl::expected<monostate, std::string> indirect_truncate(Filesystem &fs, Inode &inode, uint32_t from,
+                                                       IndirectCache *cache)
+{
+    if (inode.flags & INODE_EXTENTS)
+        return tl::make_unexpected("Inode is mapped with extents");
+
+    // pinned blocks can't be dropped from the block cache once they're freed
+    if (cache)
+        cache->clear();
+
+    BlockReleaser released(fs);
+
+    for (uint32_t i = from; i < NUM_DIRECT_PTR; i++)
+    {
+        if (inode.block_ptrs[i] == 0)
+            continue;
+
+        auto freed = released.add(inode.block_ptrs[i], 1);
+        if (!freed)
+            return freed;
+        inode.block_ptrs[i] = 0;
+    }
+
+    uint64_t per_block = fs.block_size() / sizeof(uint32_t);
+    uint64_t first = NUM_DIRECT_PTR;
+    uint64_t span = per_block;
+
+    for (int slot = SINGLE_INDIRECT; slot <= TRIPLE_INDIRECT; slot++)
+    {
+        uint32_t block = inode.block_ptrs[slot];
+        if (block != 0 && first + span > from)
+        {
+            auto empty = truncate_level(fs, block, slot - SINGLE_INDIRECT + 1, first, from, released);
+            if (!empty)
+                return tl::make_unexpected(empty.error());
+
+            if (*empty)
+            {
+                auto freed = released.add(block, 1);
+                if (!freed)
+                    return freed;
+                inode.block_ptrs[slot] = 0;
+            }
+        }
+
+        first += span;
+        span *= per_block;
+    }
+
+    return released.flush();
+}
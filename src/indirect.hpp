@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "alloc.hpp"
+#include "cache.hpp"
+#include "expected.hpp"
+#include "extent.hpp"
+#include "filesystem.hpp"
+#include "fs.hpp"
+#include "monostate.hpp"
+
+/*
+    Classic ext2 block mapping, for inodes that aren't flagged INODE_EXTENTS
+
+    The first 12 block_ptrs point straight at data blocks, slot 12 at a block of
+    pointers to data blocks, 13 at a block of pointers to those and 14 one level
+    deeper again. With 1 KiB blocks that's a little over 16 GiB per file
+*/
+
+const int NUM_DIRECT_PTR = 12;
+const int SINGLE_INDIRECT = 12;
+const int DOUBLE_INDIRECT = 13;
+const int TRIPLE_INDIRECT = 14;
+
+/*
+    Keeps the indirect blocks the last lookup went through pinned, one per level,
+    so walking through a file doesn't go back to the block cache for the same
+    indirect blocks on every block. One per open file, not thread safe. Has to be
+    cleared if the file's indirect blocks are freed
+*/
+class IndirectCache
+{
+public:
+    // Pointers held in an indirect block, level is how many indirect blocks down from the inode it is
+    tl::expected<uint32_t *, std::string> pointers(BlockCache &cache, int level, uint32_t block);
+
+    // Call after changing the pointers returned for level
+    void mark_dirty(int level) { levels[level].ref.mark_dirty(); }
+
+    // Hold while changing the pointers returned for level, see BufferRef::lock
+    std::unique_lock<std::mutex> lock(int level) { return levels[level].ref.lock(); }
+
+    void clear();
+
+private:
+    struct Level
+    {
+        uint32_t block = 0;
+        BufferRef ref;
+    };
+
+    Level levels[3];
+};
+
+/*
+    Mappings are as for extents, start is 0 for a hole and len counts how many of the
+    following blocks (in the same pointer block) are laid out right after it
+*/
+tl::expected<BlockMapping, std::string> indirect_lookup(Filesystem &fs, const Inode &inode, uint32_t lblock,
+                                                        IndirectCache *cache = nullptr);
+
+/*
+    How many indirect blocks mapping count blocks at lblock would have to allocate,
+    so they can be allocated along with the data
+*/
+tl::expected<uint32_t, std::string> indirect_needed(Filesystem &fs, const Inode &inode, uint32_t lblock,
+                                                    uint32_t count, IndirectCache *cache = nullptr);
+
+/*
+    Points len blocks at lblock to physical blocks starting at start, allocating any
+    indirect blocks on the way. Those are taken off the front of reserved while it
+    lasts, what's left of it is the caller's to free. The caller writes the inode back after
+*/
+tl::expected<monostate, std::string> indirect_insert(Filesystem &fs, Inode &inode, uint32_t lblock, uint32_t start,
+                                                     uint32_t len, IndirectCache *cache = nullptr,
+                                                     BlockRun *reserved = nullptr);
+
+/*
+    Unmaps everything from logical block from onwards and frees the blocks, indirect
+    blocks left empty included. cache is cleared. The caller writes the inode back after
+*/
+tl::expected<monostate, std::string> indirect_truncate(Filesystem &fs, Inode &inode, uint32_t from,
+                                                       IndirectCache *cache = nullptr);
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <cstring>
+
+#include "alloc.hpp"
+#include "extent.hpp"
+#include "inline_data.hpp"
+
+static char *inline_area(Inode &inode)
+{
+    return (char *)inode.block_ptrs;
+}
+
+void inline_init(Inode &inode)
+{
+    std::memset(inline_area(inode), 0, INLINE_DATA_MAX);
+    inode.flags = (inode.flags & ~INODE_EXTENTS) | INODE_INLINE_DATA;
+}
+
+size_t inline_read(const Inode &inode, uint64_t offset, void *buf, size_t len)
+{
+    uint64_t size = std::min<uint64_t>(inode.size, INLINE_DATA_MAX);
+    if (offset >= size)
+        return 0;
+
+    len = std::min<uint64_t>(len, size - offset);
+    std::memcpy(buf, (const char *)inode.block_ptrs + offset, len);
+    return len;
+}
+
+tl::expected<monostate, std::string> inline_write(Inode &inode, uint64_t offset, const void *buf, size_t len)
+{
+    if (offset + len > INLINE_DATA_MAX)
+        return tl::make_unexpected("Write doesn't fit inline");
+
+    std::memcpy(inline_area(inode) + offset, buf, len);
+    inode.size = std::max<uint64_t>(inode.size, offset + len);
+    return monostate{};
+}
+
+tl::expected<monostate, std::string> inline_spill(Filesystem &fs, Inode &inode, uint64_t goal)
+{
+    if (!(inode.flags & INODE_INLINE_DATA))
+        return monostate{};
+
+    // an empty file doesn't need a block yet
+    if (inode.size == 0)
+    {
+        inode.flags &= ~INODE_INLINE_DATA;
+        extent_init(inode);
+        return monostate{};
+    }
+
+    // the data is copied out before the inode is touched, so a full filesystem leaves it as it was
+    auto block = alloc_block(fs, goal);
+    if (!block)
+        return tl::make_unexpected(block.error());
+
+    auto buf = fs.cache->get_new(*block);
+    if (!buf)
+    {
+        free_blocks(fs, *block, 1);
+        return tl::make_unexpected(buf.error());
+    }
+
+    {
+        auto guard = buf->lock();
+        std::memset(buf->data(), 0, fs.block_size());
+        std::memcpy(buf->data(), inline_area(inode), std::min<uint64_t>(inode.size, INLINE_DATA_MAX));
+        buf->mark_dirty();
+    }
+
+    inode.flags &= ~INODE_INLINE_DATA;
+    extent_init(inode);
+
+    auto mapped = extent_insert(fs, inode, 0, *block, 1);
+    if (!mapped)
+    {
+        // back inline as it was, the block still has the data
+        std::memcpy(inline_area(inode), buf->data(), INLINE_DATA_MAX);
+        inode.flags = (inode.flags & ~INODE_EXTENTS) | INODE_INLINE_DATA;
+
+        buf->reset();
+        free_blocks(fs, *block, 1);
+    }
+    return mapped;
+}
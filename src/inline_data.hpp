@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "expected.hpp"
+#include "filesystem.hpp"
+#include "fs.hpp"
+#include "monostate.hpp"
+
+/*
+    Inline data, small files kept inside their inode
+
+    A file that fits in block_ptrs and the padding after it is stored right there
+    instead of taking a whole data block, so reading it only needs the inode table
+    block it's already sitting in. Once it grows past that it's moved out into a
+    data block and mapped with extents like any other file
+*/
+
+const uint32_t INLINE_DATA_MAX = sizeof(Inode::block_ptrs) + sizeof(Inode::_pad);
+
+static_assert(offsetof(Inode, _pad) == offsetof(Inode, block_ptrs) + sizeof(Inode::block_ptrs),
+              "Inline data needs block_ptrs and _pad to be next to each other");
+
+// Empties the inode's data area and flags it INODE_INLINE_DATA
+void inline_init(Inode &inode);
+
+// Copies out up to len bytes at offset, stopping at the end of the file, returns how many
+size_t inline_read(const Inode &inode, uint64_t offset, void *buf, size_t len);
+
+// Fails if the write would go past INLINE_DATA_MAX, the file should be spilled first
+tl::expected<monostate, std::string> inline_write(Inode &inode, uint64_t offset, const void *buf, size_t len);
+
+/*
+    Moves the contents out into a data block (allocated near goal) and switches the
+    inode over to extents. The caller writes the inode back after
+*/
+tl::expected<monostate, std::string> inline_spill(Filesystem &fs, Inode &inode, uint64_t goal);
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <cstring>
+
+#include "filesystem.hpp"
+#include "inode_cache.hpp"
+
+InodeRef &InodeRef::operator=(InodeRef &&other)
+{
+    if (this != &other)
+    {
+        reset();
+        cache = other.cache;
+        cached = other.cached;
+        other.cached = nullptr;
+    }
+    return *this;
+}
+
+void InodeRef::mark_dirty()
+{
+    cache->mark_dirty(cached);
+}
+
+void InodeRef::reset()
+{
+    if (cached)
+    {
+        cache->release(cached);
+        cached = nullptr;
+    }
+}
+
+InodeCache::InodeCache(Filesystem &fs, size_t capacity) : fs(fs), cap(std::max<size_t>(capacity, 1))
+{
+}
+
+InodeCache::~InodeCache()
+{
+    // nowhere to report errors from here, callers that care flush first
+    flush();
+
+    for (auto &entry : inodes)
+        delete entry.second;
+}
+
+tl::expected<InodeRef, std::string> InodeCache::get(uint32_t ino)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+
+    while (true)
+    {
+        auto found = inodes.find(ino);
+        if (found != inodes.end())
+        {
+            CachedInode *cached = found->second;
+
+            // someone else is reading it in, wait for them rather than read it twice
+            if (cached->loading)
+            {
+                io_done.wait(lock);
+                continue;
+            }
+
+            lru.splice(lru.begin(), lru, cached->pos);
+            cached->refs++;
+            hit_count++;
+            return InodeRef(this, cached);
+        }
+
+        // its last copy is still on its way to the table, reading it now could get the one before
+        if (writing.count(ino))
+        {
+            io_done.wait(lock);
+            continue;
+        }
+
+        break;
+    }
+
+    // miss, the inode goes in right away so gets of the same one wait for this read
+    miss_count++;
+    evict();
+
+    CachedInode *cached = new CachedInode;
+    cached->ino = ino;
+    cached->refs = 1;
+    cached->loading = true;
+
+    lru.push_front(cached);
+    cached->pos = lru.begin();
+    inodes[ino] = cached;
+
+    auto written = write_evicted(lock);
+
+    lock.unlock();
+    auto read = fs.load_inode(ino);
+    lock.lock();
+
+    cached->loading = false;
+    io_done.notify_all();
+    if (!read || !written)
+    {
+        lru.erase(cached->pos);
+        inodes.erase(ino);
+        delete cached;
+        if (!read)
+            return tl::make_unexpected(read.error());
+        return tl::make_unexpected(written.error());
+    }
+
+    cached->inode = *read;
+    return InodeRef(this, cached);
+}
+
+bool InodeCache::peek(uint32_t ino, Inode &inode)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    // one still loading has nothing newer than the table
+    auto found = inodes.find(ino);
+    if (found != inodes.end() && !found->second->loading)
+    {
+        inode = found->second->inode;
+        return true;
+    }
+
+    found = writing.find(ino);
+    if (found == writing.end())
+        return false;
+
+    inode = found->second->inode;
+    return true;
+}
+
+/*
+    Makes room for one more inode if the cache is full, skipping any that are held.
+    Dirty ones are set aside to be written back once mtx is let go, see write_evicted
+*/
+void InodeCache::evict()
+{
+    for (auto it = lru.rbegin(); it != lru.rend() && inodes.size() >= cap;)
+    {
+        CachedInode *cached = *it;
+        if (cached->refs > 0)
+        {
+            ++it;
+            continue;
+        }
+
+        it = std::list<CachedInode *>::reverse_iterator(lru.erase(std::next(it).base()));
+        inodes.erase(cached->ino);
+
+        if (cached->dirty)
+        {
+            writing[cached->ino] = cached;
+            evicted.push_back(cached);
+        }
+        else
+            delete cached;
+    }
+}
+
+/*
+    Writes back the dirty inodes evicted so far, letting go of mtx meanwhile. Until
+    then gets of them wait, so nobody reads them back from the table early. One that
+    fails to write goes back in the cache still dirty
+*/
+tl::expected<monostate, std::string> InodeCache::write_evicted(std::unique_lock<std::mutex> &lock)
+{
+    if (evicted.empty())
+        return monostate{};
+
+    std::vector<CachedInode *> out;
+    out.swap(evicted);
+
+    lock.unlock();
+    tl::expected<monostate, std::string> result = monostate{};
+    std::vector<bool> failed(out.size());
+    for (size_t i = 0; i < out.size(); i++)
+    {
+        // nobody else can reach an evicted inode, no need for its lock
+        auto written = fs.write_inode(out[i]->ino, out[i]->inode);
+        if (!written)
+        {
+            failed[i] = true;
+            result = written;
+        }
+    }
+    lock.lock();
+
+    for (size_t i = 0; i < out.size(); i++)
+    {
+        CachedInode *cached = out[i];
+        writing.erase(cached->ino);
+        if (failed[i])
+        {
+            lru.push_back(cached);
+            cached->pos = std::prev(lru.end());
+            inodes[cached->ino] = cached;
+        }
+        else
+        {
+            delete cached;
+        }
+    }
+
+    io_done.notify_all();
+    return result;
+}
+
+void InodeCache::release(CachedInode *cached)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    cached->refs--;
+}
+
+void InodeCache::mark_dirty(CachedInode *cached)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    cached->dirty = true;
+}
+
+tl::expected<monostate, std::string> InodeCache::flush()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    std::vector<uint32_t> dirty;
+    for (auto &entry : inodes)
+    {
+        if (entry.second->dirty)
+            dirty.push_back(entry.first);
+    }
+
+    std::vector<InodeLocation> locs = fs.addressing.locate_sorted(dirty, fs.descriptors);
+
+    ByteBuffer packed(sizeof(Inode));
+    for (size_t i = 0; i < locs.size();)
+    {
+        uint64_t block = locs[i].block;
+
+        auto buf = fs.cache->get(block);
+        if (!buf)
+            return tl::make_unexpected(buf.error());
+
+        // every dirty inode in this block goes in before it's marked dirty once
+        auto guard = buf->lock();
+        for (; i < locs.size() && locs[i].block == block; i++)
+        {
+            CachedInode *cached = inodes[locs[i].ino];
+            packed.seekp(0);
+            pack_inode(packed, cached->inode, locs[i].ino);
+            std::memcpy(buf->data() + locs[i].offset, packed.bytes(), sizeof(Inode));
+            cached->dirty = false;
+        }
+
+        buf->mark_dirty();
+    }
+
+    return monostate{};
+}
+
+size_t InodeCache::size()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return inodes.size();
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstddef>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "expected.hpp"
+#include "fs.hpp"
+#include "monostate.hpp"
+
+struct Filesystem;
+class InodeCache;
+
+// One inode held in memory
+struct CachedInode
+{
+    uint32_t ino = 0;
+    Inode inode;
+    unsigned refs = 0;
+    bool dirty = false;
+    // still being read from the inode table, see InodeCache::get
+    bool loading = false;
+    // see InodeRef::lock
+    std::mutex lock;
+    // bumped whenever blocks are unmapped from the inode, under lock
+    uint64_t map_generation = 0;
+    std::list<CachedInode *>::iterator pos;
+};
+
+/*
+    Reference to a cached inode, drops the reference when it goes out of scope.
+    The inode stays in memory for as long as anyone holds one
+*/
+class InodeRef
+{
+public:
+    InodeRef() = default;
+    InodeRef(InodeCache *cache, CachedInode *cached) : cache(cache), cached(cached) {}
+    ~InodeRef() { reset(); }
+
+    InodeRef(InodeRef &&other) : cache(other.cache), cached(other.cached) { other.cached = nullptr; }
+    InodeRef &operator=(InodeRef &&other);
+
+    InodeRef(const InodeRef &) = delete;
+    InodeRef &operator=(const InodeRef &) = delete;
+
+    Inode &operator*() const { return cached->inode; }
+    Inode *operator->() const { return &cached->inode; }
+    uint32_t ino() const { return cached->ino; }
+    explicit operator bool() const { return cached != nullptr; }
+
+    // Marks the inode as needing write back, call after modifying it
+    void mark_dirty();
+    void reset();
+
+    /*
+        For callers sharing an inode to take turns changing it. Whatever changes a
+        directory's entries holds the directory's for the whole change, so two of
+        them can't both find a name missing and add it, or remove a directory while
+        something is being created in it. Files hold it while mapping blocks, see File
+    */
+    std::unique_lock<std::mutex> lock() const { return std::unique_lock<std::mutex>(cached->lock); }
+
+    /*
+        Counts how often blocks were unmapped from the inode, so anyone remembering
+        mapping blocks can tell they may have been freed. Only with lock() held
+    */
+    uint64_t map_generation() const { return cached->map_generation; }
+    void unmapped() { cached->map_generation++; }
+
+private:
+    InodeCache *cache = nullptr;
+    CachedInode *cached = nullptr;
+};
+
+/*
+    Cache of in-memory inodes in front of the inode tables
+
+    Inodes are looked up by number and reference counted, changes stay in memory
+    until flush, which sorts the dirty inodes by where they live and packs every
+    dirty inode sharing an inode table block into that block in one go, so the
+    block only gets written once. Least recently used inodes nobody holds are
+    dropped past capacity (written back first if dirty). Thread safe, although
+    callers sharing an inode have to agree on who changes it, see InodeRef::lock.
+    Inode table reads and write backs happen with the cache unlocked, anyone after
+    an inode on its way in or out waits for it instead
+*/
+class InodeCache
+{
+public:
+    InodeCache(Filesystem &fs, size_t capacity);
+    ~InodeCache();
+
+    InodeCache(const InodeCache &) = delete;
+    InodeCache &operator=(const InodeCache &) = delete;
+
+    tl::expected<InodeRef, std::string> get(uint32_t ino);
+
+    // Copies out an inode if it's cached, without bringing it in if not
+    bool peek(uint32_t ino, Inode &inode);
+
+    // Writes every dirty inode into the block cache, one pass per inode table block
+    tl::expected<monostate, std::string> flush();
+
+    size_t size();
+    size_t hits() const { return hit_count; }
+    size_t misses() const { return miss_count; }
+
+private:
+    friend class InodeRef;
+
+    void release(CachedInode *cached);
+    void mark_dirty(CachedInode *cached);
+    void evict();
+    tl::expected<monostate, std::string> write_evicted(std::unique_lock<std::mutex> &lock);
+
+    Filesystem &fs;
+    size_t cap;
+
+    std::mutex mtx;
+    std::unordered_map<uint32_t, CachedInode *> inodes;
+    // most recently used at the front
+    std::list<CachedInode *> lru;
+    // dirty inodes evicted but not yet written back, by number
+    std::unordered_map<uint32_t, CachedInode *> writing;
+    // the ones of those nobody has started writing yet
+    std::vector<CachedInode *> evicted;
+    // an inode finished loading or writing back
+    std::condition_variable io_done;
+
+    size_t hit_count = 0;
+    size_t miss_count = 0;
+};
@@ -0,0 +1,36 @@
+#include "inode_map.hpp"
+
+tl::expected<BlockMapping, std::string> map_block(Filesystem &fs, const Inode &inode, uint32_t lblock,
+                                                  IndirectCache *cache)
+{
+    if (inode.flags & INODE_INLINE_DATA)
+        return tl::make_unexpected("Inline inodes don't have blocks");
+
+    if (inode.flags & INODE_EXTENTS)
+        return extent_lookup(fs, inode, lblock);
+
+    return indirect_lookup(fs, inode, lblock, cache);
+}
+
+tl::expected<monostate, std::string> map_insert(Filesystem &fs, Inode &inode, uint32_t lblock, uint32_t start,
+                                                uint32_t len, IndirectCache *cache, BlockRun *reserved)
+{
+    if (inode.flags & INODE_INLINE_DATA)
+        return tl::make_unexpected("Inline inodes don't have blocks");
+
+    if (inode.flags & INODE_EXTENTS)
+        return extent_insert(fs, inode, lblock, start, len);
+
+    return indirect_insert(fs, inode, lblock, start, len, cache, reserved);
+}
+
+tl::expected<monostate, std::string> map_truncate(Filesystem &fs, Inode &inode, uint32_t from, IndirectCache *cache)
+{
+    if (inode.flags & INODE_INLINE_DATA)
+        return tl::make_unexpected("Inline inodes don't have blocks");
+
+    if (inode.flags & INODE_EXTENTS)
+        return extent_truncate(fs, inode, from);
+
+    return indirect_truncate(fs, inode, from, cache);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "expected.hpp"
+#include "extent.hpp"
+#include "filesystem.hpp"
+#include "fs.hpp"
+#include "indirect.hpp"
+#include "monostate.hpp"
+
+/*
+    Logical to physical block mapping for any inode, going through the extent tree
+    or the indirect blocks depending on how it's flagged. cache is only used for
+    indirect mapped inodes
+*/
+tl::expected<BlockMapping, std::string> map_block(Filesystem &fs, const Inode &inode, uint32_t lblock,
+                                                  IndirectCache *cache = nullptr);
+
+/*
+    Maps len blocks at lblock to start onwards. reserved is blocks set aside for the
+    mapping's own use, only taken from for indirect mapped inodes, see indirect_insert
+*/
+tl::expected<monostate, std::string> map_insert(Filesystem &fs, Inode &inode, uint32_t lblock, uint32_t start,
+                                                uint32_t len, IndirectCache *cache = nullptr,
+                                                BlockRun *reserved = nullptr);
+
+// Frees every block mapped at or after from
+tl::expected<monostate, std::string> map_truncate(Filesystem &fs, Inode &inode, uint32_t from,
+                                                  IndirectCache *cache = nullptr);
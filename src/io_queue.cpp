@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "io_queue.hpp"
+
+// there's no liburing to lean on, so the ring is driven through the raw syscalls
+
+static int uring_setup(unsigned entries, io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+IOQueue::IOQueue(BlockDevice &dev, unsigned depth) : dev(dev)
+{
+    if (dev.backend() == IOBackend::Uring && depth > 0)
+        setup_ring(depth);
+}
+
+IOQueue::~IOQueue()
+{
+    if (ring_fd < 0)
+        return;
+
+    flush();
+
+    if (sqe_mem)
+        munmap(sqe_mem, sqe_mem_size);
+    if (cq_ring && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring)
+        munmap(sq_ring, sq_ring_size);
+
+    close(ring_fd);
+}
+
+bool IOQueue::setup_ring(unsigned depth)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    int fd = uring_setup(depth, &params);
+    if (fd < 0)
+        return false;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    // newer kernels share one mapping between both rings
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+    {
+        sq_ring = nullptr;
+        close(fd);
+        return false;
+    }
+
+    if (single_mmap)
+    {
+        cq_ring = sq_ring;
+    }
+    else
+    {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+        {
+            cq_ring = nullptr;
+            munmap(sq_ring, sq_ring_size);
+            sq_ring = nullptr;
+            close(fd);
+            return false;
+        }
+    }
+
+    sqe_mem_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqe_mem = mmap(nullptr, sqe_mem_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqe_mem == MAP_FAILED)
+    {
+        sqe_mem = nullptr;
+        if (cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        munmap(sq_ring, sq_ring_size);
+        sq_ring = cq_ring = nullptr;
+        close(fd);
+        return false;
+    }
+
+    char *sq = (char *)sq_ring;
+    sq_head = (unsigned *)(sq + params.sq_off.head);
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    char *cq = (char *)cq_ring;
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+
+    ring_fd = fd;
+    entries = params.sq_entries;
+
+    // never have more in flight than the submission ring can hold, so it can't overflow
+    slots.resize(entries);
+    for (uint32_t i = entries; i > 0; i--)
+        free_slots.push_back(i - 1);
+
+    return true;
+}
+
+void IOQueue::fail(const std::string &err)
+{
+    if (result)
+        result = tl::make_unexpected(err);
+}
+
+void IOQueue::read(uint64_t offset, void *buf, size_t len)
+{
+    queue(Request{offset, (char *)buf, len, false});
+}
+
+void IOQueue::write(uint64_t offset, const void *buf, size_t len)
+{
+    queue(Request{offset, (char *)buf, len, true});
+}
+
+static bool is_zero(const char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (buf[i])
+            return false;
+    }
+    return true;
+}
+
+void IOQueue::write_nonzero(uint64_t offset, const void *buf, size_t len)
+{
+    const char *src = (const char *)buf;
+    size_t bsize = dev.block_size();
+    size_t pos = 0;
+
+    while (pos < len)
+    {
+        // skip over a run of zero blocks
+        while (pos < len && is_zero(src + pos, std::min(bsize, len - pos)))
+            pos += bsize;
+
+        // then write out the following run of blocks that have data in one go
+        size_t run = pos;
+        while (run < len && !is_zero(src + run, std::min(bsize, len - run)))
+            run += bsize;
+
+        run = std::min(run, len);
+        if (run > pos)
+            write(offset + pos, src + pos, run - pos);
+
+        pos = run;
+    }
+}
+
+void IOQueue::queue(const Request &req)
+{
+    if (req.len == 0)
+        return;
+
+    if (ring_fd < 0 || broken)
+    {
+        auto done = req.write ? dev.write(req.offset, req.buf, req.len) : dev.read(req.offset, req.buf, req.len);
+        if (!done)
+            fail(done.error());
+        return;
+    }
+
+    // ring is full, push what's queued and wait for room
+    while (free_slots.empty())
+    {
+        submit(1);
+        reap();
+    }
+
+    uint32_t slot = free_slots.back();
+    free_slots.pop_back();
+    slots[slot] = req;
+    push_sqe(slot);
+}
+
+void IOQueue::push_sqe(uint32_t slot)
+{
+    const Request &req = slots[slot];
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+
+    io_uring_sqe *sqe = (io_uring_sqe *)sqe_mem + index;
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = dev.native_handle();
+    sqe->off = req.offset;
+    sqe->addr = (uint64_t)(uintptr_t)req.buf;
+    sqe->len = req.len;
+    sqe->user_data = slot;
+
+    sq_array[index] = index;
+
+    // the kernel must see the filled in entry before the new tail
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+}
+
+void IOQueue::submit(unsigned min_complete)
+{
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    while (to_submit > 0 || min_complete > 0)
+    {
+        int n = uring_enter(ring_fd, to_submit, min_complete, flags);
+        if (n < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+                // completions need reaping before the kernel takes more
+                reap();
+                continue;
+            }
+
+            fail(std::string("io_uring_enter failed: ") + std::strerror(errno));
+            to_submit = 0;
+            broken = true;
+            return;
+        }
+
+        to_submit -= std::min<unsigned>(n, to_submit);
+        if (to_submit == 0)
+            return;
+
+        min_complete = 0;
+        flags = 0;
+    }
+}
+
+void IOQueue::reap()
+{
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        io_uring_cqe *cqe = (io_uring_cqe *)cqes + (head & *cq_mask);
+        uint32_t slot = cqe->user_data;
+        int res = cqe->res;
+        head++;
+
+        Request &req = slots[slot];
+
+        if (res < 0)
+        {
+            fail(std::string(req.write ? "Write failed: " : "Read failed: ") + std::strerror(-res));
+            free_slots.push_back(slot);
+        }
+        else if (res == 0 && !req.write)
+        {
+            fail("Read past end of image");
+            free_slots.push_back(slot);
+        }
+        else if ((size_t)res < req.len)
+        {
+            // short transfer, send the rest back round in the same slot
+            req.offset += res;
+            req.buf += res;
+            req.len -= res;
+            push_sqe(slot);
+        }
+        else
+        {
+            free_slots.push_back(slot);
+        }
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+size_t IOQueue::poll()
+{
+    if (ring_fd < 0)
+        return 0;
+
+    submit(0);
+    reap();
+    return entries - free_slots.size();
+}
+
+tl::expected<monostate, std::string> IOQueue::flush()
+{
+    if (ring_fd >= 0)
+    {
+        // once the ring itself has failed nothing more is coming back
+        while (free_slots.size() < entries && !broken)
+        {
+            submit(1);
+            reap();
+        }
+    }
+
+    auto done = result;
+    result = monostate{};
+    return done;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "block_device.hpp"
+#include "expected.hpp"
+#include "monostate.hpp"
+
+/*
+    Batches block reads and writes against a BlockDevice
+
+    With the Uring backend requests are queued as io_uring submissions and kept in
+    flight up to depth at a time, so bulk operations keep a deep queue outstanding
+    against the image instead of waiting on one syscall per block. With any other
+    backend (or if the kernel refuses to set up a ring) every request is carried out
+    synchronously as soon as it's queued, so callers can use the same code either way
+
+    Buffers handed to read/write must stay alive and untouched until flush returns.
+    A queue isn't thread safe, give each thread its own
+*/
+class IOQueue
+{
+public:
+    explicit IOQueue(BlockDevice &dev, unsigned depth = 64);
+    ~IOQueue();
+
+    IOQueue(const IOQueue &) = delete;
+    IOQueue &operator=(const IOQueue &) = delete;
+
+    void read(uint64_t offset, void *buf, size_t len);
+    void write(uint64_t offset, const void *buf, size_t len);
+
+    void read_block(uint64_t block, void *buf) { read(block * dev.block_size(), buf, dev.block_size()); }
+    void write_block(uint64_t block, const void *buf) { write(block * dev.block_size(), buf, dev.block_size()); }
+
+    /*
+        Like write, but blocks of buf that are entirely zero are skipped, leaving holes.
+        Only valid where the skipped range already reads back as zeroes, like a freshly
+        created or preallocated image
+    */
+    void write_nonzero(uint64_t offset, const void *buf, size_t len);
+
+    // Reaps whatever has completed without blocking, returns how many requests are still outstanding
+    size_t poll();
+
+    // Submits everything queued and waits for all of it, returns the first error hit since the last flush
+    tl::expected<monostate, std::string> flush();
+
+    bool is_async() const { return ring_fd >= 0; }
+
+private:
+    struct Request
+    {
+        uint64_t offset;
+        char *buf;
+        size_t len;
+        bool write;
+    };
+
+    bool setup_ring(unsigned depth);
+    void queue(const Request &req);
+    void push_sqe(uint32_t slot);
+    void submit(unsigned min_complete);
+    void reap();
+    void fail(const std::string &err);
+
+    BlockDevice &dev;
+    tl::expected<monostate, std::string> result = monostate{};
+
+    // io_uring state, ring_fd is -1 when requests are done synchronously
+    int ring_fd = -1;
+    bool broken = false;
+    unsigned entries = 0;
+    unsigned to_submit = 0;
+
+    void *sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void *cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    void *sqe_mem = nullptr;
+    size_t sqe_mem_size = 0;
+
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    void *cqes = nullptr;
+
+    // in-flight requests indexed by slot (sqe user_data), free_slots holds the unused ones
+    std::vector<Request> slots;
+    std::vector<uint32_t> free_slots;
+};
@@ -0,0 +1,678 @@
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+
+#include "alloc.hpp"
+#include "filesystem.hpp"
+#include "journal.hpp"
+
+// Block numbers a descriptor or revoke block has room for
+static uint32_t ids_per_block(uint32_t block_size)
+{
+    return (block_size - sizeof(JournalHeader)) / sizeof(uint64_t);
+}
+
+static JournalHeader make_header(uint32_t type, uint64_t tid, uint32_t count)
+{
+    JournalHeader header = {JOURNAL_MAGIC, type, tid, count, 0};
+    return header;
+}
+
+JournalHandle &JournalHandle::operator=(JournalHandle &&other)
+{
+    if (this != &other)
+    {
+        reset();
+        journal = other.journal;
+        credits = other.credits;
+        other.journal = nullptr;
+    }
+    return *this;
+}
+
+void JournalHandle::extend(uint32_t more)
+{
+    if (journal)
+    {
+        journal->extend(more);
+        credits += more;
+    }
+}
+
+void JournalHandle::reset()
+{
+    if (journal)
+    {
+        journal->end_update(credits);
+        journal = nullptr;
+    }
+}
+
+Journal::Journal(Filesystem &fs, const MountOptions &opts)
+    : fs(fs), dev(fs.dev), first_block(fs.sb.journal_start), blocks(fs.sb.journal_blocks), mode(opts.journal_mode),
+      interval(opts.commit_interval), fill(std::min<uint32_t>(opts.checkpoint_fill, 100))
+{
+}
+
+Journal::~Journal()
+{
+    stop();
+}
+
+tl::expected<monostate, std::string> Journal::open()
+{
+    std::vector<char> buf(dev.block_size());
+    auto got = dev.read_block(first_block, buf.data());
+    if (!got)
+        return got;
+
+    JournalSuperblock jsb;
+    std::memcpy(&jsb, buf.data(), sizeof(jsb));
+    if (jsb.magic != JOURNAL_MAGIC || jsb.blocks != blocks || jsb.start == 0 || jsb.start >= blocks)
+        return tl::make_unexpected("Journal superblock is corrupt");
+
+    tail = head = jsb.start;
+    tail_tid = sequence = jsb.sequence;
+    in_use = 0;
+
+    fs.cache->enable_journal(1, mode == JournalMode::Ordered);
+
+    stopping = false;
+    committer = std::thread([this]
+                            { commit_loop(); });
+    checkpointer = std::thread([this]
+                               { checkpoint_loop(); });
+    return monostate{};
+}
+
+void Journal::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+
+    if (committer.joinable())
+        committer.join();
+    if (checkpointer.joinable())
+        checkpointer.join();
+}
+
+void Journal::commit_loop()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!stopping)
+    {
+        auto wanted = [this]
+        { return stopping || commit_wanted; };
+
+        if (interval.count() > 0)
+            cv.wait_for(lock, interval, wanted);
+        else
+            cv.wait(lock, wanted);
+
+        if (stopping)
+            break;
+
+        // nowhere to report a failure from here, the next commit tries again and sync reports it
+        lock.unlock();
+        commit();
+        lock.lock();
+    }
+}
+
+void Journal::checkpoint_loop()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!stopping)
+    {
+        cv.wait(lock, [this]
+                { return stopping || over_fill(); });
+        if (stopping)
+            break;
+
+        lock.unlock();
+        auto done = checkpoint_log();
+        lock.lock();
+
+        // commits fall back on checkpointing themselves meanwhile, so don't spin on a failing device
+        if (!done)
+            cv.wait_for(lock, std::chrono::seconds(1), [this]
+                        { return stopping; });
+    }
+}
+
+JournalHandle Journal::start(uint32_t credits)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+
+    // keep the running transaction well inside what the log can take in one go, and from
+    // filling the block cache with blocks it can't write back yet. An operation needing
+    // more than that gets a transaction to itself
+    size_t limit = std::min<size_t>(capacity() / 2, fs.cache->capacity() / 2);
+    auto room = [&]
+    {
+        size_t taken = fs.cache->running_size() + reserved;
+        return taken == 0 || taken + credits <= limit;
+    };
+
+    while (closing || (!stopping && failed.empty() && !room()))
+    {
+        if (!closing)
+        {
+            commit_wanted = true;
+            cv.notify_all();
+        }
+        cv.wait(lock);
+    }
+
+    updates++;
+    reserved += credits;
+    return JournalHandle(this, credits);
+}
+
+void Journal::end_update(uint32_t credits)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    reserved -= credits;
+    if (--updates == 0)
+        cv.notify_all();
+}
+
+void Journal::extend(uint32_t credits)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    reserved += credits;
+}
+
+void Journal::revoke(uint64_t block)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    // only blocks with copies in the log, or on their way there, can be replayed over
+    if (logged.count(block) || committing.count(block) || fs.cache->in_running(block))
+        revokes.push_back(block);
+}
+
+uint32_t Journal::used()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return in_use;
+}
+
+uint32_t Journal::advance(uint32_t pos, uint32_t count) const
+{
+    // position 0 is the journal superblock, the log is the ring after it
+    return 1 + (pos - 1 + count) % (blocks - 1);
+}
+
+tl::expected<monostate, std::string> Journal::write_log(uint32_t pos, const char *data, uint32_t count)
+{
+    uint32_t block_size = dev.block_size();
+
+    // at most two pieces, up to the end of the area and then from the start of the ring
+    uint32_t first = std::min(count, blocks - pos);
+    auto written = dev.write((first_block + pos) * block_size, data, (uint64_t)first * block_size);
+    if (!written || first == count)
+        return written;
+
+    return dev.write((first_block + 1) * block_size, data + (uint64_t)first * block_size,
+                     (uint64_t)(count - first) * block_size);
+}
+
+tl::expected<monostate, std::string> Journal::write_super(uint32_t start, uint64_t start_tid)
+{
+    std::vector<char> buf(dev.block_size(), 0);
+
+    JournalSuperblock jsb = {JOURNAL_MAGIC, blocks, start_tid, start, 0};
+    std::memcpy(buf.data(), &jsb, sizeof(jsb));
+
+    return dev.write_block(first_block, buf.data());
+}
+
+tl::expected<monostate, std::string> Journal::commit()
+{
+    std::lock_guard<std::mutex> serial(commit_mtx);
+
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!failed.empty())
+            return tl::make_unexpected(failed);
+
+        closing = true;
+        commit_wanted = false;
+        cv.wait(lock, [this]
+                { return updates == 0; });
+    }
+
+    // with no operation half done, the transaction takes in everything still only in memory too
+    std::vector<uint64_t> homes;
+    std::vector<char> data;
+    std::vector<uint64_t> revoked;
+
+    auto written = fs.write_metadata();
+    uint64_t tid = 0;
+    if (written)
+        tid = fs.cache->close_transaction(homes, data);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (written)
+        {
+            revoked.swap(revokes);
+            committing.insert(homes.begin(), homes.end());
+        }
+        closing = false;
+    }
+    cv.notify_all();
+
+    if (!written)
+        return written;
+
+    // in ordered mode the file contents this transaction's metadata points at go first, the sync below covers them
+    std::vector<uint64_t> ordered;
+    if (mode == JournalMode::Ordered)
+    {
+        fs.cache->take_ordered(ordered);
+        written = fs.cache->write_back(ordered);
+        if (!written)
+            return reopen(tid, homes, ordered, revoked, written.error());
+    }
+
+    // a block logged again after being freed is back in use, its revoke no longer applies
+    std::sort(revoked.begin(), revoked.end());
+    revoked.erase(std::unique(revoked.begin(), revoked.end()), revoked.end());
+    revoked.erase(std::remove_if(revoked.begin(), revoked.end(), [&](uint64_t block)
+                                 { return committing.count(block) > 0; }),
+                  revoked.end());
+
+    if (homes.empty() && revoked.empty())
+    {
+        fs.cache->commit_transaction(tid);
+        return monostate{};
+    }
+
+    uint32_t block_size = dev.block_size();
+    uint32_t per_block = ids_per_block(block_size);
+    uint32_t descriptors = (homes.size() + per_block - 1) / per_block;
+    uint32_t revoke_blocks = (revoked.size() + per_block - 1) / per_block;
+    uint32_t length = descriptors + homes.size() + revoke_blocks + 1;
+
+    // only an operation going past its credits gets here, no later commit could fit it either. Its blocks stay
+    // held for good, the image is left as of the last commit
+    if (length > capacity())
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        failed = "Transaction of " + std::to_string(length) + " blocks doesn't fit in the journal";
+        committing.clear();
+        return tl::make_unexpected(failed);
+    }
+
+    // the checkpoint thread normally keeps ahead of this, no other commit can take the room back meanwhile
+    if (used() + length > capacity())
+    {
+        auto emptied = checkpoint_log();
+        if (!emptied)
+            return reopen(tid, homes, ordered, revoked, emptied.error());
+    }
+
+    // descriptors followed by the blocks they describe, then revokes, all written in one go
+    std::vector<char> log((size_t)(length - 1) * block_size, 0);
+    std::vector<uint32_t> positions(homes.size());
+    size_t at = 0;
+
+    for (size_t i = 0; i < homes.size(); i += per_block)
+    {
+        uint32_t count = std::min<size_t>(per_block, homes.size() - i);
+
+        JournalHeader header = make_header(JOURNAL_DESCRIPTOR, sequence, count);
+        std::memcpy(&log[at * block_size], &header, sizeof(header));
+        std::memcpy(&log[at * block_size + sizeof(header)], &homes[i], count * sizeof(uint64_t));
+        at++;
+
+        std::memcpy(&log[at * block_size], &data[i * block_size], (size_t)count * block_size);
+        for (uint32_t j = 0; j < count; j++)
+            positions[i + j] = advance(head, at + j);
+        at += count;
+    }
+
+    for (size_t i = 0; i < revoked.size(); i += per_block)
+    {
+        uint32_t count = std::min<size_t>(per_block, revoked.size() - i);
+
+        JournalHeader header = make_header(JOURNAL_REVOKE, sequence, count);
+        std::memcpy(&log[at * block_size], &header, sizeof(header));
+        std::memcpy(&log[at * block_size + sizeof(header)], &revoked[i], count * sizeof(uint64_t));
+        at++;
+    }
+
+    auto logged_ok = write_log(head, log.data(), length - 1);
+    if (!logged_ok)
+        return reopen(tid, homes, ordered, revoked, logged_ok.error());
+
+    // the commit record mustn't reach the disk before what it vouches for
+    logged_ok = dev.sync();
+    if (!logged_ok)
+        return reopen(tid, homes, ordered, revoked, logged_ok.error());
+
+    std::vector<char> commit_block(block_size, 0);
+    JournalHeader header = make_header(JOURNAL_COMMIT, sequence, 0);
+    std::memcpy(commit_block.data(), &header, sizeof(header));
+
+    // if the record made it anyway, the retry writes the same id over it with everything it had and more
+    logged_ok = write_log(advance(head, length - 1), commit_block.data(), 1);
+    if (!logged_ok)
+        return reopen(tid, homes, ordered, revoked, logged_ok.error());
+
+    logged_ok = dev.sync();
+    if (!logged_ok)
+        return reopen(tid, homes, ordered, revoked, logged_ok.error());
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (uint64_t block : revoked)
+            logged.erase(block);
+        for (size_t i = 0; i < homes.size(); i++)
+            logged[homes[i]] = positions[i];
+        committing.clear();
+
+        head = advance(head, length);
+        in_use += length;
+        sequence++;
+    }
+    cv.notify_all();
+
+    fs.cache->commit_transaction(tid);
+    return monostate{};
+}
+
+/*
+    Puts a transaction that couldn't be committed back into the running one, blocks,
+    revokes, ordered file contents and all, so the next commit takes it in instead
+    of letting its blocks go home unlogged. Returns error
+*/
+tl::expected<monostate, std::string> Journal::reopen(uint64_t tid, const std::vector<uint64_t> &homes,
+                                                     const std::vector<uint64_t> &ordered,
+                                                     const std::vector<uint64_t> &revoked, const std::string &error)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        fs.cache->reopen_transaction(tid, homes, ordered);
+        revokes.insert(revokes.end(), revoked.begin(), revoked.end());
+        committing.clear();
+    }
+    cv.notify_all();
+
+    return tl::make_unexpected(error);
+}
+
+tl::expected<monostate, std::string> Journal::checkpoint()
+{
+    auto flushed = fs.cache->flush();
+    if (!flushed)
+        return flushed;
+
+    return checkpoint_log();
+}
+
+/*
+    Gets everything committed so far to its home location and moves the start of the
+    log up past it. Commits carry on meanwhile, only the part of the log in use when
+    it started is reclaimed
+*/
+tl::expected<monostate, std::string> Journal::checkpoint_log()
+{
+    std::lock_guard<std::mutex> serial(checkpoint_mtx);
+
+    uint32_t end;
+    uint64_t end_tid;
+    uint32_t reclaimed;
+    std::vector<std::pair<uint64_t, uint32_t>> entries;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (in_use == 0)
+            return monostate{};
+
+        end = head;
+        end_tid = sequence;
+        reclaimed = in_use;
+        entries.assign(logged.begin(), logged.end());
+    }
+
+    std::sort(entries.begin(), entries.end());
+
+    std::vector<uint64_t> homes;
+    for (auto &entry : entries)
+        homes.push_back(entry.first);
+
+    auto written = fs.cache->write_back(homes);
+    if (!written)
+        return written;
+
+    // blocks changed again since their last commit are held back in the cache, their committed copies come from the log
+    std::vector<char> buf(dev.block_size());
+    for (auto &entry : entries)
+    {
+        auto done = fs.cache->write_committed(entry.first, nullptr);
+        if (done && !*done)
+        {
+            auto got = dev.read_block(first_block + entry.second, buf.data());
+            if (!got)
+                return got;
+            done = fs.cache->write_committed(entry.first, buf.data());
+        }
+        if (!done)
+            return tl::make_unexpected(done.error());
+    }
+
+    written = dev.sync();
+    if (!written)
+        return written;
+
+    // the new start has to be on disk before commits can reuse the space behind it
+    written = write_super(end, end_tid);
+    if (written)
+        written = dev.sync();
+    if (!written)
+        return written;
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        tail = end;
+        tail_tid = end_tid;
+        in_use -= reclaimed;
+
+        for (auto &entry : entries)
+        {
+            auto found = logged.find(entry.first);
+            if (found != logged.end() && found->second == entry.second)
+                logged.erase(found);
+        }
+    }
+    cv.notify_all();
+
+    return monostate{};
+}
+
+uint32_t journal_size(const Superblock &sb)
+{
+    // the log is one contiguous run, which has to leave room in its group for the bitmaps and inode table
+    uint32_t blocks = std::min<uint32_t>({sb.num_blocks / 32, sb.blocks_per_group / 2, 32768});
+    return blocks < JOURNAL_MIN_BLOCKS ? 0 : blocks;
+}
+
+tl::expected<monostate, std::string> journal_create(Filesystem &fs, uint32_t blocks)
+{
+    if (blocks < JOURNAL_MIN_BLOCKS)
+        return tl::make_unexpected("Journal needs at least " + std::to_string(JOURNAL_MIN_BLOCKS) + " blocks");
+
+    // in the middle of the disk, so it's never far from anything
+    auto run = alloc_blocks(fs, fs.group_start(fs.num_groups() / 2), blocks);
+    if (!run)
+        return tl::make_unexpected(run.error());
+
+    if (run->len < blocks)
+    {
+        free_blocks(fs, run->start, run->len);
+        return tl::make_unexpected("No room for a journal of " + std::to_string(blocks) + " contiguous blocks");
+    }
+
+    auto block = fs.cache->get_new(run->start);
+    if (!block)
+        return tl::make_unexpected(block.error());
+
+    JournalSuperblock jsb = {JOURNAL_MAGIC, blocks, 1, 1, 0};
+    {
+        auto guard = block->lock();
+        std::memset(block->data(), 0, fs.block_size());
+        std::memcpy(block->data(), &jsb, sizeof(jsb));
+        block->mark_dirty();
+    }
+
+    std::lock_guard<std::mutex> lock(fs.meta_mtx);
+    fs.sb.journal_start = run->start;
+    fs.sb.journal_blocks = blocks;
+    return monostate{};
+}
+
+tl::expected<uint32_t, std::string> journal_recover(BlockDevice &dev, const Superblock &sb)
+{
+    if (sb.journal_blocks == 0)
+        return 0;
+
+    uint32_t block_size = dev.block_size();
+    uint32_t per_block = ids_per_block(block_size);
+    uint64_t first_block = sb.journal_start;
+    uint32_t blocks = sb.journal_blocks;
+
+    std::vector<char> buf(block_size);
+    auto got = dev.read_block(first_block, buf.data());
+    if (!got)
+        return tl::make_unexpected(got.error());
+
+    JournalSuperblock jsb;
+    std::memcpy(&jsb, buf.data(), sizeof(jsb));
+    if (jsb.magic != JOURNAL_MAGIC || jsb.blocks != blocks || jsb.start == 0 || jsb.start >= blocks)
+        return tl::make_unexpected("Journal superblock is corrupt");
+
+    auto advance = [blocks](uint32_t pos, uint32_t count)
+    { return 1 + (pos - 1 + count) % (blocks - 1); };
+
+    // newest committed copy of every block as (id, log position), and the newest revoke of each
+    std::unordered_map<uint64_t, std::pair<uint64_t, uint32_t>> newest;
+    std::unordered_map<uint64_t, uint64_t> revoked;
+
+    // what the transaction being read has so far, only taken in once its commit record turns up
+    std::vector<std::pair<uint64_t, uint32_t>> copies;
+    std::vector<uint64_t> revokes;
+
+    uint32_t pos = jsb.start;
+    uint64_t tid = jsb.sequence;
+    uint32_t end = pos;
+    uint32_t scanned = 0;
+    uint32_t replayed = 0;
+
+    while (scanned < blocks - 1)
+    {
+        got = dev.read_block(first_block + pos, buf.data());
+        if (!got)
+            return tl::make_unexpected(got.error());
+
+        JournalHeader header;
+        std::memcpy(&header, buf.data(), sizeof(header));
+        if (header.magic != JOURNAL_MAGIC || header.tid != tid)
+            break;
+
+        const uint64_t *ids = (const uint64_t *)(buf.data() + sizeof(header));
+
+        if (header.type == JOURNAL_DESCRIPTOR)
+        {
+            if (header.count > per_block || scanned + 1 + header.count > blocks - 1)
+                break;
+
+            for (uint32_t i = 0; i < header.count; i++)
+                copies.push_back(std::make_pair(ids[i], advance(pos, 1 + i)));
+
+            scanned += 1 + header.count;
+            pos = advance(pos, 1 + header.count);
+        }
+        else if (header.type == JOURNAL_REVOKE)
+        {
+            if (header.count > per_block)
+                break;
+
+            revokes.insert(revokes.end(), ids, ids + header.count);
+            scanned++;
+            pos = advance(pos, 1);
+        }
+        else if (header.type == JOURNAL_COMMIT)
+        {
+            for (uint64_t block : revokes)
+                revoked[block] = tid;
+            for (auto &copy : copies)
+                newest[copy.first] = std::make_pair(tid, copy.second);
+
+            copies.clear();
+            revokes.clear();
+
+            scanned++;
+            pos = advance(pos, 1);
+            end = pos;
+            tid++;
+            replayed++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (replayed == 0)
+        return 0;
+
+    std::vector<std::pair<uint64_t, uint32_t>> writes;
+    for (auto &entry : newest)
+    {
+        uint64_t home = entry.first;
+
+        // a block freed after its last copy was logged may hold anything by now
+        auto revoke = revoked.find(home);
+        if (revoke != revoked.end() && revoke->second >= entry.second.first)
+            continue;
+
+        bool in_journal = home >= first_block && home < first_block + blocks;
+        if (home >= sb.num_blocks || in_journal)
+            continue;
+
+        writes.push_back(std::make_pair(home, entry.second.second));
+    }
+
+    // in block order so the writes sweep across the image once
+    std::sort(writes.begin(), writes.end());
+    for (auto &write : writes)
+    {
+        got = dev.read_block(first_block + write.second, buf.data());
+        if (got)
+            got = dev.write_block(write.first, buf.data());
+        if (!got)
+            return tl::make_unexpected(got.error());
+    }
+
+    got = dev.sync();
+    if (!got)
+        return tl::make_unexpected(got.error());
+
+    // everything replayed is home, the log starts over after it
+    std::fill(buf.begin(), buf.end(), 0);
+    jsb.start = end;
+    jsb.sequence = tid;
+    std::memcpy(buf.data(), &jsb, sizeof(jsb));
+
+    got = dev.write_block(first_block, buf.data());
+    if (got)
+        got = dev.sync();
+    if (!got)
+        return tl::make_unexpected(got.error());
+
+    return replayed;
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "block_device.hpp"
+#include "expected.hpp"
+#include "fs.hpp"
+#include "monostate.hpp"
+
+struct Filesystem;
+struct MountOptions;
+class Journal;
+
+/*
+    Write-ahead journal for metadata
+
+    Anything marked dirty through BufferRef::mark_dirty counts as metadata: the
+    superblock and descriptor table, bitmaps, inode tables, directory and mapping
+    blocks. Changes to them are gathered into a running transaction that any number
+    of operations share, each one running inside a JournalHandle so a transaction
+    never closes halfway through an operation. Every commit interval (or sooner if it
+    grows large, or on sync) the transaction is committed as a whole: copies of its
+    blocks are appended to the log, the image is synced, a commit record follows and
+    the image is synced again. The block cache holds the blocks back until then, so
+    nothing reaches its home location before it's safely in the log. Opening an
+    image replays every transaction in the log that has a commit record, the
+    metadata always comes back as it was at some commit
+
+    Blocks freed while they still have copies in the log are revoked, so replay
+    can't write stale metadata over whatever the block gets reused for
+
+    File contents aren't logged. In ordered mode the ones written through the block
+    cache go to the image before the commit of the metadata pointing at them, so
+    after a crash a file never has blocks holding whatever was there before. In
+    writeback mode they go whenever the cache gets to them
+
+    Log space is reclaimed by checkpoints, which get what's committed to its home
+    location and move the start of the log up past it. A background thread runs
+    one whenever the log fills past a set level, so commits (and the writers behind
+    them) don't have to wait for one; a commit only checkpoints itself if the log
+    fills up anyway, and sync empties it completely
+
+    Log area, journal_blocks blocks from journal_start
+    -------------------------------------------------------------------------------
+    | Journal Superblock | Descriptor | Data ... | Revoke | Commit | Descriptor | ...
+    -------------------------------------------------------------------------------
+    The rest of the area is a ring, the journal superblock says where the oldest
+    transaction in it starts and what its id is. Replay walks forward from there
+    for as long as it finds records carrying the next id in sequence
+*/
+
+const uint32_t JOURNAL_MAGIC = 0x4A524E4C;
+
+// What a log block holds
+const uint32_t JOURNAL_DESCRIPTOR = 1; // home block numbers of the data blocks following it
+const uint32_t JOURNAL_COMMIT = 2;     // the transaction is complete
+const uint32_t JOURNAL_REVOKE = 3;     // blocks no earlier copy of should be replayed
+
+// Smallest journal worth having, mkfs leaves it out on filesystems too small for one
+const uint32_t JOURNAL_MIN_BLOCKS = 64;
+
+// What happens to file contents, see Journal
+enum class JournalMode
+{
+    Ordered,
+    Writeback,
+};
+
+struct JournalSuperblock
+{
+    uint32_t magic;
+    uint32_t blocks;
+    // id and log position of the oldest transaction that may still need replaying
+    uint64_t sequence;
+    uint32_t start;
+    uint32_t _pad;
+};
+
+// Starts every descriptor, revoke and commit block, followed by count block numbers for the first two
+struct JournalHeader
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t tid;
+    uint32_t count;
+    uint32_t _pad;
+};
+
+/*
+    Marks an operation as in progress in the running transaction, which can't be
+    committed until every handle on it is gone. Handles don't nest, taking a second
+    one while holding one can deadlock against a commit
+
+    Every handle holds credits, room in the running transaction for as many blocks
+    as the operation may change, so the transaction never outgrows the log however
+    many operations share it
+*/
+class JournalHandle
+{
+public:
+    JournalHandle() = default;
+    JournalHandle(Journal *journal, uint32_t credits) : journal(journal), credits(credits) {}
+    ~JournalHandle() { reset(); }
+
+    JournalHandle(JournalHandle &&other) : journal(other.journal), credits(other.credits) { other.journal = nullptr; }
+    JournalHandle &operator=(JournalHandle &&other);
+
+    JournalHandle(const JournalHandle &) = delete;
+    JournalHandle &operator=(const JournalHandle &) = delete;
+
+    // For an operation finding out it needs more once under way. Doesn't wait for room, a commit can't make any meanwhile
+    void extend(uint32_t more);
+
+    void reset();
+
+private:
+    Journal *journal = nullptr;
+    uint32_t credits = 0;
+};
+
+class Journal
+{
+public:
+    // Takes the mode, commit interval and checkpoint level from opts
+    Journal(Filesystem &fs, const MountOptions &opts);
+    ~Journal();
+
+    Journal(const Journal &) = delete;
+    Journal &operator=(const Journal &) = delete;
+
+    // Picks up the log (which must have been recovered already) and starts committing and checkpointing in the background
+    tl::expected<monostate, std::string> open();
+
+    // Stops the background threads, whatever is still running has to be committed by hand
+    void stop();
+
+    // Reserves credits, waiting while a commit is closing the running transaction or until one makes room for them
+    JournalHandle start(uint32_t credits);
+
+    // Commits the running transaction, waiting for any operations in progress to finish first
+    tl::expected<monostate, std::string> commit();
+
+    // Writes every dirty block back, including everything committed, and empties the log
+    tl::expected<monostate, std::string> checkpoint();
+
+    // Call for every freed block, before it's dropped from the block cache
+    void revoke(uint64_t block);
+
+    // Blocks of the log in use, out of capacity()
+    uint32_t used();
+    uint32_t capacity() const { return blocks - 1; }
+
+private:
+    friend class JournalHandle;
+
+    void end_update(uint32_t credits);
+    void extend(uint32_t credits);
+    tl::expected<monostate, std::string> reopen(uint64_t tid, const std::vector<uint64_t> &homes,
+                                                const std::vector<uint64_t> &ordered,
+                                                const std::vector<uint64_t> &revoked, const std::string &error);
+    void commit_loop();
+    void checkpoint_loop();
+    // an empty log is never over, so a level of 0 checkpoints after every commit rather than spinning
+    bool over_fill() const { return in_use > 0 && (uint64_t)in_use * 100 >= (uint64_t)capacity() * fill; }
+
+    tl::expected<monostate, std::string> checkpoint_log();
+    tl::expected<monostate, std::string> write_log(uint32_t pos, const char *data, uint32_t count);
+    tl::expected<monostate, std::string> write_super(uint32_t start, uint64_t start_tid);
+    uint32_t advance(uint32_t pos, uint32_t count) const;
+
+    Filesystem &fs;
+    BlockDevice &dev;
+    uint64_t first_block;
+    uint32_t blocks;
+    JournalMode mode;
+    std::chrono::milliseconds interval;
+    // percentage of the log in use that sets off a background checkpoint
+    uint32_t fill;
+
+    // one commit at a time, taken before checkpoint_mtx
+    std::mutex commit_mtx;
+    // one checkpoint at a time
+    std::mutex checkpoint_mtx;
+
+    // guards everything below
+    std::mutex mtx;
+    std::condition_variable cv;
+    unsigned updates = 0;
+    // credits held by the handles in progress
+    size_t reserved = 0;
+    // a commit is closing the running transaction, new handles wait
+    bool closing = false;
+    bool commit_wanted = false;
+    bool stopping = false;
+    std::vector<uint64_t> revokes;
+    // blocks in the transaction being written to the log, a free meanwhile still needs a revoke
+    std::unordered_set<uint64_t> committing;
+    // why a transaction couldn't be committed at all, nothing is committed after it
+    std::string failed;
+
+    // the log, positions are block indexes into the journal area
+    uint32_t tail = 1;
+    uint32_t head = 1;
+    uint32_t in_use = 0;
+    uint64_t tail_tid = 1;
+    // id the next transaction written to the log gets
+    uint64_t sequence = 1;
+    // log position of the newest committed copy of every block in the log
+    std::unordered_map<uint64_t, uint32_t> logged;
+
+    std::thread committer;
+    std::thread checkpointer;
+};
+
+// Journal size mkfs picks for a filesystem, 0 when it's too small for one
+uint32_t journal_size(const Superblock &sb);
+
+// Sets aside and formats a journal of the given size on a freshly made filesystem, it has to fit in one group
+tl::expected<monostate, std::string> journal_create(Filesystem &fs, uint32_t blocks);
+
+/*
+    Replays the committed transactions left in the journal of an image that wasn't
+    closed cleanly, straight through the device before anything else reads it.
+    Returns how many were replayed
+*/
+tl::expected<uint32_t, std::string> journal_recover(BlockDevice &dev, const Superblock &sb);
@@ -1,3 +1,5 @@
+#pragma once
+
 /*
     Unit type for returning nothing in variant, expected, optional, etc
 */
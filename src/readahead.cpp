@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <vector>
+
+#include "readahead.hpp"
+
+// stream state is tiny, but don't let it grow forever on a workload touching millions of files
+static const size_t MAX_STREAMS = 4096;
+
+Readahead::Readahead(BlockCache &cache, uint32_t min_window, uint32_t max_window)
+    : cache(cache), min_window(std::max<uint32_t>(min_window, 1)), max_window(std::max(min_window, max_window)), worker(1)
+{
+}
+
+Readahead::~Readahead()
+{
+    worker.wait();
+}
+
+void Readahead::access(uint32_t ino, uint64_t first, uint64_t last, uint64_t num_blocks, BlockMap map)
+{
+    uint64_t from, to;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+
+        if (streams.size() >= MAX_STREAMS && !streams.count(ino))
+            streams.clear();
+
+        Stream &s = streams[ino];
+
+        // reads smaller than a block (or not lined up with them) pick up in the block the last one ended in
+        if (first == s.next || (s.next > 0 && first == s.next - 1))
+        {
+            // sequential (a new stream starts at next = 0), open up the window as the reader moves on
+            if (last + 1 > s.next)
+                s.window = s.window == 0 ? min_window : std::min(s.window * 2, max_window);
+        }
+        else
+        {
+            // random access, stop prefetching until the reader goes sequential again
+            s.window = 0;
+            s.ra_end = last + 1;
+        }
+
+        s.next = last + 1;
+
+        if (s.window == 0)
+            return;
+
+        // only top up once the reader has eaten into half of what's been fetched
+        if (s.ra_end > last + 1 + s.window / 2)
+            return;
+
+        from = std::max(s.ra_end, last + 1);
+        to = std::min<uint64_t>(last + 1 + s.window, num_blocks);
+        if (from >= to)
+            return;
+
+        s.ra_end = to;
+    }
+
+    worker.submit([this, from, to, map]
+                  {
+        std::vector<uint64_t> blocks;
+        for (uint64_t l = from; l < to; l++)
+        {
+            uint64_t phys = map(l);
+            if (phys)
+                blocks.push_back(phys);
+        }
+
+        // readahead is only a hint, a failed prefetch just means a later miss
+        cache.prefetch(blocks); });
+}
+
+void Readahead::forget(uint32_t ino)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    streams.erase(ino);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+#include "cache.hpp"
+#include "thread_pool.hpp"
+
+/*
+    Adaptive readahead on top of the block cache
+
+    File reads report the range of logical blocks they touch. A stream reading blocks in order
+    gets a window of upcoming blocks prefetched into the cache in the background,
+    the window doubles each time the stream keeps going sequentially (up to
+    max_window) and collapses to nothing on a random access. The next batch is
+    kicked off once the reader is halfway through the current one, so the reads
+    stay ahead of it instead of stalling at every window boundary
+*/
+class Readahead
+{
+public:
+    // Maps a logical block of the file to its physical block, 0 for holes
+    typedef std::function<uint64_t(uint64_t)> BlockMap;
+
+    Readahead(BlockCache &cache, uint32_t min_window = 4, uint32_t max_window = 256);
+    ~Readahead();
+
+    /*
+        Records a read of logical blocks first through last of inode ino, num_blocks is
+        the size of the file in blocks so the window never runs past the end. A read
+        starting where the last one ended, or in the block it ended in, is sequential.
+        map is called from the background thread, so it mustn't refer to anything that goes away
+    */
+    void access(uint32_t ino, uint64_t first, uint64_t last, uint64_t num_blocks, BlockMap map);
+
+    // Drops the stream state for an inode, e.g. when it's truncated or freed
+    void forget(uint32_t ino);
+
+    // Waits for any prefetches in flight
+    void drain() { worker.wait(); }
+
+private:
+    struct Stream
+    {
+        // logical block a sequential reader would ask for next
+        uint64_t next = 0;
+        uint32_t window = 0;
+        // everything before this has already been prefetched
+        uint64_t ra_end = 0;
+    };
+
+    BlockCache &cache;
+    uint32_t min_window;
+    uint32_t max_window;
+
+    std::mutex mtx;
+    std::unordered_map<uint32_t, Stream> streams;
+
+    ThreadPool worker;
+};
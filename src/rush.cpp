@@ -5,10 +5,85 @@
 
 #include "fs.hpp"
 #include "args.hpp"
+#include "filesystem.hpp"
+#include "fsck.hpp"
+
+// Image files always end in .bin
+static std::string image_name(std::string name)
+{
+    if (name.rfind(".bin") == std::string::npos)
+    {
+        name += ".bin";
+    }
+    return name;
+}
+
+// stoull would wrap a negative number around to a huge one, so those are turned away along with anything past max
+static tl::expected<uint64_t, std::string> parse_size(const std::string &option, const std::string &value, uint64_t max)
+{
+    size_t first = value.find_first_not_of(" \t\n\v\f\r");
+    if (first != std::string::npos && value[first] == '-')
+        return tl::make_unexpected(fmt::format("{} can't be negative", option));
+
+    uint64_t size = std::stoull(value);
+    if (size > max)
+        return tl::make_unexpected(fmt::format("{} can't be more than {}", option, max));
+    return size;
+}
+
+// Exit status is 0 for a clean filesystem, 1 if anything is wrong with it and 2 if it couldn't be checked
+static int check(args::ArgParser &parser)
+{
+    std::string fs_name = image_name(parser.value("filename"));
+
+    int jobs = std::stoi(parser.value("jobs"));
+    if (jobs < 0)
+    {
+        fmt::println("Number of jobs can't be negative");
+        return 2;
+    }
+
+    // nothing but the journal replay (if it needs one) should write to the image
+    MountOptions mount;
+    mount.read_only = true;
+    mount.readahead = 0;
+
+    Filesystem fs;
+    auto opened = fs.open(fs_name, mount);
+    if (!opened)
+    {
+        fmt::println("{}", opened.error());
+        return 2;
+    }
+
+    auto report = fsck(fs, jobs);
+    if (!report)
+    {
+        fmt::println("{}", report.error());
+        return 2;
+    }
+
+    for (const std::string &problem : report->problems)
+        fmt::println("{}", problem);
+
+    fmt::println("{}: {} inodes in use ({} directories), {} blocks in files, {} problems", fs_name,
+                 report->inodes_used, report->directories, report->blocks_used, report->problems.size());
+
+    auto closed = fs.close();
+    if (!closed)
+    {
+        fmt::println("{}", closed.error());
+        return 2;
+    }
+
+    return report->clean() ? 0 : 1;
+}
 
 int main(int argc, char **argv)
 {
     std::string help = "Usage: rush [OPTION]...\n"
+                       "       rush fsck [OPTION]...\n"
+                       "Makes a new filesystem, or checks an existing one with fsck\n"
                        "OPTIONS:\n"
                        "\t-f, --filename=file\n"
                        "\t\tSpecifies the name of the file to use as the filesystem, if it doesn't end in .bin, the extension will be added. Defaults to fs.bin\n"
@@ -17,7 +92,26 @@ int main(int argc, char **argv)
                        "\t-s, --fs_size\n"
                        "\t\tSets the total size of the filesystem, defaults to 1024 KiB\n"
                        "\t-i, --inode_ratio\n"
-                       "\t\tSets the ratio of bytes per inode, defaults to being 1024 bytes / inode";
+                       "\t\tSets the ratio of bytes per inode, defaults to being 1024 bytes / inode\n"
+                       "\t-j, --jobs\n"
+                       "\t\tNumber of threads used to format block groups, 0 uses one per core. Defaults to 1\n"
+                       "\t-l, --lazy_itable_init\n"
+                       "\t\tDon't zero inode tables while formatting, they get zeroed on first use instead\n"
+                       "\t-J, --journal_blocks\n"
+                       "\t\tSize of the metadata journal in blocks, 0 leaves it out. Defaults to a size picked from the filesystem size\n"
+                       "\t-p, --preallocate\n"
+                       "\t\tAllocate disk space for the whole image up front instead of leaving unused regions sparse\n"
+                       "\t--backend=pread|mmap|uring\n"
+                       "\t\tHow the image is accessed, through pread/pwrite, by mapping it into memory, or with batches\n"
+                       "\t\tof requests queued through io_uring. Defaults to pread";
+
+    std::string fsck_help = "Usage: rush fsck [OPTION]...\n"
+                            "Checks a filesystem for inconsistencies without changing it, apart from replaying its journal\n"
+                            "OPTIONS:\n"
+                            "\t-f, --filename=file\n"
+                            "\t\tFilesystem to check, if it doesn't end in .bin, the extension will be added. Defaults to fs.bin\n"
+                            "\t-j, --jobs\n"
+                            "\t\tNumber of threads scanning block groups, 0 uses one per core. Defaults to 0";
 
     args::ArgParser parser;
     parser.helptext = help;
@@ -25,26 +119,73 @@ int main(int argc, char **argv)
     parser.option("block_size b", "1024");
     parser.option("fs_size s", "1024");
     parser.option("inode_ratio i", "1024");
+    parser.option("jobs j", "1");
+    parser.flag("lazy_itable_init l");
+    parser.option("journal_blocks J", "auto");
+    parser.flag("preallocate p");
+    parser.option("backend", "pread");
+
+    args::ArgParser &fsck_parser = parser.command("fsck", fsck_help);
+    fsck_parser.option("filename f", "fs.bin");
+    fsck_parser.option("jobs j", "0");
 
     parser.parse(argc, argv);
 
+    if (parser.commandFound())
+        return check(parser.commandParser());
+
     std::string fs_name;
-    int block_size;
-    int fs_size;
-    int inode_ratio;
+    MkfsOptions opts;
 
-    fs_name = parser.value("filename");
+    fs_name = image_name(parser.value("filename"));
 
-    if (fs_name.rfind(".bin") == std::string::npos)
+    // fs_size is in KiB and gets turned into bytes
+    auto block_size = parse_size("Block size", parser.value("block_size"), UINT32_MAX);
+    auto fs_size = parse_size("Filesystem size", parser.value("fs_size"), UINT64_MAX / 1024);
+    auto inode_ratio = parse_size("Inode ratio", parser.value("inode_ratio"), UINT32_MAX);
+    for (auto *parsed : {&block_size, &fs_size, &inode_ratio})
     {
-        fs_name += ".bin";
+        if (!*parsed)
+        {
+            fmt::println("{}", parsed->error());
+            return 1;
+        }
     }
 
-    block_size = std::stoi(parser.value("block_size"));
-    fs_size = std::stoi(parser.value("fs_size"));
-    inode_ratio = std::stoi(parser.value("inode_ratio"));
+    opts.jobs = std::stoi(parser.value("jobs"));
+    if (opts.jobs < 0)
+    {
+        fmt::println("Number of jobs can't be negative");
+        return 1;
+    }
+    opts.lazy_itable_init = parser.found("lazy_itable_init");
+    opts.preallocate = parser.found("preallocate");
 
-    mkfs(fs_size, block_size, fs_name, inode_ratio)
-        .map_error([&](std::string s)
-                   { fmt::println("{}", s); });
+    std::string journal_blocks = parser.value("journal_blocks");
+    if (journal_blocks != "auto")
+    {
+        // one short of the most a uint32_t holds, that's JOURNAL_AUTO
+        auto parsed = parse_size("Journal size", journal_blocks, JOURNAL_AUTO - 1);
+        if (!parsed)
+        {
+            fmt::println("{}", parsed.error());
+            return 1;
+        }
+        opts.journal_blocks = *parsed;
+    }
+
+    auto backend = parse_backend(parser.value("backend"));
+    if (!backend)
+    {
+        fmt::println("{}", backend.error());
+        return 1;
+    }
+    opts.backend = *backend;
+
+    auto formatted = mkfs(*fs_size, *block_size, fs_name, *inode_ratio, opts);
+    if (!formatted)
+    {
+        fmt::println("{}", formatted.error());
+        return 1;
+    }
 }
\ No newline at end of file
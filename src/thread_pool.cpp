@@ -0,0 +1,69 @@
+#include <algorithm>
+
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(unsigned num_threads)
+{
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned i = 0; i < num_threads; i++)
+        threads.emplace_back(&ThreadPool::worker, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    work_cv.notify_all();
+
+    for (auto &t : threads)
+        t.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        tasks.push_back(std::move(task));
+    }
+    work_cv.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    done_cv.wait(lock, [this]
+                 { return tasks.empty() && active == 0; });
+}
+
+void ThreadPool::worker()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            work_cv.wait(lock, [this]
+                         { return stopping || !tasks.empty(); });
+
+            if (stopping && tasks.empty())
+                return;
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+            active++;
+        }
+
+        task();
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            active--;
+            if (tasks.empty() && active == 0)
+                done_cv.notify_all();
+        }
+    }
+}
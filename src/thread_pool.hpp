@@ -0,0 +1,43 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+    Fixed size pool of worker threads pulling tasks off a shared queue
+
+    Used for work that splits cleanly into independent pieces, like formatting
+    disjoint block groups with positional writes
+*/
+class ThreadPool
+{
+public:
+    // num_threads of 0 uses one thread per core
+    explicit ThreadPool(unsigned num_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    void submit(std::function<void()> task);
+
+    // Blocks until every submitted task has finished
+    void wait();
+
+    unsigned size() const { return threads.size(); }
+
+private:
+    void worker();
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mtx;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    unsigned active = 0;
+    bool stopping = false;
+};